@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midifanalyze.h"
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifiter.h"
+
+/* file-local miscellany */
+static PmError Mf_Analyze(MfStats *into, MfIter *iter);
+
+/* analyze a decoded file */
+PmError Mf_AnalyzeFile(MfStats *into, MfFile *file)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenFile(&iter, file))) return perr;
+    perr = Mf_Analyze(into, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+/* analyze a standard MIDI file in memory, without decoding it */
+PmError Mf_AnalyzeBuffer(MfStats *into, const unsigned char *buf, size_t length)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenBuffer(&iter, buf, length))) {
+        Mf_IterClose(&iter);
+        return perr;
+    }
+    perr = Mf_Analyze(into, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+static PmError Mf_Analyze(MfStats *into, MfIter *iter)
+{
+    MfIterEvent ev;
+    uint16_t sounding[16][128];
+    uint32_t polyphony = 0, tempo = 500000, lastTick = 0;
+    uint64_t elapsed = 0; /* microseconds * timeDivision */
+    uint8_t type, channel;
+
+    memset(into, 0, sizeof(MfStats));
+    memset(sounding, 0, sizeof(sounding));
+
+    while (Mf_IterNext(iter, &ev)) {
+        into->eventCount++;
+
+        /* keep track of time */
+        elapsed += (uint64_t) (ev.tick - lastTick) * tempo;
+        lastTick = ev.tick;
+
+        if (ev.status == MIDI_STATUS_META) {
+            if (ev.metaType == MIDI_M_TEMPO && ev.metaLength == MIDI_M_TEMPO_LENGTH) {
+                tempo = MIDI_M_TEMPO_N(ev.metaData);
+                if (into->tempoChanges == 0 || tempo < into->minTempo) into->minTempo = tempo;
+                if (into->tempoChanges == 0 || tempo > into->maxTempo) into->maxTempo = tempo;
+                into->tempoChanges++;
+            }
+            continue;
+        }
+        if (ev.status >= 0xF0) continue;
+
+        type = ev.status >> 4;
+        channel = ev.status & 0xF;
+        into->channelsUsed |= 1 << channel;
+
+        switch (type) {
+            case MIDI_NOTE_ON:
+                if (ev.data2) {
+                    into->noteCount++;
+                    into->channelNotes[channel]++;
+                    into->pitchHistogram[ev.data1 & 0x7F]++;
+                    into->velocityHistogram[ev.data2 & 0x7F]++;
+                    sounding[channel][ev.data1 & 0x7F]++;
+                    if (++polyphony > into->maxPolyphony) into->maxPolyphony = polyphony;
+                    break;
+                }
+                /* velocity 0 is a note off */
+                /* fall through */
+            case MIDI_NOTE_OFF:
+                if (sounding[channel][ev.data1 & 0x7F]) {
+                    sounding[channel][ev.data1 & 0x7F]--;
+                    polyphony--;
+                }
+                break;
+
+            case MIDI_PROGRAM_CHANGE:
+                into->programsUsed[channel][(ev.data1 & 0x7F) >> 3] |= 1 << (ev.data1 & 7);
+                break;
+        }
+    }
+
+    if (into->tempoChanges == 0) into->minTempo = into->maxTempo = 500000;
+    into->lengthTicks = lastTick;
+
+    if (iter->timeDivision & 0x8000) {
+        /* SMPTE: frames per second in the high byte, ticks per frame in the low */
+        int fps = -(int8_t) (iter->timeDivision >> 8);
+        double rate = (fps == 29) ? 29.97 : fps;
+        if (rate > 0 && (iter->timeDivision & 0xFF))
+            into->seconds = lastTick / (rate * (iter->timeDivision & 0xFF));
+    } else if (iter->timeDivision) {
+        into->seconds = (double) elapsed / iter->timeDivision / 1000000.0;
+    }
+
+    return iter->perr;
+}
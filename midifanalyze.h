@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFANALYZE_H
+#define MIDIFANALYZE_H
+
+#include "midifile.h"
+
+/* single-pass statistics over a whole MIDI file */
+
+/* types */
+typedef struct __MfStats MfStats;
+
+struct __MfStats {
+    uint32_t eventCount, noteCount;
+    uint32_t lengthTicks;
+    double seconds;
+    uint32_t maxPolyphony;
+
+    /* channel and program usage: channelsUsed is a mask of channels with any
+     * channel messages, programsUsed a 128-bit mask of programs per channel */
+    uint16_t channelsUsed;
+    uint8_t programsUsed[16][16];
+    uint32_t channelNotes[16];
+
+    /* histograms of note-on pitches and velocities */
+    uint32_t pitchHistogram[128];
+    uint32_t velocityHistogram[128];
+
+    /* tempo range, in microseconds per quarter note */
+    uint32_t tempoChanges, minTempo, maxTempo;
+};
+
+/* is this program used on this channel? */
+#define MF_STATS_PROGRAM_USED(stats, channel, program) \
+    ((stats)->programsUsed[(channel)][(program) >> 3] & (1 << ((program) & 7)))
+
+/* analyze a decoded file */
+PmError Mf_AnalyzeFile(MfStats *into, MfFile *file);
+
+/* analyze a standard MIDI file in memory, without decoding it */
+PmError Mf_AnalyzeBuffer(MfStats *into, const unsigned char *buf, size_t length);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* times writing and reading MIDI files in memory, e.g. to check changes to
+ * the encoder or decoder. Usage: midifbench [-n passes] [file.mid]; without a
+ * file, a dense generated file of channel messages is used. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifilealloc.h"
+
+static MfFile *generate(void);
+static double now(void);
+
+int main(int argc, char **argv)
+{
+    FILE *f;
+    MfFile *pf, *rf;
+    unsigned char *buf;
+    size_t length;
+    double start, writeTime, readTime;
+    int argi, passes = 200, i;
+    char *arg, *nextarg, *file = NULL;
+
+    for (argi = 1; argi < argc; argi++) {
+        arg = argv[argi];
+        nextarg = argv[argi+1];
+        if (!strcmp(arg, "-n") && nextarg) {
+            passes = atoi(nextarg);
+            argi++;
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "Use: midifbench [-n passes] [file.mid]\n");
+            exit(1);
+        } else {
+            file = arg;
+        }
+    }
+    if (passes < 1) passes = 1;
+
+    Mf_Initialize();
+
+    if (file) {
+        f = fopen(file, "rb");
+        if (f == NULL) {
+            perror(file);
+            exit(1);
+        }
+        if (Mf_ReadMidiFile(&pf, f) != pmNoError) {
+            fprintf(stderr, "%s: not a MIDI file\n", file);
+            exit(1);
+        }
+        fclose(f);
+    } else {
+        pf = generate();
+    }
+
+    /* writing */
+    buf = NULL;
+    start = now();
+    for (i = 0; i < passes; i++) {
+        if (buf) AL.free(buf);
+        Mf_WriteMidiBuffer(&buf, &length, pf);
+    }
+    writeTime = (now() - start) / passes;
+
+    /* reading */
+    start = now();
+    for (i = 0; i < passes; i++) {
+        Mf_ReadMidiBuffer(&rf, buf, length, 0);
+        Mf_FreeFile(rf);
+    }
+    readTime = (now() - start) / passes;
+
+    printf("%lu bytes, %d passes\n", (unsigned long) length, passes);
+    printf("write: %.3fms (%.1fMB/s)\n", writeTime * 1000, length / writeTime / 1000000);
+    printf("read:  %.3fms (%.1fMB/s)\n", readTime * 1000, length / readTime / 1000000);
+
+    AL.free(buf);
+    Mf_FreeFile(pf);
+    return 0;
+}
+
+/* a file of notes, controllers and pitch bend on every channel, mostly
+ * under running status, in 16 tracks */
+static MfFile *generate(void)
+{
+    MfFile *ret = Mf_NewFile(480);
+    MfTrack *track;
+    MfEvent *event;
+    int i, j, channel;
+    uint32_t seed = 1;
+
+    for (channel = 0; channel < 16; channel++) {
+        track = Mf_NewTrack(ret);
+        for (i = 0; i < 4000; i++) {
+            seed = seed * 1103515245 + 12345;
+            for (j = 0; j < 4; j++) {
+                event = Mf_NewEvent();
+                event->deltaTm = j ? 0 : (seed >> 16) % 30;
+                switch (j) {
+                    case 0:
+                        event->e.message = Pm_Message(Pm_MessageStatusGen(MIDI_NOTE_ON, channel), 36 + (seed >> 8) % 60, 1 + (seed >> 4) % 127);
+                        break;
+                    case 1:
+                        event->e.message = Pm_Message(Pm_MessageStatusGen(MIDI_CONTROLLER, channel), 1, i & 0x7F);
+                        break;
+                    case 2:
+                        event->e.message = Pm_Message(Pm_MessageStatusGen(MIDI_CONTROLLER, channel), 11, (i >> 1) & 0x7F);
+                        break;
+                    default:
+                        event->e.message = Pm_Message(Pm_MessageStatusGen(MIDI_PITCH_BEND, channel), i & 0x7F, (i >> 7) & 0x7F);
+                }
+                Mf_PushEvent(track, event);
+            }
+        }
+        event = Mf_NewEvent();
+        event->e.message = Pm_Message(MIDI_STATUS_META, 0, 0);
+        event->meta = Mf_NewMeta(0);
+        event->meta->type = MIDI_M_END;
+        Mf_PushEvent(track, event);
+    }
+    ret->format = 1;
+
+    return ret;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
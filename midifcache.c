@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "midifcache.h"
+
+#include "midifile.h"
+#include "midifilealloc.h"
+
+#define MF_CACHE_BUCKETS 256
+
+/* a cached file, which is also the handle given to users */
+struct __MfCacheEntry {
+    MfCacheEntry *hnext; /* hash chain */
+    MfCacheEntry *prev, *next; /* LRU list, most recently used first */
+    int linked; /* still findable in the cache? */
+
+    /* the key */
+    char *path;
+    time_t mtime;
+    off_t size;
+    uint32_t hash;
+
+    /* and the value */
+    MfFile *file;
+    size_t footprint;
+    int refs, loading;
+    PmError perr;
+};
+
+struct __MfCache {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    MfCacheEntry *buckets[MF_CACHE_BUCKETS];
+    MfCacheEntry *lruHead, *lruTail;
+    MfCacheStats stats;
+};
+
+/* file-local miscellany */
+static uint32_t Mf_CacheHash(const char *path, time_t mtime);
+static MfCacheEntry *Mf_CacheFind(MfCache *cache, uint32_t hash, const char *path, struct stat *sbuf);
+static void Mf_CacheLink(MfCache *cache, MfCacheEntry *entry);
+static void Mf_CacheUnlink(MfCache *cache, MfCacheEntry *entry);
+static void Mf_CacheTouch(MfCache *cache, MfCacheEntry *entry);
+static void Mf_CacheEvict(MfCache *cache);
+static void Mf_FreeCacheEntry(MfCacheEntry *entry);
+
+/* create a cache which will try to stay within budget bytes of decoded files */
+MfCache *Mf_NewCache(size_t budget)
+{
+    MfCache *ret = Mf_New(MfCache);
+    pthread_mutex_init(&ret->lock, NULL);
+    pthread_cond_init(&ret->loaded, NULL);
+    ret->stats.budget = budget;
+    return ret;
+}
+
+/* free a cache; every handle must have been released */
+void Mf_FreeCache(MfCache *cache)
+{
+    MfCacheEntry *entry, *next;
+
+    for (entry = cache->lruHead; entry; entry = next) {
+        next = entry->next;
+        Mf_FreeCacheEntry(entry);
+    }
+
+    pthread_cond_destroy(&cache->loaded);
+    pthread_mutex_destroy(&cache->lock);
+    AL.free(cache);
+}
+
+/* change the cache's budget, evicting as necessary */
+void Mf_CacheSetBudget(MfCache *cache, size_t budget)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->stats.budget = budget;
+    Mf_CacheEvict(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* get a handle to the decoded file at this path, loading it if necessary */
+PmError Mf_CacheLoad(MfCache *cache, MfCacheEntry **handle, const char *path)
+{
+    struct stat sbuf;
+    uint32_t hash;
+    MfCacheEntry *entry;
+    MfFile *file;
+    FILE *f;
+    PmError perr;
+
+    if (stat(path, &sbuf) != 0) return pmHostError;
+    hash = Mf_CacheHash(path, sbuf.st_mtime);
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = Mf_CacheFind(cache, hash, path, &sbuf);
+    if (entry) {
+        /* somebody has it or is getting it */
+        entry->refs++;
+        cache->stats.hits++;
+        if (entry->loading) {
+            cache->stats.coalesced++;
+            while (entry->loading) pthread_cond_wait(&cache->loaded, &cache->lock);
+        }
+
+        perr = entry->perr;
+        if (perr) {
+            /* their load failed, so ours did too */
+            if (--entry->refs == 0) Mf_FreeCacheEntry(entry);
+            pthread_mutex_unlock(&cache->lock);
+            return perr;
+        }
+
+        Mf_CacheTouch(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+        *handle = entry;
+        return pmNoError;
+    }
+
+    /* it's ours to load, so put a placeholder in for anyone else who wants it */
+    cache->stats.misses++;
+    entry = Mf_New(MfCacheEntry);
+    entry->path = Mf_Malloc(strlen(path) + 1);
+    strcpy(entry->path, path);
+    entry->mtime = sbuf.st_mtime;
+    entry->size = sbuf.st_size;
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->loading = 1;
+    Mf_CacheLink(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+
+    /* then load it without the lock held */
+    file = NULL;
+    f = fopen(path, "rb");
+    if (f) {
+        perr = Mf_ReadMidiFile(&file, f);
+        fclose(f);
+        if (perr && file) {
+            Mf_FreeFile(file);
+            file = NULL;
+        }
+    } else {
+        perr = pmHostError;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    entry->loading = 0;
+    entry->perr = perr;
+    if (perr) {
+        /* don't keep failures around, the next load should retry */
+        Mf_CacheUnlink(cache, entry);
+        entry->refs--;
+        pthread_cond_broadcast(&cache->loaded);
+        if (entry->refs == 0) Mf_FreeCacheEntry(entry);
+        pthread_mutex_unlock(&cache->lock);
+        return perr;
+    }
+
+    entry->file = file;
+    entry->footprint = Mf_GetFileFootprint(file);
+    cache->stats.bytes += entry->footprint;
+    pthread_cond_broadcast(&cache->loaded);
+    Mf_CacheEvict(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    *handle = entry;
+    return pmNoError;
+}
+
+/* get the (shared, immutable) file behind a handle */
+MfFile *Mf_CacheFile(MfCacheEntry *handle)
+{
+    return handle->file;
+}
+
+/* release a handle gotten from Mf_CacheLoad */
+void Mf_CacheRelease(MfCache *cache, MfCacheEntry *handle)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (--handle->refs == 0) {
+        if (handle->linked) {
+            /* it may have been pinned over budget */
+            Mf_CacheEvict(cache);
+        } else {
+            Mf_FreeCacheEntry(handle);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* get the cache's current statistics */
+void Mf_CacheGetStats(MfCache *cache, MfCacheStats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static uint32_t Mf_CacheHash(const char *path, time_t mtime)
+{
+    /* FNV-1a over the path, then the mtime */
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (; *path; path++) {
+        hash ^= (unsigned char) *path;
+        hash *= 16777619u;
+    }
+    for (i = 0; i < (int) sizeof(time_t); i++) {
+        hash ^= (uint32_t) (mtime >> (i * 8)) & 0xFF;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static MfCacheEntry *Mf_CacheFind(MfCache *cache, uint32_t hash, const char *path, struct stat *sbuf)
+{
+    MfCacheEntry *entry;
+
+    for (entry = cache->buckets[hash % MF_CACHE_BUCKETS]; entry; entry = entry->hnext) {
+        if (entry->hash == hash &&
+            entry->mtime == sbuf->st_mtime &&
+            entry->size == sbuf->st_size &&
+            !strcmp(entry->path, path))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* add an entry to the hash table and the front of the LRU list */
+static void Mf_CacheLink(MfCache *cache, MfCacheEntry *entry)
+{
+    MfCacheEntry **bucket = &cache->buckets[entry->hash % MF_CACHE_BUCKETS];
+
+    entry->hnext = *bucket;
+    *bucket = entry;
+
+    entry->prev = NULL;
+    entry->next = cache->lruHead;
+    if (cache->lruHead) cache->lruHead->prev = entry;
+    else cache->lruTail = entry;
+    cache->lruHead = entry;
+
+    entry->linked = 1;
+    cache->stats.entries++;
+}
+
+/* remove an entry from the hash table and LRU list (but don't free it) */
+static void Mf_CacheUnlink(MfCache *cache, MfCacheEntry *entry)
+{
+    MfCacheEntry **pentry = &cache->buckets[entry->hash % MF_CACHE_BUCKETS];
+
+    while (*pentry != entry) pentry = &(*pentry)->hnext;
+    *pentry = entry->hnext;
+
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache->lruHead = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache->lruTail = entry->prev;
+    entry->prev = entry->next = entry->hnext = NULL;
+
+    entry->linked = 0;
+    cache->stats.entries--;
+    if (entry->file) cache->stats.bytes -= entry->footprint;
+}
+
+/* move an entry to the front of the LRU list */
+static void Mf_CacheTouch(MfCache *cache, MfCacheEntry *entry)
+{
+    if (cache->lruHead == entry) return;
+
+    entry->prev->next = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache->lruTail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = cache->lruHead;
+    cache->lruHead->prev = entry;
+    cache->lruHead = entry;
+}
+
+/* evict least-recently-used entries until we're within budget. Entries in use
+ * are pinned, so the cache may stay over budget until they're released. */
+static void Mf_CacheEvict(MfCache *cache)
+{
+    MfCacheEntry *entry, *prev;
+
+    for (entry = cache->lruTail;
+         entry && cache->stats.bytes > cache->stats.budget;
+         entry = prev) {
+        prev = entry->prev;
+        if (entry->refs || entry->loading) continue;
+        Mf_CacheUnlink(cache, entry);
+        Mf_FreeCacheEntry(entry);
+        cache->stats.evictions++;
+    }
+}
+
+static void Mf_FreeCacheEntry(MfCacheEntry *entry)
+{
+    if (entry->file) Mf_FreeFile(entry->file);
+    AL.free(entry->path);
+    AL.free(entry);
+}
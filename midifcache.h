@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFCACHE_H
+#define MIDIFCACHE_H
+
+#include "midifile.h"
+
+/* A thread-safe cache of decoded MIDI files, keyed by path and modification
+ * time. Files handed out by the cache are shared between every user of the
+ * same key, so they must be treated as immutable: don't modify them, don't
+ * free them, and don't consume them with a stream. */
+
+/* types */
+typedef struct __MfCache MfCache;
+typedef struct __MfCacheEntry MfCacheEntry;
+typedef struct __MfCacheStats MfCacheStats;
+
+/* statistics, as returned by Mf_CacheGetStats */
+struct __MfCacheStats {
+    uint64_t hits, misses, evictions;
+    uint64_t coalesced; /* hits which waited for another thread's load */
+    size_t bytes, budget;
+    uint32_t entries;
+};
+
+/* create a cache which will try to stay within budget bytes of decoded files */
+MfCache *Mf_NewCache(size_t budget);
+
+/* free a cache; every handle must have been released */
+void Mf_FreeCache(MfCache *cache);
+
+/* change the cache's budget, evicting as necessary */
+void Mf_CacheSetBudget(MfCache *cache, size_t budget);
+
+/* get a handle to the decoded file at this path, loading it if necessary.
+ * Concurrent loads of the same file are coalesced into a single decode. */
+PmError Mf_CacheLoad(MfCache *cache, MfCacheEntry **handle, const char *path);
+
+/* get the (shared, immutable) file behind a handle */
+MfFile *Mf_CacheFile(MfCacheEntry *handle);
+
+/* release a handle gotten from Mf_CacheLoad */
+void Mf_CacheRelease(MfCache *cache, MfCacheEntry *handle);
+
+/* get the cache's current statistics */
+void Mf_CacheGetStats(MfCache *cache, MfCacheStats *stats);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFCODEC_H
+#define MIDIFCODEC_H
+
+/* this is an internal header */
+#include <stdint.h>
+#include <stdio.h>
+
+#include "midifile.h"
+
+/* what each status byte is, for decoding and encoding events */
+#define MF_KIND_DATA        0 /* not a status byte (so running status) */
+#define MF_KIND_CHANNEL     1 /* channel message, with dataLength data bytes */
+#define MF_KIND_SYSEX       2 /* F0 or F7, followed by a length and data */
+#define MF_KIND_META        3 /* FF, followed by a type, a length and data */
+#define MF_KIND_INVALID     4 /* system common and real-time, not in files */
+
+typedef struct __MfStatusInfo MfStatusInfo;
+struct __MfStatusInfo {
+    uint8_t kind;
+    uint8_t dataLength;
+    uint8_t running; /* may be omitted when repeated (running status) */
+};
+extern const MfStatusInfo Mf_StatusTable[256];
+
+/* what can be left out of a controller's messages without changing what they
+ * mean, for optimizing output */
+#define MF_CC_EVERY         0 /* nothing, since every message counts */
+#define MF_CC_SWITCH        1 /* a value repeated */
+#define MF_CC_CONTINUOUS    2 /* a value repeated or soon replaced */
+extern const uint8_t Mf_ControllerTable[128];
+
+/* encode one event (with its delta time) into a stdio file, using and
+ * updating the running status in *pstatus. The number of bytes written is
+ * stored in *sz. */
+PmError Mf_EncodeMidiEvent(FILE *into, MfEvent *event, uint8_t *pstatus, uint32_t *sz);
+
+#endif
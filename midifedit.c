@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midifedit.h"
+
+#include "midi.h"
+#include "midifile.h"
+
+/* file-local miscellany */
+static void Mf_ExtractTrack(MfTrack *into, MfTrack *from, uint32_t startTm, uint32_t endTm);
+static void Mf_PushEventAt(MfTrack *track, MfEvent *event, uint32_t tm);
+static void Mf_PushMessageAt(MfTrack *track, uint32_t tm, uint8_t status, uint8_t data1, uint8_t data2);
+
+/* meta-events whose latest value is chased to the start of the region */
+#define CHASED_META(type) ((type) == MIDI_M_NAME || \
+                           (type) == MIDI_M_TEMPO || \
+                           (type) == MIDI_M_TIME_SIGNATURE || \
+                           (type) == MIDI_M_KEY_SIGNATURE)
+#define CHASED_METAS 4
+
+/* extract the region [startTm, endTm) of a file into a new file */
+MfFile *Mf_ExtractRange(MfFile *file, uint32_t startTm, uint32_t endTm)
+{
+    MfFile *ret = Mf_NewFileCtx(file->ctx, file->timeDivision);
+    int i;
+
+    ret->format = file->format;
+    for (i = 0; i < file->trackCt; i++) {
+        Mf_ExtractTrack(Mf_NewTrack(ret), file->tracks[i], startTm, endTm);
+    }
+
+    return ret;
+}
+
+static void Mf_ExtractTrack(MfTrack *into, MfTrack *from, uint32_t startTm, uint32_t endTm)
+{
+    MfEvent *event, *chasedMeta[CHASED_METAS];
+    MfWalk walk;
+    int16_t program[16], pressure[16], bend[16], controller[16][128];
+    uint16_t sounding[16][128];
+    uint8_t status, type, channel, data1, data2;
+    int i, j;
+    uint32_t length = endTm - startTm;
+
+    memset(chasedMeta, 0, sizeof(chasedMeta));
+    memset(program, 0xFF, sizeof(program));
+    memset(pressure, 0xFF, sizeof(pressure));
+    memset(bend, 0xFF, sizeof(bend));
+    memset(controller, 0xFF, sizeof(controller));
+    memset(sounding, 0, sizeof(sounding));
+
+    /* chase state up to the start (with any patterns expanded) */
+    Mf_WalkTrack(&walk, from);
+    for (event = Mf_WalkNext(&walk); event && walk.tick < startTm; event = Mf_WalkNext(&walk)) {
+        status = Pm_MessageStatus(event->e.message);
+        data1 = Pm_MessageData1(event->e.message) & 0x7F;
+        data2 = Pm_MessageData2(event->e.message) & 0x7F;
+        type = status >> 4;
+        channel = status & 0xF;
+
+        if (event->meta) {
+            if (status == MIDI_STATUS_META && CHASED_META(event->meta->type)) {
+                switch (event->meta->type) {
+                    case MIDI_M_NAME:           chasedMeta[0] = event; break;
+                    case MIDI_M_TEMPO:          chasedMeta[1] = event; break;
+                    case MIDI_M_TIME_SIGNATURE: chasedMeta[2] = event; break;
+                    case MIDI_M_KEY_SIGNATURE:  chasedMeta[3] = event; break;
+                }
+            }
+            continue;
+        }
+
+        switch (type) {
+            case MIDI_CONTROLLER:           controller[channel][data1] = data2; break;
+            case MIDI_PROGRAM_CHANGE:       program[channel] = data1; break;
+            case MIDI_CHANNEL_AFTERTOUCH:   pressure[channel] = data1; break;
+            case MIDI_PITCH_BEND:           bend[channel] = (data2 << 7) + data1; break;
+        }
+    }
+
+    /* then write out the chased state at the start */
+    for (i = 0; i < CHASED_METAS; i++) {
+        if (chasedMeta[i]) Mf_PushEventAt(into, Mf_CopyEventCtx(into->ctx, chasedMeta[i]), 0);
+    }
+    for (i = 0; i < 16; i++) {
+        /* bank select has to come before the program change */
+        if (controller[i][0] >= 0)
+            Mf_PushMessageAt(into, 0, Pm_MessageStatusGen(MIDI_CONTROLLER, i), 0, controller[i][0]);
+        if (controller[i][32] >= 0)
+            Mf_PushMessageAt(into, 0, Pm_MessageStatusGen(MIDI_CONTROLLER, i), 32, controller[i][32]);
+        if (program[i] >= 0)
+            Mf_PushMessageAt(into, 0, Pm_MessageStatusGen(MIDI_PROGRAM_CHANGE, i), program[i], 0);
+        for (j = 1; j < 128; j++) {
+            if (j == 32 || controller[i][j] < 0) continue;
+            Mf_PushMessageAt(into, 0, Pm_MessageStatusGen(MIDI_CONTROLLER, i), j, controller[i][j]);
+        }
+        if (pressure[i] >= 0)
+            Mf_PushMessageAt(into, 0, Pm_MessageStatusGen(MIDI_CHANNEL_AFTERTOUCH, i), pressure[i], 0);
+        if (bend[i] >= 0)
+            Mf_PushMessageAt(into, 0, Pm_MessageStatusGen(MIDI_PITCH_BEND, i), bend[i] & 0x7F, bend[i] >> 7);
+    }
+
+    /* copy the region itself */
+    for (; event && walk.tick < endTm; event = Mf_WalkNext(&walk)) {
+        status = Pm_MessageStatus(event->e.message);
+        data1 = Pm_MessageData1(event->e.message) & 0x7F;
+        data2 = Pm_MessageData2(event->e.message);
+        type = status >> 4;
+        channel = status & 0xF;
+
+        /* we add our own end of track */
+        if (event->meta && status == MIDI_STATUS_META && event->meta->type == MIDI_M_END) continue;
+
+        if (!event->meta) {
+            if (type == MIDI_NOTE_ON && data2) {
+                sounding[channel][data1]++;
+            } else if (type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF) {
+                /* drop note-offs for notes started before the region */
+                if (!sounding[channel][data1]) continue;
+                sounding[channel][data1]--;
+            }
+        }
+
+        Mf_PushEventAt(into, Mf_CopyEventCtx(into->ctx, event), walk.tick - startTm);
+    }
+
+    /* close anything still sounding */
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 128; j++) {
+            while (sounding[i][j]) {
+                Mf_PushMessageAt(into, length, Pm_MessageStatusGen(MIDI_NOTE_OFF, i), j, 0);
+                sounding[i][j]--;
+            }
+        }
+    }
+
+    /* and end the track */
+    event = Mf_NewEventCtx(into->ctx);
+    event->e.message = Pm_Message(MIDI_STATUS_META, 0, 0);
+    event->meta = Mf_NewMetaCtx(into->ctx, 0);
+    event->meta->type = MIDI_M_END;
+    Mf_PushEventAt(into, event, length);
+}
+
+/* push an event at an absolute time (which must not be before the tail) */
+static void Mf_PushEventAt(MfTrack *track, MfEvent *event, uint32_t tm)
+{
+    event->deltaTm = tm - (track->tail ? track->tail->absoluteTm : 0);
+    Mf_PushEvent(track, event);
+}
+
+static void Mf_PushMessageAt(MfTrack *track, uint32_t tm, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    MfEvent *event = Mf_NewEventCtx(track->ctx);
+    event->e.message = Pm_Message(status, data1, data2);
+    Mf_PushEventAt(track, event, tm);
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midifexport.h"
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifilealloc.h"
+#include "midifiter.h"
+#include "midifload.h"
+
+#define CHUNK_ROWS  1024 /* rows buffered before being written out */
+#define NPY_HEADER  128 /* fixed, so it can be rewritten with the final shape */
+#define OPEN_DEPTH  4 /* overlapping notes remembered per channel and key */
+
+/* the columns */
+enum {
+    COL_FILE, COL_TICK, COL_SECONDS, COL_TRACK, COL_CHANNEL, COL_TYPE,
+    COL_DATA1, COL_DATA2, COL_END_TICK, COL_END_SECONDS, COLUMNS
+};
+static const char *columnNames[COLUMNS] = {
+    "file", "tick", "seconds", "track", "channel", "type",
+    "data1", "data2", "endTick", "endSeconds"
+};
+static const char *columnTypes[COLUMNS] = {
+    "u4", "u4", "f8", "u2", "u1", "u1", "u1", "u1", "u4", "f8"
+};
+static const size_t columnSizes[COLUMNS] = {
+    4, 4, 8, 2, 1, 1, 1, 1, 4, 8
+};
+
+struct __MfExport {
+    int flags, columnCt;
+    FILE *fh[COLUMNS];
+    uint64_t rows;
+    pthread_mutex_t lock;
+    PmError perr;
+
+    /* files in a corpus which couldn't be decoded */
+    uint32_t failed;
+};
+
+/* rows being built by one call, written out together */
+typedef struct __MfExportChunk MfExportChunk;
+struct __MfExportChunk {
+    uint32_t rows;
+    uint32_t file[CHUNK_ROWS], tick[CHUNK_ROWS], endTick[CHUNK_ROWS];
+    double seconds[CHUNK_ROWS], endSeconds[CHUNK_ROWS];
+    uint16_t track[CHUNK_ROWS];
+    uint8_t channel[CHUNK_ROWS], type[CHUNK_ROWS], data1[CHUNK_ROWS], data2[CHUNK_ROWS];
+};
+
+/* a note waiting for its end */
+typedef struct __MfExportNote MfExportNote;
+struct __MfExportNote {
+    uint32_t tick;
+    double seconds;
+    uint16_t track;
+    uint8_t velocity;
+};
+
+/* the state of exporting one file */
+typedef struct __MfExportState MfExportState;
+struct __MfExportState {
+    MfExport *ex;
+    MfExportChunk chunk;
+    uint32_t fileIndex;
+
+    /* time */
+    uint16_t timeDivision;
+    uint32_t tempo, lastTick;
+    uint64_t elapsed; /* microseconds * timeDivision */
+    double seconds;
+
+    /* open notes, oldest first */
+    uint8_t openCt[16][128];
+    MfExportNote open[16][128][OPEN_DEPTH];
+};
+
+/* file-local miscellany */
+static PmError Mf_Export(MfExport *ex, uint32_t fileIndex, MfIter *iter);
+static void Mf_ExportTime(MfExportState *st, uint32_t tick);
+static void Mf_ExportRow(MfExportState *st, uint32_t tick, double seconds, uint32_t endTick, double endSeconds,
+                         uint16_t track, uint8_t channel, uint8_t type, uint8_t data1, uint8_t data2);
+static void Mf_ExportCloseNote(MfExportState *st, uint8_t channel, uint8_t key);
+static void Mf_ExportFlush(MfExportState *st);
+static void Mf_ExportHeader(MfExport *ex, int col);
+static void Mf_ExportCorpusFile(void *vex, int worker, uint32_t index, unsigned char *buf, size_t length);
+
+/* start exporting */
+MfExport *Mf_OpenExport(const char *prefix, int flags)
+{
+    MfExport *ret = Mf_New(MfExport);
+    char *path = Mf_Malloc(strlen(prefix) + 16);
+    int i;
+
+    ret->flags = flags;
+    ret->columnCt = (flags & MF_EXPORT_NOTES) ? COLUMNS : COL_END_TICK;
+    pthread_mutex_init(&ret->lock, NULL);
+
+    for (i = 0; i < ret->columnCt; i++) {
+        sprintf(path, "%s%s.npy", prefix, columnNames[i]);
+        ret->fh[i] = fopen(path, "w+b");
+        if (!ret->fh[i]) {
+            ret->perr = pmHostError;
+            continue;
+        }
+        Mf_ExportHeader(ret, i);
+    }
+
+    AL.free(path);
+    return ret;
+}
+
+/* export a standard MIDI file in memory */
+PmError Mf_ExportBuffer(MfExport *ex, uint32_t fileIndex, const unsigned char *buf, size_t length)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenBuffer(&iter, buf, length))) {
+        Mf_IterClose(&iter);
+        return perr;
+    }
+    perr = Mf_Export(ex, fileIndex, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+/* export a decoded file */
+PmError Mf_ExportFile(MfExport *ex, uint32_t fileIndex, MfFile *file)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenFile(&iter, file))) return perr;
+    perr = Mf_Export(ex, fileIndex, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+/* finish exporting */
+PmError Mf_CloseExport(MfExport *ex)
+{
+    PmError perr;
+    int i;
+
+    for (i = 0; i < ex->columnCt; i++) {
+        if (!ex->fh[i]) continue;
+        Mf_ExportHeader(ex, i);
+        if (fclose(ex->fh[i])) ex->perr = pmHostError;
+    }
+
+    perr = ex->perr;
+    pthread_mutex_destroy(&ex->lock);
+    AL.free(ex);
+    return perr;
+}
+
+/* export a whole corpus in parallel */
+PmError Mf_ExportCorpus(const char *prefix, int flags, const char **paths, uint32_t count, int threads)
+{
+    MfExport *ex = Mf_OpenExport(prefix, flags);
+    uint32_t loaded, failed;
+    PmError perr;
+
+    loaded = Mf_LoadCorpus(paths, count, threads, Mf_ExportCorpusFile, ex);
+    failed = ex->failed;
+    perr = Mf_CloseExport(ex);
+    if (!perr && (loaded < count || failed)) perr = pmBadData;
+    return perr;
+}
+
+static void Mf_ExportCorpusFile(void *vex, int worker, uint32_t index, unsigned char *buf, size_t length)
+{
+    MfExport *ex = (MfExport *) vex;
+
+    if (Mf_ExportBuffer(ex, index, buf, length)) {
+        pthread_mutex_lock(&ex->lock);
+        ex->failed++;
+        pthread_mutex_unlock(&ex->lock);
+    }
+}
+
+static PmError Mf_Export(MfExport *ex, uint32_t fileIndex, MfIter *iter)
+{
+    MfExportState *st = Mf_Malloc(sizeof(MfExportState));
+    MfIterEvent ev;
+    PmError perr;
+    uint8_t type, channel, key;
+    int notes = ex->flags & MF_EXPORT_NOTES;
+    MfExportNote *note;
+
+    st->ex = ex;
+    st->chunk.rows = 0;
+    st->fileIndex = fileIndex;
+    st->timeDivision = iter->timeDivision;
+    st->tempo = 500000;
+    st->lastTick = 0;
+    st->elapsed = 0;
+    st->seconds = 0;
+    memset(st->openCt, 0, sizeof(st->openCt));
+
+    while (Mf_IterNext(iter, &ev)) {
+        Mf_ExportTime(st, ev.tick);
+
+        if (ev.status == MIDI_STATUS_META && ev.metaType == MIDI_M_TEMPO &&
+            ev.metaLength == MIDI_M_TEMPO_LENGTH) {
+            st->tempo = MIDI_M_TEMPO_N(ev.metaData);
+        }
+
+        if (ev.status >= 0xF0) {
+            /* meta-events and SysEx */
+            if (!notes && !(ex->flags & MF_EXPORT_CHANNEL))
+                Mf_ExportRow(st, ev.tick, st->seconds, ev.tick, st->seconds, ev.track, 0, ev.status,
+                             (ev.status == MIDI_STATUS_META) ? ev.metaType : 0, 0);
+            continue;
+        }
+
+        type = ev.status >> 4;
+        channel = ev.status & 0xF;
+        if (!notes) {
+            Mf_ExportRow(st, ev.tick, st->seconds, ev.tick, st->seconds, ev.track, channel, type, ev.data1, ev.data2);
+            continue;
+        }
+
+        /* pair up notes */
+        key = ev.data1 & 0x7F;
+        if (type == MIDI_NOTE_ON && ev.data2) {
+            if (st->openCt[channel][key] == OPEN_DEPTH) Mf_ExportCloseNote(st, channel, key);
+            note = &st->open[channel][key][st->openCt[channel][key]++];
+            note->tick = ev.tick;
+            note->seconds = st->seconds;
+            note->track = ev.track;
+            note->velocity = ev.data2 & 0x7F;
+        } else if ((type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF) && st->openCt[channel][key]) {
+            Mf_ExportCloseNote(st, channel, key);
+        }
+    }
+
+    /* anything still sounding ends at the end */
+    if (notes) {
+        for (channel = 0; channel < 16; channel++) {
+            for (key = 0; key < 128; key++) {
+                while (st->openCt[channel][key]) Mf_ExportCloseNote(st, channel, key);
+            }
+        }
+    }
+
+    Mf_ExportFlush(st);
+    perr = iter->perr;
+    AL.free(st);
+    return perr;
+}
+
+/* bring the time up to this tick */
+static void Mf_ExportTime(MfExportState *st, uint32_t tick)
+{
+    uint16_t div = st->timeDivision;
+
+    st->elapsed += (uint64_t) (tick - st->lastTick) * st->tempo;
+    st->lastTick = tick;
+
+    if (div & 0x8000) {
+        /* SMPTE: frames per second in the high byte, ticks per frame in the low */
+        int fps = -(int8_t) (div >> 8);
+        double rate = (fps == 29) ? 29.97 : fps;
+        if (rate > 0 && (div & 0xFF)) st->seconds = tick / (rate * (div & 0xFF));
+    } else if (div) {
+        st->seconds = (double) st->elapsed / div / 1000000.0;
+    }
+}
+
+static void Mf_ExportRow(MfExportState *st, uint32_t tick, double seconds, uint32_t endTick, double endSeconds,
+                         uint16_t track, uint8_t channel, uint8_t type, uint8_t data1, uint8_t data2)
+{
+    MfExportChunk *chunk = &st->chunk;
+    uint32_t r = chunk->rows;
+
+    chunk->file[r] = st->fileIndex;
+    chunk->tick[r] = tick;
+    chunk->seconds[r] = seconds;
+    chunk->track[r] = track;
+    chunk->channel[r] = channel;
+    chunk->type[r] = type;
+    chunk->data1[r] = data1;
+    chunk->data2[r] = data2;
+    chunk->endTick[r] = endTick;
+    chunk->endSeconds[r] = endSeconds;
+
+    if (++chunk->rows == CHUNK_ROWS) Mf_ExportFlush(st);
+}
+
+/* end the oldest open note on this channel and key, now */
+static void Mf_ExportCloseNote(MfExportState *st, uint8_t channel, uint8_t key)
+{
+    MfExportNote *open = st->open[channel][key];
+
+    Mf_ExportRow(st, open->tick, open->seconds, st->lastTick, st->seconds,
+                 open->track, channel, MIDI_NOTE_ON, key, open->velocity);
+
+    memmove(open, open + 1, (--st->openCt[channel][key]) * sizeof(MfExportNote));
+}
+
+/* write out the buffered rows */
+static void Mf_ExportFlush(MfExportState *st)
+{
+    MfExport *ex = st->ex;
+    MfExportChunk *chunk = &st->chunk;
+    void *columns[COLUMNS];
+    int i;
+
+    if (!chunk->rows) return;
+
+    columns[COL_FILE] = chunk->file;
+    columns[COL_TICK] = chunk->tick;
+    columns[COL_SECONDS] = chunk->seconds;
+    columns[COL_TRACK] = chunk->track;
+    columns[COL_CHANNEL] = chunk->channel;
+    columns[COL_TYPE] = chunk->type;
+    columns[COL_DATA1] = chunk->data1;
+    columns[COL_DATA2] = chunk->data2;
+    columns[COL_END_TICK] = chunk->endTick;
+    columns[COL_END_SECONDS] = chunk->endSeconds;
+
+    pthread_mutex_lock(&ex->lock);
+    for (i = 0; i < ex->columnCt; i++) {
+        if (!ex->fh[i]) continue;
+        if (fwrite(columns[i], columnSizes[i], chunk->rows, ex->fh[i]) != chunk->rows) ex->perr = pmHostError;
+    }
+    ex->rows += chunk->rows;
+    pthread_mutex_unlock(&ex->lock);
+
+    chunk->rows = 0;
+}
+
+/* (re)write a column's .npy header, leaving the file positioned at the end */
+static void Mf_ExportHeader(MfExport *ex, int col)
+{
+    char header[NPY_HEADER + 1];
+    const char *type = columnTypes[col];
+    uint16_t one = 1;
+    char order;
+    int len;
+
+    /* single bytes have no order, otherwise it's ours */
+    if (type[1] == '1') order = '|';
+    else order = (*(unsigned char *) &one) ? '<' : '>';
+
+    memset(header, ' ', NPY_HEADER);
+    memcpy(header, "\x93NUMPY\x01\x00", 8);
+    header[8] = (NPY_HEADER - 10) & 0xFF;
+    header[9] = (NPY_HEADER - 10) >> 8;
+    len = sprintf(header + 10, "{'descr': '%c%s', 'fortran_order': False, 'shape': (%llu,), }",
+                  order, type, (unsigned long long) ex->rows);
+    header[10 + len] = ' ';
+    header[NPY_HEADER - 1] = '\n';
+
+    fseek(ex->fh[col], 0, SEEK_SET);
+    if (fwrite(header, 1, NPY_HEADER, ex->fh[col]) != NPY_HEADER) ex->perr = pmHostError;
+    fseek(ex->fh[col], 0, SEEK_END);
+}
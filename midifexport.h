@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFEXPORT_H
+#define MIDIFEXPORT_H
+
+#include "midifile.h"
+
+/* Columnar export of events or notes, as one NumPy .npy array per column:
+ * file (uint32, the index given for each file), tick (uint32), seconds
+ * (float64), track (uint16), channel, type, data1 and data2 (uint8). For
+ * events, type is the high nibble of a channel message's status, or the
+ * status itself (0xF0, 0xF7 or 0xFF) for SysEx and meta-events, whose data1 is
+ * the meta type. For notes, type is always 9, data1 is the key, data2 the
+ * velocity, and there are two more columns, endTick and endSeconds; notes are
+ * written in the order they end.
+ *
+ * Rows are written out as they're made through a small buffer, so memory use
+ * is bounded however much is exported, and the arrays' headers are fixed up
+ * on close. Several threads may export into one MfExport at once. */
+
+/* types */
+typedef struct __MfExport MfExport;
+
+#define MF_EXPORT_NOTES     1 /* paired notes instead of events */
+#define MF_EXPORT_CHANNEL   2 /* only channel messages (for events) */
+
+/* start exporting into files named <prefix><column>.npy */
+MfExport *Mf_OpenExport(const char *prefix, int flags);
+
+/* export a standard MIDI file in memory (without decoding it), or a decoded
+ * file. If a file turns out to be bad part way through, this returns
+ * pmBadData, but the rows made before that have already been written, so its
+ * rows may be partial. */
+PmError Mf_ExportBuffer(MfExport *ex, uint32_t fileIndex, const unsigned char *buf, size_t length);
+PmError Mf_ExportFile(MfExport *ex, uint32_t fileIndex, MfFile *file);
+
+/* finish exporting, returning any error from along the way */
+PmError Mf_CloseExport(MfExport *ex);
+
+/* export a whole corpus of files using up to threads threads. Each file's
+ * index is its position in paths. Files which can't be read are skipped, and
+ * so are files which can't be decoded, although they may have partial rows.
+ * In either case everything else is still exported, and pmBadData is
+ * returned, unless there was a worse error. */
+PmError Mf_ExportCorpus(const char *prefix, int flags, const char **paths, uint32_t count, int threads);
+
+#endif
@@ -21,13 +21,55 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 
+#include "midi.h"
+#include "midifcodec.h"
 #include "midifile.h"
 #include "midifilealloc.h"
+#include "midifiter.h"
+#include "midiftrace.h"
 
 /* MISCELLANY HERE */
 
+/* a source to read a MIDI file from, either a stdio file or a buffer */
+typedef struct __MfReader MfReader;
+struct __MfReader {
+    MfContext *ctx;
+    FILE *fh;
+    unsigned char *buf;
+    size_t pos, length;
+    int flags;
+};
+
+/* and a destination to write one to, either a stdio file or a buffer */
+typedef struct __MfWriter MfWriter;
+struct __MfWriter {
+    MfContext *ctx; /* for buf */
+    FILE *fh;
+    unsigned char *buf;
+    size_t length, size;
+};
+
+/* state shared by the workers of a parallel write */
+typedef struct __MfParallelWrite MfParallelWrite;
+struct __MfParallelWrite {
+    MfFile *from;
+    MfWriter *tracks;
+    pthread_mutex_t lock;
+    int next;
+    PmError perr;
+};
+
+/* an event as the compact writer will write it */
+typedef struct __MfCompactEvent MfCompactEvent;
+struct __MfCompactEvent {
+    MfEvent *event;
+    PmMessage message;
+    uint32_t tick;
+};
+
 /* default strerror */
 static const char *mallocStrerror()
 {
@@ -35,36 +77,45 @@ static const char *mallocStrerror()
 }
 
 /* internal functions */
-static MfFile *Mf_AllocFile(void);
-static MfTrack *Mf_AllocTrack(void);
-static MfEvent *Mf_AllocEvent(void);
-static MfMeta *Mf_AllocMeta(uint32_t length);
-
-static PmError Mf_ReadMidiHeader(MfFile **into, FILE *from, uint16_t *expectedTracks);
-static PmError Mf_ReadMidiTrack(MfFile *file, FILE *from);
-static PmError Mf_ReadMidiEvent(MfTrack *track, FILE *from, uint8_t *pstatus, uint32_t *sz);
-static PmError Mf_ReadMidiBignum(uint32_t *into, FILE *from, uint32_t *sz);
-static PmError Mf_WriteMidiHeader(FILE *into, MfFile *from);
-static PmError Mf_WriteMidiTrack(FILE *into, MfTrack *track);
-static PmError Mf_WriteMidiEvent(FILE *into, MfEvent *event, uint8_t *pstatus);
-static uint32_t Mf_GetMidiEventLength(MfEvent *event, uint8_t *pstatus);
-static PmError Mf_WriteMidiBignum(FILE *into, uint32_t val);
+static MfFile *Mf_AllocFile(MfContext *ctx);
+static MfTrack *Mf_AllocTrack(MfContext *ctx);
+static MfEvent *Mf_AllocEvent(MfContext *ctx);
+static MfMeta *Mf_AllocMeta(MfContext *ctx, uint32_t length);
+static size_t Mf_GetPatternFootprint(MfPattern *pattern);
+
+static PmError Mf_ReadMidi(MfFile **into, MfReader *from);
+static PmError Mf_ReadMidiHeader(MfFile **into, MfReader *from, uint16_t *expectedTracks);
+static PmError Mf_ReadMidiTrack(MfFile *file, MfReader *from);
+static PmError Mf_ReadMidiEvent(MfTrack *track, MfReader *from, uint8_t *pstatus, uint32_t *sz);
+static PmError Mf_ReadMidiBignum(uint32_t *into, MfReader *from, uint32_t *sz);
+static size_t Mf_ReaderRead(MfReader *from, void *into, size_t n);
+static PmError Mf_WriteMidi(MfWriter *into, MfFile *from);
+static PmError Mf_WriteMidiHeader(MfWriter *into, MfFile *from);
+static PmError Mf_WriteMidiTrack(MfWriter *into, MfTrack *track);
+static uint32_t Mf_GetMidiTrackLength(MfTrack *track);
+static PmError Mf_WriteMidiCompact(MfWriter *into, MfFile *from, int flags, MfWriteStats *stats);
+static uint8_t **Mf_FindRedundantEvents(MfFile *from, uint32_t *dropped);
+static uint32_t Mf_GetCompactEvents(MfTrack *track, uint8_t *drop, int flags, MfCompactEvent **pevents, uint32_t *psize, MfWriteStats *stats);
+static uint32_t Mf_ReorderCompactEvents(MfCompactEvent *events, uint32_t count, uint8_t status);
+static PmError Mf_WriteCompactTrack(MfWriter *into, MfCompactEvent *events, uint32_t count, uint32_t *pchunkSize);
+static PmError Mf_WriteMidiEvent(MfWriter *into, MfEvent *event, uint32_t deltaTm, uint8_t *pstatus);
+static uint32_t Mf_GetMidiEventLength(MfEvent *event, uint32_t deltaTm, uint8_t *pstatus);
+static PmError Mf_WriteMidiBignum(MfWriter *into, uint32_t val);
 static uint32_t Mf_GetMidiBignumLength(uint32_t val);
+static void *Mf_WriteMidiTracksWorker(void *vpw);
+static void Mf_WriterWrite(MfWriter *into, const void *from, size_t n);
+static void Mf_WriterReserve(MfWriter *into, size_t n);
 
-#define BAD_DATA { *((int *) 0) = 0; return pmBadData; }
+#define BAD_DATA return pmBadData
 
 #define MIDI_READ_N(into, fh, n) do { \
-    if (fread((into), 1, n, (fh)) != n) BAD_DATA; \
+    if (Mf_ReaderRead((fh), (into), n) != n) BAD_DATA; \
 } while (0)
 
 #define MIDI_READ1(into, fh) do { \
     MIDI_READ_N(&(into), fh, 1); \
 } while (0)
 
-#define MIDI_UNREAD1(from, fh) do { \
-    if (ungetc((from), fh) == EOF) BAD_DATA; \
-} while (0)
-
 #define MIDI_READ2(into, fh) do { \
     unsigned char __mrbuf[2]; \
     MIDI_READ_N(__mrbuf, fh, 2); \
@@ -81,26 +132,74 @@ static uint32_t Mf_GetMidiBignumLength(uint32_t val);
               __mrbuf[3]; \
 } while (0)
 
+#define MIDI_WRITE_N(fh, from, n) do { \
+    Mf_WriterWrite((fh), (from), (n)); \
+} while (0)
+
 #define MIDI_WRITE1(fh, val) do { \
-    fwrite(&(val), 1, 1, fh); \
+    MIDI_WRITE_N(fh, &(val), 1); \
 } while (0)
 
 #define MIDI_WRITE2(fh, val) do { \
-    fprintf(fh, "%c%c", \
-        (char) (((val) & 0xFF00) >> 8), \
-        (char) ( (val) & 0x00FF)); \
+    unsigned char __mwbuf[2]; \
+    __mwbuf[0] = ((val) & 0xFF00) >> 8; \
+    __mwbuf[1] =  (val) & 0x00FF; \
+    MIDI_WRITE_N(fh, __mwbuf, 2); \
 } while (0)
 
 #define MIDI_WRITE4(fh, val) do { \
-    fprintf(fh, "%c%c%c%c", \
-        (char) (((val) & 0xFF000000) >> 24), \
-        (char) (((val) & 0x00FF0000) >> 16), \
-        (char) (((val) & 0x0000FF00) >> 8), \
-        (char) ( (val) & 0x000000FF)); \
+    unsigned char __mwbuf[4]; \
+    __mwbuf[0] = ((val) & 0xFF000000) >> 24; \
+    __mwbuf[1] = ((val) & 0x00FF0000) >> 16; \
+    __mwbuf[2] = ((val) & 0x0000FF00) >> 8; \
+    __mwbuf[3] =  (val) & 0x000000FF; \
+    MIDI_WRITE_N(fh, __mwbuf, 4); \
 } while (0)
 
-/* only some message types have a data2 field */
-#define TYPE_HAS_DATA2(status) (!(status >= 0xC0 && status <= 0xDF))
+/* the status byte table */
+#define ST_DATA     { MF_KIND_DATA, 0, 0 }
+#define ST_CHAN(n)  { MF_KIND_CHANNEL, (n), 1 }
+#define ST_SYSEX    { MF_KIND_SYSEX, 0, 0 }
+#define ST_META     { MF_KIND_META, 0, 0 }
+#define ST_INVALID  { MF_KIND_INVALID, 0, 0 }
+#define ST_ROW(st)  st, st, st, st, st, st, st, st, st, st, st, st, st, st, st, st
+
+const MfStatusInfo Mf_StatusTable[256] = {
+    ST_ROW(ST_DATA), ST_ROW(ST_DATA), ST_ROW(ST_DATA), ST_ROW(ST_DATA),
+    ST_ROW(ST_DATA), ST_ROW(ST_DATA), ST_ROW(ST_DATA), ST_ROW(ST_DATA),
+    ST_ROW(ST_CHAN(2)), /* note off */
+    ST_ROW(ST_CHAN(2)), /* note on */
+    ST_ROW(ST_CHAN(2)), /* polyphonic aftertouch */
+    ST_ROW(ST_CHAN(2)), /* controller */
+    ST_ROW(ST_CHAN(1)), /* program change */
+    ST_ROW(ST_CHAN(1)), /* channel aftertouch */
+    ST_ROW(ST_CHAN(2)), /* pitch bend */
+    ST_SYSEX, ST_INVALID, ST_INVALID, ST_INVALID,
+    ST_INVALID, ST_INVALID, ST_INVALID, ST_SYSEX,
+    ST_INVALID, ST_INVALID, ST_INVALID, ST_INVALID,
+    ST_INVALID, ST_INVALID, ST_INVALID, ST_META
+};
+
+/* the controller table: bank select, data entry, (N)RPNs, portamento control
+ * and channel mode messages all mean something each time they're sent */
+#define CC_E        MF_CC_EVERY
+#define CC_S        MF_CC_SWITCH
+#define CC_C        MF_CC_CONTINUOUS
+#define CC_ROW(cc)  cc, cc, cc, cc, cc, cc, cc, cc, cc, cc, cc, cc, cc, cc, cc, cc
+
+const uint8_t Mf_ControllerTable[128] = {
+    CC_E, CC_C, CC_C, CC_C, CC_C, CC_C, CC_E, CC_C, /* 0: bank select, 6: data entry */
+    CC_C, CC_C, CC_C, CC_C, CC_C, CC_C, CC_C, CC_C,
+    CC_ROW(CC_C),
+    CC_E, CC_C, CC_C, CC_C, CC_C, CC_C, CC_E, CC_C, /* their LSBs */
+    CC_C, CC_C, CC_C, CC_C, CC_C, CC_C, CC_C, CC_C,
+    CC_ROW(CC_C),
+    CC_S, CC_S, CC_S, CC_S, CC_S, CC_S, CC_C, CC_C, /* 64-69: pedals and switches */
+    CC_C, CC_C, CC_C, CC_C, CC_C, CC_C, CC_C, CC_C,
+    CC_C, CC_C, CC_C, CC_C, CC_E, CC_C, CC_C, CC_C, /* 84: portamento control */
+    CC_C, CC_C, CC_C, CC_C, CC_C, CC_C, CC_C, CC_C,
+    CC_ROW(CC_E), CC_ROW(CC_E) /* (N)RPNs, data increment and channel mode */
+};
 
 /* END MISCELLANY */
 
@@ -110,13 +209,18 @@ PmError Mf_Initialize()
     AL.malloc = malloc;
     AL.strerror = mallocStrerror;
     AL.free = free;
+#ifdef MF_RT_DEBUG
+    Mf_GuardAllocators();
+#endif
     return pmNoError;
 }
 
 /* MIDI file */
-static MfFile *Mf_AllocFile()
+static MfFile *Mf_AllocFile(MfContext *ctx)
 {
-    return Mf_New(MfFile);
+    MfFile *ret = Mf_CtxNew(ctx, MfFile);
+    ret->ctx = ctx;
+    return ret;
 }
 
 void Mf_FreeFile(MfFile *file)
@@ -125,21 +229,71 @@ void Mf_FreeFile(MfFile *file)
     for (i = 0; i < file->trackCt; i++) {
         Mf_FreeTrack(file->tracks[i]);
     }
-    if (file->tracks) AL.free(file->tracks);
-    AL.free(file);
+    if (file->tracks) Mf_CtxFree(file->ctx, file->tracks);
+    Mf_CtxFree(file->ctx, file);
 }
 
 MfFile *Mf_NewFile(uint16_t timeDivision)
 {
-    MfFile *ret = Mf_AllocFile();
+    return Mf_NewFileCtx(NULL, timeDivision);
+}
+
+MfFile *Mf_NewFileCtx(MfContext *ctx, uint16_t timeDivision)
+{
+    MfFile *ret = Mf_AllocFile(ctx);
     ret->timeDivision = timeDivision;
     return ret;
 }
 
+size_t Mf_GetFileFootprint(MfFile *file)
+{
+    size_t sz;
+    int i;
+    MfEvent *event;
+    MfPattern *pattern;
+
+    sz = sizeof(MfFile) + file->trackCt * sizeof(MfTrack *);
+    for (i = 0; i < file->trackCt; i++) {
+        sz += sizeof(MfTrack);
+        for (event = file->tracks[i]->head; event; event = event->next) {
+            sz += sizeof(MfEvent);
+            if (event->meta) {
+                sz += sizeof(MfMeta);
+                if ((pattern = Mf_EventPattern(event))) {
+                    /* each reference's share of the pattern */
+                    sz += Mf_GetPatternFootprint(pattern) / pattern->refs;
+                } else if (!(event->meta->flags & MF_META_BORROWED)) {
+                    sz += event->meta->length;
+                }
+            }
+        }
+    }
+
+    return sz;
+}
+
+static size_t Mf_GetPatternFootprint(MfPattern *pattern)
+{
+    size_t sz = sizeof(MfPattern);
+    MfEvent *event;
+
+    for (event = pattern->head; event; event = event->next) {
+        sz += sizeof(MfEvent);
+        if (event->meta) {
+            sz += sizeof(MfMeta);
+            if (!(event->meta->flags & MF_META_BORROWED)) sz += event->meta->length;
+        }
+    }
+
+    return sz;
+}
+
 /* track */
-static MfTrack *Mf_AllocTrack()
+static MfTrack *Mf_AllocTrack(MfContext *ctx)
 {
-    return Mf_New(MfTrack);
+    MfTrack *ret = Mf_CtxNew(ctx, MfTrack);
+    ret->ctx = ctx;
+    return ret;
 }
 
 void Mf_FreeTrack(MfTrack *track)
@@ -147,15 +301,15 @@ void Mf_FreeTrack(MfTrack *track)
     MfEvent *ev = track->head, *next;
     while (ev) {
         next = ev->next;
-        Mf_FreeEvent(ev);
+        Mf_FreeEventCtx(track->ctx, ev);
         ev = next;
     }
-    AL.free(track);
+    Mf_CtxFree(track->ctx, track);
 }
 
 MfTrack *Mf_NewTrack(MfFile *file)
 {
-    MfTrack *track = Mf_AllocTrack();
+    MfTrack *track = Mf_AllocTrack(file->ctx);
     Mf_PushTrack(file, track);
     return track;
 }
@@ -164,40 +318,50 @@ void Mf_PushTrack(MfFile *file, MfTrack *track)
 {
     MfTrack **newTracks;
     if (file->tracks) {
-        newTracks = Mf_Malloc((file->trackCt + 1) * sizeof(MfTrack *));
+        newTracks = Mf_CtxMalloc(file->ctx, (file->trackCt + 1) * sizeof(MfTrack *));
         memcpy(newTracks, file->tracks, file->trackCt * sizeof(MfTrack *));
         newTracks[file->trackCt++] = track;
-        AL.free(file->tracks);
+        Mf_CtxFree(file->ctx, file->tracks);
         file->tracks = newTracks;
     } else {
-        file->tracks = Mf_Malloc(sizeof(MfTrack *));
+        file->tracks = Mf_CtxMalloc(file->ctx, sizeof(MfTrack *));
         file->tracks[0] = track;
         file->trackCt = 1;
     }
 }
 
 /* and event */
-static MfEvent *Mf_AllocEvent()
+static MfEvent *Mf_AllocEvent(MfContext *ctx)
 {
-    return Mf_New(MfEvent);
+    return Mf_CtxNew(ctx, MfEvent);
 }
 
 void Mf_FreeEvent(MfEvent *event)
 {
-    if (event->meta) Mf_FreeMeta(event->meta);
-    AL.free(event);
+    Mf_FreeEventCtx(NULL, event);
+}
+
+void Mf_FreeEventCtx(MfContext *ctx, MfEvent *event)
+{
+    if (event->meta) Mf_FreeMetaCtx(ctx, event->meta);
+    Mf_CtxFree(ctx, event);
 }
 
 MfEvent *Mf_NewEvent()
 {
-    return Mf_AllocEvent();
+    return Mf_AllocEvent(NULL);
+}
+
+MfEvent *Mf_NewEventCtx(MfContext *ctx)
+{
+    return Mf_AllocEvent(ctx);
 }
 
 void Mf_PushEvent(MfTrack *track, MfEvent *event)
 {
     if (track->tail) {
         track->tail->next = event;
-        event->absoluteTm = track->tail->absoluteTm + event->deltaTm;
+        event->absoluteTm = Mf_EventEndTm(track->tail) + event->deltaTm;
         track->tail = event;
     } else {
         track->head = track->tail = event;
@@ -217,67 +381,256 @@ void Mf_PushEventHead(MfTrack *track, MfEvent *event)
     }
 }
 
+MfEvent *Mf_CopyEvent(MfEvent *event)
+{
+    return Mf_CopyEventCtx(NULL, event);
+}
+
+MfEvent *Mf_CopyEventCtx(MfContext *ctx, MfEvent *event)
+{
+    MfEvent *ret = Mf_AllocEvent(ctx);
+    *ret = *event;
+    ret->next = NULL;
+    if (event->meta) ret->meta = Mf_CopyMetaCtx(ctx, event->meta);
+    return ret;
+}
+
 /* meta-events have extra fields */
-static MfMeta *Mf_AllocMeta(uint32_t length)
+static MfMeta *Mf_AllocMeta(MfContext *ctx, uint32_t length)
 {
-    MfMeta *ret = Mf_Calloc(sizeof(MfMeta) + length);
+    MfMeta *ret = Mf_CtxCalloc(ctx, sizeof(MfMeta) + length);
     ret->length = length;
+    ret->data = ret->store;
     return ret;
 }
 
 void Mf_FreeMeta(MfMeta *meta)
 {
-    AL.free(meta);
+    Mf_FreeMetaCtx(NULL, meta);
+}
+
+void Mf_FreeMetaCtx(MfContext *ctx, MfMeta *meta)
+{
+    if (meta->flags & MF_META_PATTERN) Mf_ReleasePattern((MfPattern *) meta->data);
+    if (meta->flags & MF_META_ALLOCATED) Mf_CtxFree(ctx, meta->data);
+    Mf_CtxFree(ctx, meta);
 }
 
 MfMeta *Mf_NewMeta(uint32_t length)
 {
-    return Mf_AllocMeta(length);
+    return Mf_AllocMeta(NULL, length);
+}
+
+MfMeta *Mf_NewMetaCtx(MfContext *ctx, uint32_t length)
+{
+    return Mf_AllocMeta(ctx, length);
+}
+
+MfMeta *Mf_NewBorrowedMeta(uint32_t length, unsigned char *data)
+{
+    return Mf_NewBorrowedMetaCtx(NULL, length, data);
+}
+
+MfMeta *Mf_NewBorrowedMetaCtx(MfContext *ctx, uint32_t length, unsigned char *data)
+{
+    MfMeta *ret = Mf_AllocMeta(ctx, 0);
+    ret->length = length;
+    ret->data = data;
+    ret->flags = MF_META_BORROWED;
+    return ret;
+}
+
+MfMeta *Mf_CopyMeta(MfMeta *meta)
+{
+    return Mf_CopyMetaCtx(NULL, meta);
+}
+
+MfMeta *Mf_CopyMetaCtx(MfContext *ctx, MfMeta *meta)
+{
+    MfMeta *ret;
+
+    if (meta->flags & MF_META_PATTERN) {
+        /* share the pattern */
+        ret = Mf_AllocMeta(ctx, 0);
+        ret->flags = MF_META_PATTERN;
+        ret->data = meta->data;
+        ((MfPattern *) meta->data)->refs++;
+    } else if (meta->flags & MF_META_BORROWED) {
+        ret = Mf_NewBorrowedMetaCtx(ctx, meta->length, meta->data);
+    } else {
+        ret = Mf_AllocMeta(ctx, meta->length);
+        memcpy(ret->data, meta->data, meta->length);
+    }
+    ret->type = meta->type;
+
+    return ret;
+}
+
+unsigned char *Mf_MetaWritable(MfMeta *meta)
+{
+    return Mf_MetaWritableCtx(NULL, meta);
+}
+
+unsigned char *Mf_MetaWritableCtx(MfContext *ctx, MfMeta *meta)
+{
+    unsigned char *data;
+
+    if (meta->flags & MF_META_BORROWED) {
+        /* copy on write */
+        data = Mf_CtxMalloc(ctx, meta->length ? meta->length : 1);
+        memcpy(data, meta->data, meta->length);
+        meta->data = data;
+        meta->flags = (meta->flags & ~MF_META_BORROWED) | MF_META_ALLOCATED;
+    }
+
+    return meta->data;
+}
+
+/* shared patterns */
+void Mf_ReleasePattern(MfPattern *pattern)
+{
+    MfEvent *event, *next;
+
+    if (--pattern->refs > 0) return;
+    for (event = pattern->head; event; event = next) {
+        next = event->next;
+        Mf_FreeEventCtx(pattern->ctx, event);
+    }
+    Mf_CtxFree(pattern->ctx, pattern);
+}
+
+uint32_t Mf_EventEndTm(MfEvent *event)
+{
+    MfPattern *pattern = Mf_EventPattern(event);
+    return event->absoluteTm + (pattern ? pattern->tail->absoluteTm : 0);
+}
+
+void Mf_WalkTrack(MfWalk *walk, MfTrack *track)
+{
+    walk->event = track->head;
+    walk->ref = NULL;
+    walk->tick = walk->deltaTm = 0;
+}
+
+MfEvent *Mf_WalkNext(MfWalk *walk)
+{
+    MfEvent *event = walk->event;
+    MfPattern *pattern;
+
+    /* out of a pattern */
+    if (!event && walk->ref) {
+        event = walk->ref->next;
+        walk->ref = NULL;
+    }
+    if (!event) return NULL;
+
+    /* and into one */
+    if ((pattern = Mf_EventPattern(event))) {
+        walk->ref = event;
+        walk->event = pattern->head->next;
+        walk->tick = event->absoluteTm;
+        walk->deltaTm = event->deltaTm;
+        return pattern->head;
+    }
+
+    walk->event = event->next;
+    if (walk->ref) {
+        walk->tick = walk->ref->absoluteTm + event->absoluteTm;
+    } else {
+        walk->tick = event->absoluteTm;
+    }
+    walk->deltaTm = event->deltaTm;
+    return event;
 }
 
 /* read in a MIDI file */
 PmError Mf_ReadMidiFile(MfFile **into, FILE *from)
+{
+    return Mf_ReadMidiFileCtx(NULL, into, from);
+}
+
+PmError Mf_ReadMidiFileCtx(MfContext *ctx, MfFile **into, FILE *from)
+{
+    MfReader rd;
+    PmError perr;
+    MF_TRACE_BEGIN(span);
+
+    memset(&rd, 0, sizeof(rd));
+    rd.ctx = ctx;
+    rd.fh = from;
+    perr = Mf_ReadMidi(into, &rd);
+
+    MF_TRACE_END(span, "Mf_ReadMidiFile");
+    return perr;
+}
+
+/* read in a MIDI file from memory */
+PmError Mf_ReadMidiBuffer(MfFile **into, unsigned char *buf, size_t length, int flags)
+{
+    return Mf_ReadMidiBufferCtx(NULL, into, buf, length, flags);
+}
+
+PmError Mf_ReadMidiBufferCtx(MfContext *ctx, MfFile **into, unsigned char *buf, size_t length, int flags)
+{
+    MfReader rd;
+    memset(&rd, 0, sizeof(rd));
+    rd.ctx = ctx;
+    rd.buf = buf;
+    rd.length = length;
+    rd.flags = flags;
+    return Mf_ReadMidi(into, &rd);
+}
+
+static PmError Mf_ReadMidi(MfFile **into, MfReader *from)
 {
     MfFile *file;
     PmError perr;
     int i;
     uint16_t expectedTracks;
 
-    if ((perr = Mf_ReadMidiHeader(&file, from, &expectedTracks))) return perr;
+    MF_TRACE_BEGIN(span);
+    perr = Mf_ReadMidiHeader(&file, from, &expectedTracks);
+    MF_TRACE_END(span, "Mf_ReadMidiHeader");
+    if (perr) return perr;
     *into = file;
 
     for (i = 0; i < expectedTracks; i++) {
-        if ((perr = Mf_ReadMidiTrack(file, from))) return perr;
+        MF_TRACE_BEGIN(trackSpan);
+        perr = Mf_ReadMidiTrack(file, from);
+        MF_TRACE_END(trackSpan, "Mf_ReadMidiTrack");
+        if (perr) return perr;
     }
 
     return pmNoError;
 }
 
-static PmError Mf_ReadMidiHeader(MfFile **into, FILE *from, uint16_t *expectedTracks)
+static PmError Mf_ReadMidiHeader(MfFile **into, MfReader *from, uint16_t *expectedTracks)
 {
     MfFile *file;
     char magic[4];
     uint32_t chunkSize;
+    uint16_t format, timeDivision;
 
     /* check that the magic is right */
-    if (fread(magic, 1, 4, from) != 4) BAD_DATA;
+    MIDI_READ_N(magic, from, 4);
     if (memcmp(magic, "MThd", 4)) BAD_DATA;
 
-    file = Mf_AllocFile();
-
     /* get the chunk size */
     MIDI_READ4(chunkSize, from);
     if (chunkSize != 6) BAD_DATA;
 
-    MIDI_READ2(file->format, from);
+    MIDI_READ2(format, from);
     MIDI_READ2(*expectedTracks, from);
-    MIDI_READ2(file->timeDivision, from);
+    MIDI_READ2(timeDivision, from);
 
+    file = Mf_AllocFile(from->ctx);
+    file->format = format;
+    file->timeDivision = timeDivision;
     *into = file;
     return pmNoError;
 }
 
-static PmError Mf_ReadMidiTrack(MfFile *file, FILE *from)
+static PmError Mf_ReadMidiTrack(MfFile *file, MfReader *from)
 {
     MfTrack *track;
     PmError perr;
@@ -287,7 +640,7 @@ static PmError Mf_ReadMidiTrack(MfFile *file, FILE *from)
     uint32_t rd;
 
     /* make sure it's a track */
-    if (fread(magic, 1, 4, from) != 4) BAD_DATA;
+    MIDI_READ_N(magic, from, 4);
     if (memcmp(magic, "MTrk", 4)) BAD_DATA;
 
     track = Mf_NewTrack(file);
@@ -306,48 +659,52 @@ static PmError Mf_ReadMidiTrack(MfFile *file, FILE *from)
     return pmNoError;
 }
 
-static PmError Mf_ReadMidiEvent(MfTrack *track, FILE *from, uint8_t *pstatus, uint32_t *sz)
+static PmError Mf_ReadMidiEvent(MfTrack *track, MfReader *from, uint8_t *pstatus, uint32_t *sz)
 {
     MfEvent *event;
     PmError perr;
+    const MfStatusInfo *info;
     uint32_t deltaTm;
     uint8_t status, data1, data2;
-    uint32_t rd = 0;
+    unsigned char data[2];
+    uint32_t rd = 0, have = 0;
 
     /* read the delta time */
     if ((perr = Mf_ReadMidiBignum(&deltaTm, from, &rd))) return perr;
 
-    event = Mf_NewEvent();
+    event = Mf_AllocEvent(track->ctx);
     event->deltaTm = deltaTm;
     Mf_PushEvent(track, event);
 
     /* and the rest */
     MIDI_READ1(status, from);
     rd++;
+    info = &Mf_StatusTable[status];
 
-    /* get status and data1 directly (in case of using previous status) */
-    if (status < 0x80) {
-        /* status is from last event */
-        MIDI_UNREAD1(status, from); rd--;
+    if (info->kind == MF_KIND_DATA) {
+        /* status is from the last channel message, so that was data1 */
+        data[have++] = status;
         status = *pstatus;
+        info = &Mf_StatusTable[status];
+        if (!info->running) BAD_DATA;
     }
 
     /* now figure the rest out */
-    if (status < 0xF0) {
-        MIDI_READ1(data1, from); rd++;
-
-        /* not all have data2 (argh) */
-        if (TYPE_HAS_DATA2(status)) {
-            MIDI_READ1(data2, from); rd++;
-        }
-
-    } else if (status == 0xF0 || status == 0xF7 || status == 0xFF) { /* SysEx or meta */
+    if (info->kind == MF_KIND_CHANNEL) {
+        data[1] = 0;
+        MIDI_READ_N(data + have, from, info->dataLength - have);
+        rd += info->dataLength - have;
+        data1 = data[0];
+        data2 = data[1];
+        *pstatus = status;
+
+    } else if (info->kind == MF_KIND_SYSEX || info->kind == MF_KIND_META) {
         uint8_t mtype;
         uint32_t srd, length;
         MfMeta *meta;
 
         /* meta type */
-        if (status == 0xFF) { /* actual meta */
+        if (info->kind == MF_KIND_META) {
             MIDI_READ1(mtype, from);
             rd++;
         } else {
@@ -358,12 +715,19 @@ static PmError Mf_ReadMidiEvent(MfTrack *track, FILE *from, uint8_t *pstatus, ui
         if ((perr = Mf_ReadMidiBignum(&length, from, &srd))) return perr;
         rd += srd;
 
-        meta = Mf_NewMeta(length);
+        /* and the data itself, which a buffer must have room for */
+        if (from->buf && from->length - from->pos < length) BAD_DATA;
+        if ((from->flags & MF_READ_BORROW) && from->buf) {
+            meta = Mf_NewBorrowedMetaCtx(track->ctx, length, from->buf + from->pos);
+            from->pos += length;
+        } else {
+            /* attached first, so it's freed with the file if reading fails */
+            meta = Mf_AllocMeta(track->ctx, length);
+            event->meta = meta;
+            MIDI_READ_N(meta->data, from, length);
+        }
         meta->type = mtype;
         event->meta = meta;
-
-        /* and the data itself */
-        if (fread(meta->data, 1, length, from) != length) BAD_DATA;
         rd += length;
 
         /* carry over some data for convenience */
@@ -378,13 +742,11 @@ static PmError Mf_ReadMidiEvent(MfTrack *track, FILE *from, uint8_t *pstatus, ui
     }
 
     event->e.message = Pm_Message(status, data1, data2);
-    if (status == 0xFF && event->meta == NULL) fprintf(stderr, "WTF\n");
-    *pstatus = status;
     *sz = rd;
     return pmNoError;
 }
 
-static PmError Mf_ReadMidiBignum(uint32_t *into, FILE *from, uint32_t *sz)
+static PmError Mf_ReadMidiBignum(uint32_t *into, MfReader *from, uint32_t *sz)
 {
     uint32_t ret = 0;
     int more = 1;
@@ -392,7 +754,7 @@ static PmError Mf_ReadMidiBignum(uint32_t *into, FILE *from, uint32_t *sz)
 
     *sz = 0;
     while (more) {
-        if (fread(&cur, 1, 1, from) != 1) BAD_DATA;
+        MIDI_READ1(cur, from);
         (*sz)++;
 
         /* is there more? */
@@ -411,8 +773,153 @@ static PmError Mf_ReadMidiBignum(uint32_t *into, FILE *from, uint32_t *sz)
     return pmNoError;
 }
 
+static size_t Mf_ReaderRead(MfReader *from, void *into, size_t n)
+{
+    if (from->fh) return fread(into, 1, n, from->fh);
+
+    if (from->length - from->pos < n) n = from->length - from->pos;
+    memcpy(into, from->buf + from->pos, n);
+    from->pos += n;
+    return n;
+}
+
 /* write out a MIDI file */
 PmError Mf_WriteMidiFile(FILE *into, MfFile *from)
+{
+    MfWriter wr;
+    PmError perr;
+    MF_TRACE_BEGIN(span);
+
+    memset(&wr, 0, sizeof(wr));
+    wr.fh = into;
+    perr = Mf_WriteMidi(&wr, from);
+
+    MF_TRACE_END(span, "Mf_WriteMidiFile");
+    return perr;
+}
+
+/* write out a MIDI file into memory */
+PmError Mf_WriteMidiBuffer(unsigned char **into, size_t *length, MfFile *from)
+{
+    MfWriter wr;
+    PmError perr;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.ctx = from->ctx;
+    if ((perr = Mf_WriteMidi(&wr, from))) {
+        if (wr.buf) Mf_CtxFree(wr.ctx, wr.buf);
+        return perr;
+    }
+
+    *into = wr.buf;
+    *length = wr.length;
+    return pmNoError;
+}
+
+/* write out a MIDI file, encoding tracks in parallel */
+PmError Mf_WriteMidiFileParallel(FILE *into, MfFile *from, int threads)
+{
+    MfParallelWrite pw;
+    MfWriter wr;
+    pthread_t *workers;
+    PmError perr;
+    int i;
+
+    if (threads > from->trackCt) threads = from->trackCt;
+    if (threads <= 1) return Mf_WriteMidiFile(into, from);
+
+    memset(&pw, 0, sizeof(pw));
+    pw.from = from;
+    /* the workers' buffers use the default context, since the file's context
+     * may not be usable from other threads */
+    pw.tracks = Mf_Calloc(from->trackCt * sizeof(MfWriter));
+    pthread_mutex_init(&pw.lock, NULL);
+
+    /* encode all the tracks into their own buffers */
+    workers = Mf_Malloc(threads * sizeof(pthread_t));
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, Mf_WriteMidiTracksWorker, &pw)) break;
+    }
+    if (i == 0) Mf_WriteMidiTracksWorker(&pw);
+    while (i > 0) pthread_join(workers[--i], NULL);
+    AL.free(workers);
+    pthread_mutex_destroy(&pw.lock);
+
+    /* then write them out in order */
+    perr = pw.perr;
+    if (!perr) {
+        memset(&wr, 0, sizeof(wr));
+        wr.fh = into;
+        perr = Mf_WriteMidiHeader(&wr, from);
+    }
+    for (i = 0; i < from->trackCt; i++) {
+        if (!perr) MIDI_WRITE_N(&wr, pw.tracks[i].buf, pw.tracks[i].length);
+        if (pw.tracks[i].buf) AL.free(pw.tracks[i].buf);
+    }
+    AL.free(pw.tracks);
+
+    return perr;
+}
+
+static void *Mf_WriteMidiTracksWorker(void *vpw)
+{
+    MfParallelWrite *pw = (MfParallelWrite *) vpw;
+    PmError perr;
+    int i;
+
+    while (1) {
+        /* take the next track */
+        pthread_mutex_lock(&pw->lock);
+        i = pw->next++;
+        pthread_mutex_unlock(&pw->lock);
+        if (i >= pw->from->trackCt) break;
+
+        MF_TRACE_BEGIN(span);
+        perr = Mf_WriteMidiTrack(&pw->tracks[i], pw->from->tracks[i]);
+        MF_TRACE_END(span, "Mf_WriteMidiTrack");
+        if (perr) {
+            pthread_mutex_lock(&pw->lock);
+            pw->perr = perr;
+            pthread_mutex_unlock(&pw->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/* write out a MIDI file as compactly as possible */
+PmError Mf_WriteMidiFileCompact(FILE *into, MfFile *from, int flags, MfWriteStats *stats)
+{
+    MfWriter wr;
+    PmError perr;
+    MF_TRACE_BEGIN(span);
+
+    memset(&wr, 0, sizeof(wr));
+    wr.fh = into;
+    perr = Mf_WriteMidiCompact(&wr, from, flags, stats);
+
+    MF_TRACE_END(span, "Mf_WriteMidiFileCompact");
+    return perr;
+}
+
+PmError Mf_WriteMidiBufferCompact(unsigned char **into, size_t *length, MfFile *from, int flags, MfWriteStats *stats)
+{
+    MfWriter wr;
+    PmError perr;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.ctx = from->ctx;
+    if ((perr = Mf_WriteMidiCompact(&wr, from, flags, stats))) {
+        if (wr.buf) Mf_CtxFree(wr.ctx, wr.buf);
+        return perr;
+    }
+
+    *into = wr.buf;
+    *length = wr.length;
+    return pmNoError;
+}
+
+static PmError Mf_WriteMidi(MfWriter *into, MfFile *from)
 {
     PmError perr;
     int i;
@@ -420,16 +927,19 @@ PmError Mf_WriteMidiFile(FILE *into, MfFile *from)
     if ((perr = Mf_WriteMidiHeader(into, from))) return perr;
 
     for (i = 0; i < from->trackCt; i++) {
-        if ((perr = Mf_WriteMidiTrack(into, from->tracks[i]))) return perr;
+        MF_TRACE_BEGIN(span);
+        perr = Mf_WriteMidiTrack(into, from->tracks[i]);
+        MF_TRACE_END(span, "Mf_WriteMidiTrack");
+        if (perr) return perr;
     }
 
     return pmNoError;
 }
 
-static PmError Mf_WriteMidiHeader(FILE *into, MfFile *from)
+static PmError Mf_WriteMidiHeader(MfWriter *into, MfFile *from)
 {
     /* magic and chunk size */
-    fwrite("MThd\0\0\0\x06", 1, 8, into);
+    MIDI_WRITE_N(into, "MThd\0\0\0\x06", 8);
 
     /* and the rest */
     MIDI_WRITE2(into, from->format);
@@ -439,72 +949,362 @@ static PmError Mf_WriteMidiHeader(FILE *into, MfFile *from)
     return pmNoError;
 }
 
-static PmError Mf_WriteMidiTrack(FILE *into, MfTrack *track)
+static PmError Mf_WriteMidiTrack(MfWriter *into, MfTrack *track)
 {
     PmError perr;
     MfEvent *event;
+    MfWalk walk;
     uint8_t status;
     uint32_t chunkSize;
 
     /* track header */
-    fwrite("MTrk", 1, 4, into);
+    MIDI_WRITE_N(into, "MTrk", 4);
 
-    /* get the chunk size to be written */
-    chunkSize = 0;
-    event = track->head;
+    /* get the chunk size to be written (with patterns expanded) */
+    chunkSize = Mf_GetMidiTrackLength(track);
+    MIDI_WRITE4(into, chunkSize);
+    Mf_WriterReserve(into, chunkSize);
+
+    /* and write it */
+    Mf_WalkTrack(&walk, track);
     status = 0;
-    while (event) {
-        chunkSize += Mf_GetMidiEventLength(event, &status);
-        event = event->next;
+    while ((event = Mf_WalkNext(&walk))) {
+        if ((perr = Mf_WriteMidiEvent(into, event, walk.deltaTm, &status))) return perr;
     }
+
+    return pmNoError;
+}
+
+/* the length of a track's chunk as written (without its header) */
+static uint32_t Mf_GetMidiTrackLength(MfTrack *track)
+{
+    MfEvent *event;
+    MfWalk walk;
+    uint8_t status = 0;
+    uint32_t chunkSize = 0;
+
+    Mf_WalkTrack(&walk, track);
+    while ((event = Mf_WalkNext(&walk))) {
+        chunkSize += Mf_GetMidiEventLength(event, walk.deltaTm, &status);
+    }
+
+    return chunkSize;
+}
+
+/* write a MIDI file with the compact writer */
+static PmError Mf_WriteMidiCompact(MfWriter *into, MfFile *from, int flags, MfWriteStats *stats)
+{
+    MfWriteStats st;
+    MfCompactEvent *events = NULL;
+    uint8_t **drop = NULL;
+    uint32_t size = 0, count, chunkSize;
+    PmError perr;
+    int i;
+
+    memset(&st, 0, sizeof(st));
+    if ((flags & MF_WRITE_REDUNDANT) && from->format != 2)
+        drop = Mf_FindRedundantEvents(from, &st.dropped);
+
+    perr = Mf_WriteMidiHeader(into, from);
+    st.length = st.standardLength = 14;
+    for (i = 0; i < from->trackCt && !perr; i++) {
+        MF_TRACE_BEGIN(span);
+        count = Mf_GetCompactEvents(from->tracks[i], drop ? drop[i] : NULL, flags, &events, &size, &st);
+        perr = Mf_WriteCompactTrack(into, events, count, &chunkSize);
+        MF_TRACE_END(span, "Mf_WriteCompactTrack");
+
+        st.length += 8 + chunkSize;
+        st.standardLength += 8 + Mf_GetMidiTrackLength(from->tracks[i]);
+    }
+
+    if (events) AL.free(events);
+    if (drop) {
+        for (i = 0; i < from->trackCt; i++) AL.free(drop[i]);
+        AL.free(drop);
+    }
+    if (stats) *stats = st;
+    return perr;
+}
+
+/* find the events in a file which change nothing, returning for each track a
+ * flag for each event (in walk order) saying whether to leave it out */
+static uint8_t **Mf_FindRedundantEvents(MfFile *from, uint32_t *dropped)
+{
+    MfIter iter;
+    MfIterEvent ev;
+    MfWalk walk;
+    uint8_t **drop;
+    uint32_t *ordinal;
+    int16_t values[16][129]; /* each controller, then pitch bend; -1 if unknown */
+    uint8_t notes[16][128];
+    int32_t tempo = -1, value;
+    int i, channel, n;
+
+    drop = Mf_Malloc(from->trackCt * sizeof(uint8_t *));
+    ordinal = Mf_Calloc(from->trackCt * sizeof(uint32_t));
+    for (i = 0; i < from->trackCt; i++) {
+        n = 0;
+        Mf_WalkTrack(&walk, from->tracks[i]);
+        while (Mf_WalkNext(&walk)) n++;
+        drop[i] = Mf_Calloc(n + 1);
+    }
+    memset(values, 0xFF, sizeof(values));
+    memset(notes, 0, sizeof(notes));
+
+    /* go through in the order it's played, with what's in effect */
+    if (Mf_IterOpenFile(&iter, from)) {
+        AL.free(ordinal);
+        return drop;
+    }
+    while (Mf_IterNext(&iter, &ev)) {
+        n = ordinal[ev.track]++;
+        channel = ev.status & 0xF;
+
+        if (ev.status == MIDI_STATUS_META) {
+            if (ev.metaType == MIDI_M_TEMPO && ev.metaLength == MIDI_M_TEMPO_LENGTH) {
+                value = MIDI_M_TEMPO_N(ev.metaData);
+                if (value == tempo) drop[ev.track][n] = 1;
+                tempo = value;
+            }
+            continue;
+        }
+        if (ev.status == MIDI_STATUS_SYSEX || ev.status == MIDI_STATUS_SYSEX_CONT) {
+            /* could be a reset or a parameter change, so nothing's known
+             * after it (notes are still counted, so note-offs are kept) */
+            memset(values, 0xFF, sizeof(values));
+            tempo = -1;
+            continue;
+        }
+
+        switch (ev.status >> 4) {
+            case MIDI_NOTE_ON:
+                if (ev.data2) {
+                    if (notes[channel][ev.data1] < 255) notes[channel][ev.data1]++;
+                    break;
+                }
+                /* fallthrough */
+
+            case MIDI_NOTE_OFF:
+                if (notes[channel][ev.data1]) notes[channel][ev.data1]--;
+                else drop[ev.track][n] = 1;
+                break;
+
+            case MIDI_CONTROLLER:
+                if (ev.data1 == 120 || ev.data1 == 123) {
+                    /* all sound off or all notes off */
+                    memset(notes[channel], 0, sizeof(notes[channel]));
+                } else if (ev.data1 == 121) {
+                    /* reset all controllers */
+                    memset(values[channel], 0xFF, sizeof(values[channel]));
+                } else if (Mf_ControllerTable[ev.data1] != MF_CC_EVERY) {
+                    if (values[channel][ev.data1] == ev.data2) drop[ev.track][n] = 1;
+                    values[channel][ev.data1] = ev.data2;
+                }
+                break;
+
+            case MIDI_PITCH_BEND:
+                value = ev.data1 | (ev.data2 << 7);
+                if (values[channel][128] == value) drop[ev.track][n] = 1;
+                values[channel][128] = value;
+                break;
+        }
+    }
+    Mf_IterClose(&iter);
+
+    for (i = 0; i < from->trackCt; i++) {
+        while (ordinal[i]--) *dropped += drop[i][ordinal[i]];
+    }
+    AL.free(ordinal);
+    return drop;
+}
+
+/* gather a track's events as they'll be written by the compact writer into
+ * *pevents (of size *psize, grown as needed), returning how many there are */
+static uint32_t Mf_GetCompactEvents(MfTrack *track, uint8_t *drop, int flags, MfCompactEvent **pevents, uint32_t *psize, MfWriteStats *stats)
+{
+    MfCompactEvent *events = *pevents, *grown;
+    MfEvent *event;
+    MfWalk walk;
+    PmMessage message;
+    uint32_t ct = 0, n = 0, i, start;
+    uint8_t status = 0;
+
+    Mf_WalkTrack(&walk, track);
+    while ((event = Mf_WalkNext(&walk))) {
+        if (drop && drop[n++]) continue;
+
+        if (ct == *psize) {
+            *psize = *psize ? *psize * 2 : 256;
+            grown = Mf_Malloc(*psize * sizeof(MfCompactEvent));
+            if (events) {
+                memcpy(grown, events, ct * sizeof(MfCompactEvent));
+                AL.free(events);
+            }
+            *pevents = events = grown;
+        }
+
+        message = event->e.message;
+        if ((flags & MF_WRITE_NOTE_OFFS) && Pm_MessageType(message) == MIDI_NOTE_OFF &&
+            (Pm_MessageData2(message) == 0 || Pm_MessageData2(message) == 64)) {
+            message = Pm_Message(Pm_MessageStatusGen(MIDI_NOTE_ON, Pm_MessageChannel(message)),
+                                 Pm_MessageData1(message), 0);
+            stats->converted++;
+        }
+
+        events[ct].event = event;
+        events[ct].message = message;
+        events[ct].tick = walk.tick;
+        ct++;
+    }
+
+    if (!(flags & MF_WRITE_REORDER)) return ct;
+
+    /* reorder each run of channel messages at the same tick, following on
+     * from the status before it */
+    for (i = 0; i < ct; i = start) {
+        start = i;
+        while (start < ct && Mf_StatusTable[Pm_MessageStatus(events[start].message)].kind == MF_KIND_CHANNEL &&
+               events[start].tick == events[i].tick)
+            start++;
+        if (start - i > 1)
+            stats->moved += Mf_ReorderCompactEvents(events + i, start - i, status);
+        if (start == i) start++;
+        status = Pm_MessageStatus(events[start - 1].message);
+    }
+
+    return ct;
+}
+
+/* reorder a run of channel messages at the same tick, starting with running
+ * status status, to make the longest runs of the same status without
+ * changing the order of any channel's messages. Returns the number of
+ * messages moved. */
+static uint32_t Mf_ReorderCompactEvents(MfCompactEvent *events, uint32_t count, uint8_t status)
+{
+    MfCompactEvent local[64], *sorted;
+    uint32_t next[16], i, j, moved = 0;
+    int channel, best;
+
+    sorted = (count <= 64) ? local : Mf_Malloc(count * sizeof(MfCompactEvent));
+
+    /* each channel's next message */
+    for (channel = 0; channel < 16; channel++) {
+        next[channel] = count;
+        for (j = 0; j < count; j++) {
+            if (Pm_MessageChannel(events[j].message) == channel) {
+                next[channel] = j;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        /* continue running status if any channel can, or else take the
+         * earliest */
+        best = -1;
+        for (channel = 0; channel < 16; channel++) {
+            if (next[channel] == count) continue;
+            if (Pm_MessageStatus(events[next[channel]].message) == status) {
+                best = channel;
+                break;
+            }
+            if (best < 0 || next[channel] < next[best]) best = channel;
+        }
+
+        j = next[best];
+        sorted[i] = events[j];
+        status = Pm_MessageStatus(events[j].message);
+        if (j != i) moved++;
+
+        /* and find that channel's next */
+        for (j++; j < count && Pm_MessageChannel(events[j].message) != best; j++);
+        next[best] = j;
+    }
+
+    memcpy(events, sorted, count * sizeof(MfCompactEvent));
+    if (sorted != local) AL.free(sorted);
+    return moved;
+}
+
+/* write a track's events with the compact writer */
+static PmError Mf_WriteCompactTrack(MfWriter *into, MfCompactEvent *events, uint32_t count, uint32_t *pchunkSize)
+{
+    PmError perr;
+    MfEvent event;
+    uint32_t chunkSize = 0, tick = 0, i;
+    uint8_t status = 0;
+
+    /* the events are written through copies carrying the new messages */
+    for (i = 0; i < count; i++) {
+        event = *events[i].event;
+        event.e.message = events[i].message;
+        chunkSize += Mf_GetMidiEventLength(&event, events[i].tick - tick, &status);
+        tick = events[i].tick;
+    }
+    *pchunkSize = chunkSize;
+
+    MIDI_WRITE_N(into, "MTrk", 4);
     MIDI_WRITE4(into, chunkSize);
+    Mf_WriterReserve(into, chunkSize);
 
-    /* and write it */
-    event = track->head;
+    tick = 0;
     status = 0;
-    while (event) {
-        if ((perr = Mf_WriteMidiEvent(into, event, &status))) return perr;
-        event = event->next;
+    for (i = 0; i < count; i++) {
+        event = *events[i].event;
+        event.e.message = events[i].message;
+        if ((perr = Mf_WriteMidiEvent(into, &event, events[i].tick - tick, &status))) return perr;
+        tick = events[i].tick;
     }
 
     return pmNoError;
 }
 
-static PmError Mf_WriteMidiEvent(FILE *into, MfEvent *event, uint8_t *pstatus)
+/* encode one event into a stdio file */
+PmError Mf_EncodeMidiEvent(FILE *into, MfEvent *event, uint8_t *pstatus, uint32_t *sz)
+{
+    MfWriter wr;
+    uint8_t status = *pstatus;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.fh = into;
+    *sz = Mf_GetMidiEventLength(event, event->deltaTm, &status);
+    return Mf_WriteMidiEvent(&wr, event, event->deltaTm, pstatus);
+}
+
+static PmError Mf_WriteMidiEvent(MfWriter *into, MfEvent *event, uint32_t deltaTm, uint8_t *pstatus)
 {
     PmError perr;
+    const MfStatusInfo *info;
     uint8_t status, data1, data2;
 
     /* write the delta time */
-    if ((perr = Mf_WriteMidiBignum(into, event->deltaTm))) return perr;
+    if ((perr = Mf_WriteMidiBignum(into, deltaTm))) return perr;
 
     /* get out the parts */
     status = Pm_MessageStatus(event->e.message);
     data1 = Pm_MessageData1(event->e.message);
     data2 = Pm_MessageData2(event->e.message);
 
+    info = &Mf_StatusTable[status];
+
     /* hopefully it's a simple event */
-    if (status < 0xF0) {
-        /* write the status if we need to */
-        if (status != *pstatus) {
-            MIDI_WRITE1(into, status);
-        }
+    if (info->kind == MF_KIND_CHANNEL) {
+        unsigned char buf[3];
+        int n = 0;
 
-        /* then write data1 */
-        MIDI_WRITE1(into, data1);
+        /* the status if we need to, then the data */
+        if (!info->running || status != *pstatus) buf[n++] = status;
+        buf[n] = data1;
+        buf[n + 1] = data2;
+        MIDI_WRITE_N(into, buf, n + info->dataLength);
 
-        /* not all have data2 (argh) */
-        if (TYPE_HAS_DATA2(status)) {
-            MIDI_WRITE1(into, data2);
-        }
-
-    } else if (event->meta) { /* has metadata */
+    } else if (event->meta && (info->kind == MF_KIND_SYSEX || info->kind == MF_KIND_META)) {
         MfMeta *meta = event->meta;
 
         MIDI_WRITE1(into, status);
 
         /* meta type */
-        if (status == 0xFF) { /* actual meta */
+        if (info->kind == MF_KIND_META) {
             MIDI_WRITE1(into, meta->type);
         }
 
@@ -512,7 +1312,7 @@ static PmError Mf_WriteMidiEvent(FILE *into, MfEvent *event, uint8_t *pstatus)
         if ((perr = Mf_WriteMidiBignum(into, meta->length))) return perr;
 
         /* and the data itself */
-        fwrite(meta->data, 1, meta->length, into);
+        MIDI_WRITE_N(into, meta->data, meta->length);
 
     } else {
         fprintf(stderr, "Unrecognized output MIDI event type %02X!\n", status);
@@ -524,35 +1324,31 @@ static PmError Mf_WriteMidiEvent(FILE *into, MfEvent *event, uint8_t *pstatus)
     return pmNoError;
 }
 
-static uint32_t Mf_GetMidiEventLength(MfEvent *event, uint8_t *pstatus)
+static uint32_t Mf_GetMidiEventLength(MfEvent *event, uint32_t deltaTm, uint8_t *pstatus)
 {
+    const MfStatusInfo *info;
     uint32_t sz = 0;
     uint8_t status;
 
     /* delta time */
-    sz += Mf_GetMidiBignumLength(event->deltaTm);
+    sz += Mf_GetMidiBignumLength(deltaTm);
 
     /* get out the parts */
     status = Pm_MessageStatus(event->e.message);
+    info = &Mf_StatusTable[status];
 
-    if (status < 0xF0) {
-        /* write the status if we need to */
-        if (status != *pstatus) sz++;
-
-        /* then data1 */
-        sz++;
-
-        /* not all have data2 (argh) */
-        if (TYPE_HAS_DATA2(status)) sz++;
+    if (info->kind == MF_KIND_CHANNEL) {
+        /* the status if we need to, then the data */
+        sz += info->dataLength + (!info->running || status != *pstatus);
 
-    } else if (event->meta) { /* has metadata */
+    } else if (event->meta && (info->kind == MF_KIND_SYSEX || info->kind == MF_KIND_META)) {
         MfMeta *meta = event->meta;
 
         /* status */
         sz++;
 
         /* meta type */
-        if (status == 0xFF) sz++;
+        if (info->kind == MF_KIND_META) sz++;
 
         /* data length */
         sz += Mf_GetMidiBignumLength(meta->length);
@@ -562,7 +1358,7 @@ static uint32_t Mf_GetMidiEventLength(MfEvent *event, uint8_t *pstatus)
 
     } else {
         fprintf(stderr, "Unrecognized output MIDI event type %02X! (unknown length)\n", status);
-        BAD_DATA;
+        return 0; /* and writing it fails */
 
     }
 
@@ -570,7 +1366,7 @@ static uint32_t Mf_GetMidiEventLength(MfEvent *event, uint8_t *pstatus)
     return sz;
 }
 
-static PmError Mf_WriteMidiBignum(FILE *into, uint32_t val)
+static PmError Mf_WriteMidiBignum(MfWriter *into, uint32_t val)
 {
     unsigned char buf[5];
     int bufl, i;
@@ -608,3 +1404,34 @@ static uint32_t Mf_GetMidiBignumLength(uint32_t val)
 
     return sz;
 }
+
+static void Mf_WriterWrite(MfWriter *into, const void *from, size_t n)
+{
+    if (into->fh) {
+        fwrite(from, 1, n, into->fh);
+        return;
+    }
+
+    Mf_WriterReserve(into, n);
+    memcpy(into->buf + into->length, from, n);
+    into->length += n;
+}
+
+/* make sure a buffer writer has room for n more bytes */
+static void Mf_WriterReserve(MfWriter *into, size_t n)
+{
+    unsigned char *newBuf;
+    size_t newSize;
+
+    if (into->fh || into->length + n <= into->size) return;
+
+    newSize = into->size ? into->size * 2 : 64;
+    if (newSize < into->length + n) newSize = into->length + n;
+    newBuf = Mf_CtxMalloc(into->ctx, newSize);
+    if (into->buf) {
+        memcpy(newBuf, into->buf, into->length);
+        Mf_CtxFree(into->ctx, into->buf);
+    }
+    into->buf = newBuf;
+    into->size = newSize;
+}
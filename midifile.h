@@ -35,22 +35,64 @@ typedef struct __MfFile MfFile;
 typedef struct __MfTrack MfTrack;
 typedef struct __MfEvent MfEvent;
 typedef struct __MfMeta MfMeta;
+typedef struct __MfContext MfContext;
+typedef struct __MfPattern MfPattern;
+typedef struct __MfWalk MfWalk;
+typedef struct __MfWriteStats MfWriteStats;
 
 /* initialization */
 PmError Mf_Initialize(void);
 
+/* a context carries the allocators used to make files, tracks, events and
+ * meta-events, and what to do when allocation fails. Files and tracks
+ * remember the context they were made with; events and meta-events don't (to
+ * keep them small), so the *Ctx functions take it explicitly, and the others
+ * use the default context, which uses the global allocators. Wherever a
+ * context is taken, NULL means the default. A context's allocators are only
+ * called by one thread at a time if only one thread uses its files. */
+struct __MfContext {
+    void *(*malloc)(MfContext *ctx, size_t sz);
+    void (*free)(MfContext *ctx, void *ptr);
+
+    /* called when malloc fails, and must not return */
+    void (*error)(MfContext *ctx, size_t sz);
+
+    void *arg; /* for the allocators' own use */
+};
+extern MfContext Mf_DefaultContext;
+
+/* initialize a context to the defaults, to then replace what you like */
+void Mf_InitContext(MfContext *ctx);
+
+/* allocate and free memory through a context */
+void *Mf_CtxMalloc(MfContext *ctx, size_t sz);
+void Mf_CtxFree(MfContext *ctx, void *ptr);
+
+/* mark the calling thread as being in (or out of) a real-time section. When
+ * built with MF_RT_DEBUG, any allocation or free through the library's
+ * allocators inside a real-time section aborts, otherwise these do nothing. */
+void Mf_EnterRealTime(void);
+void Mf_LeaveRealTime(void);
+
 /* MIDI file */
 struct __MfFile {
     uint16_t format, timeDivision;
     uint16_t trackCt;
     MfTrack **tracks;
+    MfContext *ctx;
 };
 void Mf_FreeFile(MfFile *file);
 MfFile *Mf_NewFile(uint16_t timeDivision);
+MfFile *Mf_NewFileCtx(MfContext *ctx, uint16_t timeDivision);
+
+/* how many bytes of memory does this file (with all its tracks, events and
+ * meta-events) occupy? */
+size_t Mf_GetFileFootprint(MfFile *file);
 
 /* track */
 struct __MfTrack {
     MfEvent *head, *tail;
+    MfContext *ctx; /* that of the file it was made for */
 };
 void Mf_FreeTrack(MfTrack *track);
 MfTrack *Mf_NewTrack(MfFile *file);
@@ -65,22 +107,121 @@ struct __MfEvent {
 };
 void Mf_FreeEvent(MfEvent *event);
 MfEvent *Mf_NewEvent(void);
+void Mf_FreeEventCtx(MfContext *ctx, MfEvent *event);
+MfEvent *Mf_NewEventCtx(MfContext *ctx);
 void Mf_PushEvent(MfTrack *track, MfEvent *event);
 void Mf_PushEventHead(MfTrack *track, MfEvent *event);
 
-/* meta-events have extra fields */
+/* copy an event (and its meta-event data, if any; borrowed data stays
+ * borrowed). The copy is not in any track. */
+MfEvent *Mf_CopyEvent(MfEvent *event);
+MfEvent *Mf_CopyEventCtx(MfContext *ctx, MfEvent *event);
+
+/* meta-events have extra fields. data normally points at the meta-event's
+ * own storage, but a borrowed meta-event's data points into a buffer owned by
+ * somebody else (e.g. the buffer it was read from), which must outlive it. */
 struct __MfMeta {
-    uint8_t type;
+    uint8_t type, flags;
     uint32_t length;
-    unsigned char data[1];
+    unsigned char *data;
+    unsigned char store[1];
 };
+#define MF_META_BORROWED    1 /* data belongs to somebody else */
+#define MF_META_ALLOCATED   2 /* data is a separate allocation we own */
+#define MF_META_PATTERN     4 /* data is an MfPattern, see below */
 void Mf_FreeMeta(MfMeta *meta);
 MfMeta *Mf_NewMeta(uint32_t length);
+MfMeta *Mf_NewBorrowedMeta(uint32_t length, unsigned char *data);
+MfMeta *Mf_CopyMeta(MfMeta *meta);
+void Mf_FreeMetaCtx(MfContext *ctx, MfMeta *meta);
+MfMeta *Mf_NewMetaCtx(MfContext *ctx, uint32_t length);
+MfMeta *Mf_NewBorrowedMetaCtx(MfContext *ctx, uint32_t length, unsigned char *data);
+MfMeta *Mf_CopyMetaCtx(MfContext *ctx, MfMeta *meta);
+
+/* get a writable pointer to a meta-event's data, copying it first if it's
+ * borrowed */
+unsigned char *Mf_MetaWritable(MfMeta *meta);
+unsigned char *Mf_MetaWritableCtx(MfContext *ctx, MfMeta *meta);
+
+/* a run of events repeated in a track can be stored once, as a pattern (see
+ * midifpattern.h). Each repetition is then a reference: an event with an
+ * MF_META_PATTERN meta-event (of type 0xFF, which no real meta-event has),
+ * timed at the pattern's first event. The event after a reference is timed
+ * relative to the pattern's last event, just as if it had been expanded. */
+struct __MfPattern {
+    int refs;
+    MfContext *ctx;
+    MfEvent *head, *tail; /* timed relative to the first event */
+    uint32_t eventCt;
+};
+void Mf_ReleasePattern(MfPattern *pattern);
+
+/* the pattern an event refers to, or NULL */
+#define Mf_EventPattern(event) \
+    (((event)->meta && ((event)->meta->flags & MF_META_PATTERN)) ? \
+     (MfPattern *) (event)->meta->data : NULL)
+
+/* the time of the last event that an event stands for */
+uint32_t Mf_EventEndTm(MfEvent *event);
 
-/* read in a MIDI file */
+/* walk a track's events in order with patterns expanded. Each call to
+ * Mf_WalkNext returns the next event and sets tick and deltaTm to its times
+ * as expanded (an event in a pattern has its own times relative to the
+ * pattern). */
+struct __MfWalk {
+    MfEvent *event, *ref;
+    uint32_t tick, deltaTm;
+};
+void Mf_WalkTrack(MfWalk *walk, MfTrack *track);
+MfEvent *Mf_WalkNext(MfWalk *walk);
+
+/* read in a MIDI file (the Ctx version allocates everything with ctx). Bad or
+ * truncated data gives pmBadData, and *into may then be set to what was read
+ * of the file, which is still the caller's to free. */
 PmError Mf_ReadMidiFile(MfFile **into, FILE *from);
+PmError Mf_ReadMidiFileCtx(MfContext *ctx, MfFile **into, FILE *from);
+
+/* read in a MIDI file from memory. With MF_READ_BORROW, meta-event and SysEx
+ * data is borrowed from the buffer instead of copied, so the buffer must
+ * outlive the file. */
+#define MF_READ_BORROW 1
+PmError Mf_ReadMidiBuffer(MfFile **into, unsigned char *buf, size_t length, int flags);
+PmError Mf_ReadMidiBufferCtx(MfContext *ctx, MfFile **into, unsigned char *buf, size_t length, int flags);
 
 /* write out a MIDI file */
 PmError Mf_WriteMidiFile(FILE *into, MfFile *from);
 
+/* write out a MIDI file into a buffer allocated with the file's context */
+PmError Mf_WriteMidiBuffer(unsigned char **into, size_t *length, MfFile *from);
+
+/* write out a MIDI file, encoding up to threads tracks at once */
+PmError Mf_WriteMidiFileParallel(FILE *into, MfFile *from, int threads);
+
+/* write out a MIDI file as small as it can be made without changing how it
+ * plays (the file itself isn't changed), doing any of:
+ *  - MF_WRITE_NOTE_OFFS: note-offs without a release velocity (0 or 64) are
+ *    written as note-ons of velocity 0, to continue running status.
+ *  - MF_WRITE_REORDER: events at the same tick in a track are reordered to
+ *    make longer runs of running status. Each channel's events stay in
+ *    order, and nothing moves past a meta-event or SysEx.
+ *  - MF_WRITE_REDUNDANT: controller and pitch bend values already in effect,
+ *    note-offs for notes which aren't on and tempo changes to the tempo
+ *    already in effect are left out, going through the file in the order
+ *    it's played (not for format 2 files, whose tracks are independent).
+ *    Any SysEx might reset the device, so values aren't assumed across it.
+ * If stats isn't NULL, it's filled in with what was done. */
+#define MF_WRITE_NOTE_OFFS  1
+#define MF_WRITE_REORDER    2
+#define MF_WRITE_REDUNDANT  4
+#define MF_WRITE_COMPACT    7
+struct __MfWriteStats {
+    /* the length written, and the length Mf_WriteMidiFile would write */
+    size_t length, standardLength;
+
+    /* note-offs converted, events moved and events left out */
+    uint32_t converted, moved, dropped;
+};
+PmError Mf_WriteMidiFileCompact(FILE *into, MfFile *from, int flags, MfWriteStats *stats);
+PmError Mf_WriteMidiBufferCompact(unsigned char **into, size_t *length, MfFile *from, int flags, MfWriteStats *stats);
+
 #endif
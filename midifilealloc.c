@@ -24,26 +24,135 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "midifile.h"
 #include "midifilealloc.h"
 
 MfAllocators Mf_Allocators;
 #define AL Mf_Allocators
 
-/* internal malloc-wrapper with error checking */
-void *Mf_Malloc(size_t sz)
+/* the default context just uses the global allocators */
+static void *defaultMalloc(MfContext *ctx, size_t sz)
+{
+    return AL.malloc(sz);
+}
+
+static void defaultFree(MfContext *ctx, void *ptr)
+{
+    AL.free(ptr);
+}
+
+static void defaultError(MfContext *ctx, size_t sz)
 {
-    void *ret = AL.malloc(sz);
+    fprintf(stderr, "Error while allocating memory: %s\n", AL.strerror());
+    exit(1);
+}
+
+MfContext Mf_DefaultContext = { defaultMalloc, defaultFree, defaultError, NULL };
+
+#ifdef MF_RT_DEBUG
+static __thread int realTime = 0;
+#endif
+
+void Mf_InitContext(MfContext *ctx)
+{
+    *ctx = Mf_DefaultContext;
+}
+
+/* malloc through a context, with error checking */
+void *Mf_CtxMalloc(MfContext *ctx, size_t sz)
+{
+    void *ret;
+
+    if (!ctx) ctx = &Mf_DefaultContext;
+#ifdef MF_RT_DEBUG
+    if (realTime) {
+        fprintf(stderr, "Allocation of %lu bytes in a real-time section!\n", (unsigned long) sz);
+        abort();
+    }
+#endif
+
+    ret = ctx->malloc(ctx, sz);
     if (ret == NULL) {
-        fprintf(stderr, "Error while allocating memory: %s\n", AL.strerror());
-        exit(1);
+        ctx->error(ctx, sz);
+        abort(); /* the error handler mustn't return */
     }
     return ret;
 }
 
 /* same for calloc */
-void *Mf_Calloc(size_t sz)
+void *Mf_CtxCalloc(MfContext *ctx, size_t sz)
 {
-    void *ret = Mf_Malloc(sz);
+    void *ret = Mf_CtxMalloc(ctx, sz);
     memset(ret, 0, sz);
     return ret;
 }
+
+void Mf_CtxFree(MfContext *ctx, void *ptr)
+{
+    if (!ctx) ctx = &Mf_DefaultContext;
+#ifdef MF_RT_DEBUG
+    if (realTime) {
+        fprintf(stderr, "Free of %p in a real-time section!\n", ptr);
+        abort();
+    }
+#endif
+    ctx->free(ctx, ptr);
+}
+
+/* internal malloc-wrapper with error checking */
+void *Mf_Malloc(size_t sz)
+{
+    return Mf_CtxMalloc(&Mf_DefaultContext, sz);
+}
+
+/* same for calloc */
+void *Mf_Calloc(size_t sz)
+{
+    return Mf_CtxCalloc(&Mf_DefaultContext, sz);
+}
+
+/* real-time sections, see Mf_EnterRealTime */
+#ifdef MF_RT_DEBUG
+static MfAllocators guarded;
+
+static void *guardedMalloc(size_t sz)
+{
+    if (realTime) {
+        fprintf(stderr, "Allocation of %lu bytes in a real-time section!\n", (unsigned long) sz);
+        abort();
+    }
+    return guarded.malloc(sz);
+}
+
+static void guardedFree(void *ptr)
+{
+    if (realTime) {
+        fprintf(stderr, "Free of %p in a real-time section!\n", ptr);
+        abort();
+    }
+    guarded.free(ptr);
+}
+
+void Mf_GuardAllocators()
+{
+    if (AL.malloc == guardedMalloc) return;
+    guarded = AL;
+    AL.malloc = guardedMalloc;
+    AL.free = guardedFree;
+}
+
+void Mf_EnterRealTime()
+{
+    realTime++;
+}
+
+void Mf_LeaveRealTime()
+{
+    realTime--;
+}
+
+#else
+void Mf_EnterRealTime() {}
+void Mf_LeaveRealTime() {}
+
+#endif
@@ -26,6 +26,8 @@
 /* this is an internal header */
 #include <stdlib.h>
 
+#include "midifile.h"
+
 /* pluggable allocators */
 typedef struct __MfAllocators MfAllocators;
 struct __MfAllocators {
@@ -38,8 +40,15 @@ extern MfAllocators Mf_Allocators;
 
 void *Mf_Malloc(size_t sz);
 void *Mf_Calloc(size_t sz);
+void *Mf_CtxCalloc(MfContext *ctx, size_t sz);
+
+#ifdef MF_RT_DEBUG
+/* wrap the allocators to abort when called in a real-time section */
+void Mf_GuardAllocators(void);
+#endif
 
 /* calloc of a type */
 #define Mf_New(tp) (Mf_Calloc(sizeof(tp)))
+#define Mf_CtxNew(ctx, tp) (Mf_CtxCalloc((ctx), sizeof(tp)))
 
 #endif
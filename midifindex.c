@@ -0,0 +1,896 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "midifindex.h"
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifilealloc.h"
+#include "midifiter.h"
+#include "midifload.h"
+
+#define SEGMENT_POSTINGS    (1 << 22) /* postings gathered before writing a segment */
+#define SEGMENT_MIN         (1 << 18) /* ... at the least, when split between threads */
+#define SEGMENT_MAGIC       "MFIX"
+#define SEGMENT_VERSION     1
+#define SEGMENT_HEADER      32
+#define SEGMENT_MAX         1000000 /* segment numbers are six digits */
+#define TERM_ENTRY          16 /* term, count and offset */
+
+#define DRUM_CHANNEL    9
+#define INTERVAL_RANGE  24 /* pitch intervals are clamped to +/- this */
+#define RHYTHM_RANGE    2 /* rounded log2 onset ratios are clamped to +/- this */
+
+/* A segment file is all little-endian:
+ *  header: magic, version (u32), term count (u32), 0 (u32), posting count
+ *          (u64), term table offset (u64)
+ *  postings: for each term, for each posting in file and tick order, the
+ *          file's difference from the last (varint), then the tick if the file
+ *          changed or its difference from the last if not (varint)
+ *  term table: sorted by term, each term (u32), posting count (u32) and
+ *          offset of its postings (u64) */
+
+/* a posting gathered for writing */
+typedef struct __MfIndexPosting MfIndexPosting;
+struct __MfIndexPosting {
+    uint32_t term, file, tick;
+};
+
+/* a term's entry in a segment being written */
+typedef struct __MfIndexTerm MfIndexTerm;
+struct __MfIndexTerm {
+    uint32_t term, count;
+    uint64_t offset;
+};
+
+/* a segment being written */
+typedef struct __MfIndexOut MfIndexOut;
+struct __MfIndexOut {
+    char *path;
+    FILE *fh;
+    MfIndexTerm *terms;
+    uint32_t termCt, termMax;
+    uint64_t postingCt, offset;
+    uint32_t lastFile, lastTick;
+    PmError perr;
+};
+
+/* the top line of one channel, and the window of notes making its next term */
+typedef struct __MfIndexLine MfIndexLine;
+struct __MfIndexLine {
+    int pending;
+    uint8_t pendingKey;
+    uint32_t pendingTick;
+
+    int noteCt;
+    uint8_t keys[MF_INDEX_GRAM];
+    uint32_t ticks[MF_INDEX_GRAM];
+};
+
+struct __MfIndexWriter {
+    char *prefix;
+    MfIndexPosting *postings;
+    uint32_t postingCt, postingAlloc, postingMax;
+    PmError perr;
+};
+
+/* a mapped segment */
+typedef struct __MfIndexSegment MfIndexSegment;
+struct __MfIndexSegment {
+    char *path;
+    unsigned char *map;
+    size_t size;
+    uint32_t termCt;
+    const unsigned char *table;
+};
+
+struct __MfIndex {
+    uint32_t segmentCt;
+    MfIndexSegment *segments;
+};
+
+/* reading one term's postings (term being its number in a query) */
+typedef struct __MfIndexCursor MfIndexCursor;
+struct __MfIndexCursor {
+    const unsigned char *cur, *end;
+    uint32_t left, file, tick, term;
+};
+
+/* a posting found by a query */
+typedef struct __MfIndexMatch MfIndexMatch;
+struct __MfIndexMatch {
+    uint32_t file, term, tick;
+};
+
+/* a corpus build */
+typedef struct __MfIndexCorpusState MfIndexCorpusState;
+struct __MfIndexCorpusState {
+    MfIndexWriter **writers;
+    uint32_t firstIndex;
+    PmError perr;
+};
+
+/* file-local miscellany */
+static MfIndexWriter *Mf_IndexOpenWriter(const char *prefix, uint32_t postingMax);
+static PmError Mf_Index(MfIndexWriter *writer, uint32_t fileIndex, MfIter *iter);
+static void Mf_IndexAdd(MfIndexWriter *writer, uint32_t term, uint32_t file, uint32_t tick);
+static void Mf_IndexFlush(MfIndexWriter *writer);
+static int Mf_IndexLineNote(MfIndexLine *line, uint8_t key, uint32_t tick, uint32_t *term, uint32_t *termTick);
+static int Mf_IndexLineEnd(MfIndexLine *line, uint32_t *term, uint32_t *termTick);
+static int Mf_IndexLineCommit(MfIndexLine *line, uint32_t *term, uint32_t *termTick);
+static MfIndexOut *Mf_IndexOutOpen(const char *prefix);
+static void Mf_IndexOutTerm(MfIndexOut *out, uint32_t term);
+static void Mf_IndexOutPosting(MfIndexOut *out, uint32_t file, uint32_t tick);
+static PmError Mf_IndexOutClose(MfIndexOut *out);
+static const unsigned char *Mf_IndexLookup(MfIndexSegment *seg, uint32_t term);
+static void Mf_IndexCursorOpen(MfIndexCursor *cursor, MfIndexSegment *seg, const unsigned char *entry);
+static int Mf_IndexCursorNext(MfIndexCursor *cursor);
+static void Mf_IndexHeapDown(MfIndexCursor *cursors, uint32_t *heap, uint32_t heapCt, uint32_t i);
+static void Mf_IndexCorpusFile(void *vcs, int worker, uint32_t index, unsigned char *buf, size_t length);
+static char *Mf_IndexSplitPrefix(const char *prefix, const char **base);
+static void *Mf_IndexGrow(void *old, uint32_t oldCt, uint32_t newCt, size_t size);
+static void Mf_IndexPut32(unsigned char *into, uint32_t val);
+static void Mf_IndexPut64(unsigned char *into, uint64_t val);
+static uint32_t Mf_IndexGet32(const unsigned char *from);
+static uint64_t Mf_IndexGet64(const unsigned char *from);
+static int Mf_IndexPostingCmp(const void *va, const void *vb);
+static int Mf_IndexMatchCmp(const void *va, const void *vb);
+static int Mf_IndexHitCmp(const void *va, const void *vb);
+static int Mf_IndexUintCmp(const void *va, const void *vb);
+
+/* start adding to an index */
+MfIndexWriter *Mf_OpenIndexWriter(const char *prefix)
+{
+    return Mf_IndexOpenWriter(prefix, SEGMENT_POSTINGS);
+}
+
+static MfIndexWriter *Mf_IndexOpenWriter(const char *prefix, uint32_t postingMax)
+{
+    MfIndexWriter *ret = Mf_New(MfIndexWriter);
+    ret->prefix = Mf_Malloc(strlen(prefix) + 1);
+    strcpy(ret->prefix, prefix);
+    ret->postingMax = postingMax;
+    return ret;
+}
+
+/* index a standard MIDI file in memory */
+PmError Mf_IndexBuffer(MfIndexWriter *writer, uint32_t fileIndex, const unsigned char *buf, size_t length)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenBuffer(&iter, buf, length))) {
+        Mf_IterClose(&iter);
+        return perr;
+    }
+    perr = Mf_Index(writer, fileIndex, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+/* index a decoded file */
+PmError Mf_IndexFile(MfIndexWriter *writer, uint32_t fileIndex, MfFile *file)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenFile(&iter, file))) return perr;
+    perr = Mf_Index(writer, fileIndex, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+/* finish adding to an index */
+PmError Mf_CloseIndexWriter(MfIndexWriter *writer)
+{
+    PmError perr;
+
+    Mf_IndexFlush(writer);
+    perr = writer->perr;
+    if (writer->postings) AL.free(writer->postings);
+    AL.free(writer->prefix);
+    AL.free(writer);
+    return perr;
+}
+
+/* index a whole corpus in parallel, with a writer per thread */
+PmError Mf_IndexCorpus(const char *prefix, const char **paths, uint32_t count, uint32_t firstIndex, int threads)
+{
+    MfIndexCorpusState cs;
+    uint32_t postingMax;
+    PmError perr;
+    int i;
+
+    if (threads < 1) threads = 1;
+    postingMax = SEGMENT_POSTINGS / threads;
+    if (postingMax < SEGMENT_MIN) postingMax = SEGMENT_MIN;
+
+    cs.firstIndex = firstIndex;
+    cs.writers = Mf_Malloc(threads * sizeof(MfIndexWriter *));
+    for (i = 0; i < threads; i++) cs.writers[i] = Mf_IndexOpenWriter(prefix, postingMax);
+
+    Mf_LoadCorpus(paths, count, threads, Mf_IndexCorpusFile, &cs);
+
+    cs.perr = pmNoError;
+    for (i = 0; i < threads; i++) {
+        if ((perr = Mf_CloseIndexWriter(cs.writers[i]))) cs.perr = perr;
+    }
+    AL.free(cs.writers);
+
+    return cs.perr;
+}
+
+static void Mf_IndexCorpusFile(void *vcs, int worker, uint32_t index, unsigned char *buf, size_t length)
+{
+    MfIndexCorpusState *cs = (MfIndexCorpusState *) vcs;
+    Mf_IndexBuffer(cs->writers[worker], cs->firstIndex + index, buf, length);
+}
+
+static PmError Mf_Index(MfIndexWriter *writer, uint32_t fileIndex, MfIter *iter)
+{
+    MfIndexLine lines[16];
+    MfIterEvent ev;
+    uint32_t term, tick;
+    int channel;
+
+    memset(lines, 0, sizeof(lines));
+
+    while (Mf_IterNext(iter, &ev)) {
+        if ((ev.status >> 4) != MIDI_NOTE_ON || !ev.data2) continue;
+        channel = ev.status & 0xF;
+        if (channel == DRUM_CHANNEL) continue;
+        if (Mf_IndexLineNote(&lines[channel], ev.data1 & 0x7F, ev.tick, &term, &tick))
+            Mf_IndexAdd(writer, term, fileIndex, tick);
+    }
+
+    for (channel = 0; channel < 16; channel++) {
+        if (Mf_IndexLineEnd(&lines[channel], &term, &tick))
+            Mf_IndexAdd(writer, term, fileIndex, tick);
+    }
+
+    return iter->perr;
+}
+
+static void Mf_IndexAdd(MfIndexWriter *writer, uint32_t term, uint32_t file, uint32_t tick)
+{
+    MfIndexPosting *posting;
+    uint32_t newAlloc;
+
+    if (writer->postingCt == writer->postingAlloc) {
+        if (writer->postingAlloc >= writer->postingMax) {
+            Mf_IndexFlush(writer);
+        } else {
+            newAlloc = writer->postingAlloc ? writer->postingAlloc * 2 : 4096;
+            if (newAlloc > writer->postingMax) newAlloc = writer->postingMax;
+            writer->postings = Mf_IndexGrow(writer->postings, writer->postingAlloc, newAlloc, sizeof(MfIndexPosting));
+            writer->postingAlloc = newAlloc;
+        }
+    }
+
+    posting = &writer->postings[writer->postingCt++];
+    posting->term = term;
+    posting->file = file;
+    posting->tick = tick;
+}
+
+/* write the gathered postings out as a segment */
+static void Mf_IndexFlush(MfIndexWriter *writer)
+{
+    MfIndexPosting *posting;
+    MfIndexOut *out;
+    PmError perr;
+    uint32_t i;
+
+    if (!writer->postingCt) return;
+
+    qsort(writer->postings, writer->postingCt, sizeof(MfIndexPosting), Mf_IndexPostingCmp);
+
+    out = Mf_IndexOutOpen(writer->prefix);
+    for (i = 0; i < writer->postingCt; i++) {
+        posting = &writer->postings[i];
+        if (i == 0 || posting->term != posting[-1].term) Mf_IndexOutTerm(out, posting->term);
+        Mf_IndexOutPosting(out, posting->file, posting->tick);
+    }
+    if ((perr = Mf_IndexOutClose(out))) writer->perr = perr;
+
+    writer->postingCt = 0;
+}
+
+/* add a note to a channel's top line, returning 1 with a term if one was
+ * completed */
+static int Mf_IndexLineNote(MfIndexLine *line, uint8_t key, uint32_t tick, uint32_t *term, uint32_t *termTick)
+{
+    int ret = 0;
+
+    if (line->pending && tick <= line->pendingTick) {
+        /* at the same time, only the highest note counts */
+        if (key > line->pendingKey) line->pendingKey = key;
+        return 0;
+    }
+
+    if (line->pending) ret = Mf_IndexLineCommit(line, term, termTick);
+    line->pending = 1;
+    line->pendingKey = key;
+    line->pendingTick = tick;
+    return ret;
+}
+
+/* finish a channel's top line */
+static int Mf_IndexLineEnd(MfIndexLine *line, uint32_t *term, uint32_t *termTick)
+{
+    if (!line->pending) return 0;
+    line->pending = 0;
+    return Mf_IndexLineCommit(line, term, termTick);
+}
+
+/* move the pending note into the window, making a term if it's full */
+static int Mf_IndexLineCommit(MfIndexLine *line, uint32_t *term, uint32_t *termTick)
+{
+    uint32_t ret = 0;
+    int i, step;
+
+    if (line->noteCt == MF_INDEX_GRAM) {
+        memmove(line->keys, line->keys + 1, MF_INDEX_GRAM - 1);
+        memmove(line->ticks, line->ticks + 1, (MF_INDEX_GRAM - 1) * sizeof(uint32_t));
+        line->noteCt--;
+    }
+    line->keys[line->noteCt] = line->pendingKey;
+    line->ticks[line->noteCt] = line->pendingTick;
+    if (++line->noteCt < MF_INDEX_GRAM) return 0;
+
+    /* pitch intervals */
+    for (i = 1; i < MF_INDEX_GRAM; i++) {
+        step = line->keys[i] - line->keys[i-1];
+        if (step < -INTERVAL_RANGE) step = -INTERVAL_RANGE;
+        else if (step > INTERVAL_RANGE) step = INTERVAL_RANGE;
+        ret = ret * (INTERVAL_RANGE * 2 + 1) + (step + INTERVAL_RANGE);
+    }
+
+    /* onset ratios, to the nearest power of two */
+    for (i = 2; i < MF_INDEX_GRAM; i++) {
+        step = (int) lround(log2((double) (line->ticks[i] - line->ticks[i-1]) /
+                                 (line->ticks[i-1] - line->ticks[i-2])));
+        if (step < -RHYTHM_RANGE) step = -RHYTHM_RANGE;
+        else if (step > RHYTHM_RANGE) step = RHYTHM_RANGE;
+        ret = ret * (RHYTHM_RANGE * 2 + 1) + (step + RHYTHM_RANGE);
+    }
+
+    *term = ret;
+    *termTick = line->ticks[0];
+    return 1;
+}
+
+/* start writing a new segment, under the first free number */
+static MfIndexOut *Mf_IndexOutOpen(const char *prefix)
+{
+    MfIndexOut *ret = Mf_New(MfIndexOut);
+    unsigned char header[SEGMENT_HEADER];
+    uint32_t n;
+
+    ret->path = Mf_Malloc(strlen(prefix) + 16);
+    for (n = 0; n < SEGMENT_MAX; n++) {
+        sprintf(ret->path, "%s%06u.mfi", prefix, (unsigned) n);
+        ret->fh = fopen(ret->path, "wxb");
+        if (ret->fh || errno != EEXIST) break;
+    }
+    if (!ret->fh) {
+        ret->perr = pmHostError;
+        return ret;
+    }
+
+    /* the header is written properly last, so a partial segment is never
+     * mistaken for a whole one */
+    memset(header, 0, SEGMENT_HEADER);
+    if (fwrite(header, 1, SEGMENT_HEADER, ret->fh) != SEGMENT_HEADER) ret->perr = pmHostError;
+    ret->offset = SEGMENT_HEADER;
+    return ret;
+}
+
+/* start the postings of the next term */
+static void Mf_IndexOutTerm(MfIndexOut *out, uint32_t term)
+{
+    MfIndexTerm *entry;
+
+    if (out->termCt == out->termMax) {
+        out->terms = Mf_IndexGrow(out->terms, out->termMax, out->termMax ? out->termMax * 2 : 1024, sizeof(MfIndexTerm));
+        out->termMax = out->termMax ? out->termMax * 2 : 1024;
+    }
+
+    entry = &out->terms[out->termCt++];
+    entry->term = term;
+    entry->count = 0;
+    entry->offset = out->offset;
+    out->lastFile = out->lastTick = 0;
+}
+
+/* add a posting to the current term */
+static void Mf_IndexOutPosting(MfIndexOut *out, uint32_t file, uint32_t tick)
+{
+    unsigned char buf[10];
+    uint32_t vals[2];
+    int i, len = 0;
+
+    vals[0] = file - out->lastFile;
+    vals[1] = (file == out->lastFile) ? tick - out->lastTick : tick;
+    out->lastFile = file;
+    out->lastTick = tick;
+
+    for (i = 0; i < 2; i++) {
+        while (vals[i] >= 0x80) {
+            buf[len++] = (vals[i] & 0x7F) | 0x80;
+            vals[i] >>= 7;
+        }
+        buf[len++] = vals[i];
+    }
+
+    if (!out->fh) return;
+    if (fwrite(buf, 1, len, out->fh) != (size_t) len) out->perr = pmHostError;
+    out->offset += len;
+    out->terms[out->termCt-1].count++;
+    out->postingCt++;
+}
+
+/* write the term table and header, and finish the segment */
+static PmError Mf_IndexOutClose(MfIndexOut *out)
+{
+    unsigned char entry[TERM_ENTRY], header[SEGMENT_HEADER];
+    PmError perr;
+    uint32_t i;
+
+    if (out->fh) {
+        for (i = 0; i < out->termCt; i++) {
+            Mf_IndexPut32(entry, out->terms[i].term);
+            Mf_IndexPut32(entry + 4, out->terms[i].count);
+            Mf_IndexPut64(entry + 8, out->terms[i].offset);
+            if (fwrite(entry, 1, TERM_ENTRY, out->fh) != TERM_ENTRY) out->perr = pmHostError;
+        }
+
+        memset(header, 0, SEGMENT_HEADER);
+        memcpy(header, SEGMENT_MAGIC, 4);
+        Mf_IndexPut32(header + 4, SEGMENT_VERSION);
+        Mf_IndexPut32(header + 8, out->termCt);
+        Mf_IndexPut64(header + 16, out->postingCt);
+        Mf_IndexPut64(header + 24, out->offset);
+        if (fflush(out->fh) || fseek(out->fh, 0, SEEK_SET) ||
+            fwrite(header, 1, SEGMENT_HEADER, out->fh) != SEGMENT_HEADER)
+            out->perr = pmHostError;
+
+        if (fclose(out->fh)) out->perr = pmHostError;
+        if (out->perr) unlink(out->path);
+    }
+
+    perr = out->perr;
+    if (out->terms) AL.free(out->terms);
+    AL.free(out->path);
+    AL.free(out);
+    return perr;
+}
+
+/* combine all of an index's segments */
+PmError Mf_MergeIndex(const char *prefix)
+{
+    MfIndex *index = Mf_OpenIndex(prefix);
+    MfIndexSegment *seg;
+    MfIndexCursor cursor;
+    MfIndexMatch *found = NULL;
+    uint32_t *pos, term, foundCt, foundMax = 0, i, j;
+    MfIndexOut *out;
+    PmError perr;
+    int any;
+
+    if (!index) return pmNoError;
+    if (index->segmentCt < 2) {
+        Mf_CloseIndex(index);
+        return pmNoError;
+    }
+
+    pos = Mf_Calloc(index->segmentCt * sizeof(uint32_t));
+    out = Mf_IndexOutOpen(prefix);
+
+    while (1) {
+        /* find the lowest term left in any segment */
+        any = 0;
+        term = 0;
+        for (i = 0; i < index->segmentCt; i++) {
+            seg = &index->segments[i];
+            if (pos[i] == seg->termCt) continue;
+            j = Mf_IndexGet32(seg->table + (size_t) pos[i] * TERM_ENTRY);
+            if (!any || j < term) term = j;
+            any = 1;
+        }
+        if (!any) break;
+
+        /* gather its postings from every segment */
+        foundCt = 0;
+        for (i = 0; i < index->segmentCt; i++) {
+            seg = &index->segments[i];
+            if (pos[i] == seg->termCt ||
+                Mf_IndexGet32(seg->table + (size_t) pos[i] * TERM_ENTRY) != term) continue;
+            Mf_IndexCursorOpen(&cursor, seg, seg->table + (size_t) pos[i] * TERM_ENTRY);
+            while (Mf_IndexCursorNext(&cursor)) {
+                if (foundCt == foundMax) {
+                    found = Mf_IndexGrow(found, foundMax, foundMax ? foundMax * 2 : 1024, sizeof(MfIndexMatch));
+                    foundMax = foundMax ? foundMax * 2 : 1024;
+                }
+                found[foundCt].file = cursor.file;
+                found[foundCt].term = 0;
+                found[foundCt].tick = cursor.tick;
+                foundCt++;
+            }
+            pos[i]++;
+        }
+
+        qsort(found, foundCt, sizeof(MfIndexMatch), Mf_IndexMatchCmp);
+        Mf_IndexOutTerm(out, term);
+        for (i = 0; i < foundCt; i++) Mf_IndexOutPosting(out, found[i].file, found[i].tick);
+    }
+
+    /* the old segments go only once the new one is complete */
+    if (!(perr = Mf_IndexOutClose(out))) {
+        for (i = 0; i < index->segmentCt; i++) unlink(index->segments[i].path);
+    }
+
+    if (found) AL.free(found);
+    AL.free(pos);
+    Mf_CloseIndex(index);
+    return perr;
+}
+
+/* open an index for searching */
+MfIndex *Mf_OpenIndex(const char *prefix)
+{
+    MfIndex *ret;
+    MfIndexSegment *seg;
+    const char *base;
+    char *dir = Mf_IndexSplitPrefix(prefix, &base), *path;
+    size_t baseLen = strlen(base), len;
+    uint32_t segmentMax = 0;
+    struct dirent *de;
+    struct stat sbuf;
+    unsigned char *map;
+    uint64_t tableOffset;
+    DIR *dh;
+    int fd;
+
+    if (!(dh = opendir(dir))) {
+        AL.free(dir);
+        return NULL;
+    }
+
+    ret = Mf_New(MfIndex);
+    while ((de = readdir(dh))) {
+        /* <base>NNNNNN.mfi */
+        len = strlen(de->d_name);
+        if (len != baseLen + 10 || strncmp(de->d_name, base, baseLen) ||
+            strspn(de->d_name + baseLen, "0123456789") != 6 || strcmp(de->d_name + baseLen + 6, ".mfi"))
+            continue;
+
+        path = Mf_Malloc(strlen(dir) + len + 2);
+        sprintf(path, "%s/%s", dir, de->d_name);
+
+        /* map it and check it's whole */
+        map = NULL;
+        if ((fd = open(path, O_RDONLY)) >= 0) {
+            if (fstat(fd, &sbuf) == 0 && sbuf.st_size >= SEGMENT_HEADER) {
+                map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (map == MAP_FAILED) map = NULL;
+            }
+            close(fd);
+        }
+        if (map && (memcmp(map, SEGMENT_MAGIC, 4) || Mf_IndexGet32(map + 4) != SEGMENT_VERSION ||
+                    (tableOffset = Mf_IndexGet64(map + 24)) > (uint64_t) sbuf.st_size ||
+                    ((uint64_t) sbuf.st_size - tableOffset) / TERM_ENTRY < Mf_IndexGet32(map + 8))) {
+            munmap(map, sbuf.st_size);
+            map = NULL;
+        }
+        if (!map) {
+            AL.free(path);
+            continue;
+        }
+
+        if (ret->segmentCt == segmentMax) {
+            ret->segments = Mf_IndexGrow(ret->segments, segmentMax, segmentMax ? segmentMax * 2 : 8, sizeof(MfIndexSegment));
+            segmentMax = segmentMax ? segmentMax * 2 : 8;
+        }
+        seg = &ret->segments[ret->segmentCt++];
+        seg->path = path;
+        seg->map = map;
+        seg->size = sbuf.st_size;
+        seg->termCt = Mf_IndexGet32(map + 8);
+        seg->table = map + tableOffset;
+    }
+    closedir(dh);
+    AL.free(dir);
+
+    if (!ret->segmentCt) {
+        AL.free(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+/* finish searching */
+void Mf_CloseIndex(MfIndex *index)
+{
+    uint32_t i;
+
+    for (i = 0; i < index->segmentCt; i++) {
+        munmap(index->segments[i].map, index->segments[i].size);
+        AL.free(index->segments[i].path);
+    }
+    AL.free(index->segments);
+    AL.free(index);
+}
+
+/* find the files containing a melody */
+int32_t Mf_IndexQuery(MfIndex *index, const uint8_t *keys, const uint32_t *ticks, int noteCt,
+                      MfIndexHit *hits, int32_t maxHits)
+{
+    MfIndexLine line;
+    MfIndexCursor *cursors, *cursor;
+    MfIndexHit hit;
+    const unsigned char *entry;
+    uint32_t *terms, *heap, *seen, termCt = 0, term, tick, heapCt = 0, hitCt = 0, gen = 0, i, j, s;
+    int more;
+
+    if (noteCt < MF_INDEX_GRAM || maxHits <= 0) return 0;
+
+    /* the query's distinct terms */
+    terms = Mf_Malloc(noteCt * sizeof(uint32_t));
+    memset(&line, 0, sizeof(line));
+    for (i = 0; i < (uint32_t) noteCt; i++) {
+        if (Mf_IndexLineNote(&line, keys[i] & 0x7F, ticks[i], &term, &tick)) terms[termCt++] = term;
+    }
+    if (Mf_IndexLineEnd(&line, &term, &tick)) terms[termCt++] = term;
+    qsort(terms, termCt, sizeof(uint32_t), Mf_IndexUintCmp);
+    for (i = j = 0; i < termCt; i++) {
+        if (i == 0 || terms[i] != terms[j-1]) terms[j++] = terms[i];
+    }
+    termCt = j;
+
+    /* a cursor on each term's postings in each segment, at its first */
+    cursors = Mf_Malloc((termCt * index->segmentCt + 1) * sizeof(MfIndexCursor));
+    heap = Mf_Malloc((termCt * index->segmentCt + 1) * sizeof(uint32_t));
+    for (i = 0; i < termCt; i++) {
+        for (s = 0; s < index->segmentCt; s++) {
+            if (!(entry = Mf_IndexLookup(&index->segments[s], terms[i]))) continue;
+            cursor = &cursors[heapCt];
+            Mf_IndexCursorOpen(cursor, &index->segments[s], entry);
+            cursor->term = i;
+            if (Mf_IndexCursorNext(cursor)) {
+                heap[heapCt] = heapCt;
+                heapCt++;
+            }
+        }
+    }
+    AL.free(terms);
+
+    /* postings are in file order, so merging the cursors by file brings each
+     * file's matches together, to be counted up without gathering them all */
+    for (i = heapCt / 2; i > 0; i--) Mf_IndexHeapDown(cursors, heap, heapCt, i - 1);
+    seen = Mf_Calloc((termCt + 1) * sizeof(uint32_t));
+    while (heapCt) {
+        hit.file = cursors[heap[0]].file;
+        hit.matches = 0;
+        hit.tick = (uint32_t) -1;
+        gen++;
+
+        while (heapCt && (cursor = &cursors[heap[0]])->file == hit.file) {
+            if (seen[cursor->term] != gen) {
+                seen[cursor->term] = gen;
+                hit.matches++;
+            }
+            do {
+                if (cursor->tick < hit.tick) hit.tick = cursor->tick;
+            } while ((more = Mf_IndexCursorNext(cursor)) && cursor->file == hit.file);
+
+            if (!more) heap[0] = heap[--heapCt];
+            Mf_IndexHeapDown(cursors, heap, heapCt, 0);
+        }
+
+        /* keep it if it's among the best so far */
+        if (hitCt == (uint32_t) maxHits && Mf_IndexHitCmp(&hit, &hits[hitCt-1]) >= 0) continue;
+        if (hitCt < (uint32_t) maxHits) hitCt++;
+        for (i = hitCt - 1; i > 0 && Mf_IndexHitCmp(&hit, &hits[i-1]) < 0; i--) hits[i] = hits[i-1];
+        hits[i] = hit;
+    }
+    AL.free(seen);
+    AL.free(heap);
+    AL.free(cursors);
+
+    return hitCt;
+}
+
+/* find a term's table entry in a segment */
+static const unsigned char *Mf_IndexLookup(MfIndexSegment *seg, uint32_t term)
+{
+    uint32_t lo = 0, hi = seg->termCt, mid, cur;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cur = Mf_IndexGet32(seg->table + (size_t) mid * TERM_ENTRY);
+        if (cur == term) return seg->table + (size_t) mid * TERM_ENTRY;
+        if (cur < term) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+static void Mf_IndexCursorOpen(MfIndexCursor *cursor, MfIndexSegment *seg, const unsigned char *entry)
+{
+    uint64_t offset = Mf_IndexGet64(entry + 8);
+
+    if (offset > seg->size) offset = seg->size;
+    cursor->cur = seg->map + offset;
+    cursor->end = seg->map + seg->size;
+    cursor->left = Mf_IndexGet32(entry + 4);
+    cursor->file = cursor->tick = 0;
+}
+
+/* move a cursor down a heap (ordered by file) to where it belongs */
+static void Mf_IndexHeapDown(MfIndexCursor *cursors, uint32_t *heap, uint32_t heapCt, uint32_t i)
+{
+    uint32_t child, top = heap[i];
+
+    while ((child = i * 2 + 1) < heapCt) {
+        if (child + 1 < heapCt && cursors[heap[child+1]].file < cursors[heap[child]].file) child++;
+        if (cursors[heap[child]].file >= cursors[top].file) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = top;
+}
+
+/* read the next posting, returning 0 at the end */
+static int Mf_IndexCursorNext(MfIndexCursor *cursor)
+{
+    uint32_t vals[2];
+    int i, shift;
+
+    if (!cursor->left) return 0;
+
+    for (i = 0; i < 2; i++) {
+        vals[i] = 0;
+        shift = 0;
+        do {
+            if (cursor->cur == cursor->end || shift > 28) {
+                /* corrupt */
+                cursor->left = 0;
+                return 0;
+            }
+            vals[i] |= (uint32_t) (*cursor->cur & 0x7F) << shift;
+            shift += 7;
+        } while (*cursor->cur++ & 0x80);
+    }
+
+    if (vals[0]) {
+        cursor->file += vals[0];
+        cursor->tick = vals[1];
+    } else {
+        cursor->tick += vals[1];
+    }
+    cursor->left--;
+    return 1;
+}
+
+/* split a prefix into its directory (allocated) and the start of its file
+ * names */
+static char *Mf_IndexSplitPrefix(const char *prefix, const char **base)
+{
+    const char *slash = strrchr(prefix, '/');
+    char *ret;
+
+    if (!slash) {
+        *base = prefix;
+        ret = Mf_Malloc(2);
+        strcpy(ret, ".");
+        return ret;
+    }
+
+    *base = slash + 1;
+    if (slash == prefix) slash++;
+    ret = Mf_Malloc(slash - prefix + 1);
+    memcpy(ret, prefix, slash - prefix);
+    ret[slash - prefix] = 0;
+    return ret;
+}
+
+/* move an array into a bigger allocation */
+static void *Mf_IndexGrow(void *old, uint32_t oldCt, uint32_t newCt, size_t size)
+{
+    void *ret = Mf_Malloc(newCt * size);
+    if (old) {
+        memcpy(ret, old, oldCt * size);
+        AL.free(old);
+    }
+    return ret;
+}
+
+static void Mf_IndexPut32(unsigned char *into, uint32_t val)
+{
+    into[0] = val;
+    into[1] = val >> 8;
+    into[2] = val >> 16;
+    into[3] = val >> 24;
+}
+
+static void Mf_IndexPut64(unsigned char *into, uint64_t val)
+{
+    Mf_IndexPut32(into, (uint32_t) val);
+    Mf_IndexPut32(into + 4, (uint32_t) (val >> 32));
+}
+
+static uint32_t Mf_IndexGet32(const unsigned char *from)
+{
+    return from[0] | (from[1] << 8) | (from[2] << 16) | ((uint32_t) from[3] << 24);
+}
+
+static uint64_t Mf_IndexGet64(const unsigned char *from)
+{
+    return Mf_IndexGet32(from) | ((uint64_t) Mf_IndexGet32(from + 4) << 32);
+}
+
+#define CMP(x, y) if ((x) != (y)) return ((x) < (y)) ? -1 : 1
+
+static int Mf_IndexPostingCmp(const void *va, const void *vb)
+{
+    const MfIndexPosting *a = (const MfIndexPosting *) va, *b = (const MfIndexPosting *) vb;
+    CMP(a->term, b->term);
+    CMP(a->file, b->file);
+    CMP(a->tick, b->tick);
+    return 0;
+}
+
+static int Mf_IndexMatchCmp(const void *va, const void *vb)
+{
+    const MfIndexMatch *a = (const MfIndexMatch *) va, *b = (const MfIndexMatch *) vb;
+    CMP(a->file, b->file);
+    CMP(a->term, b->term);
+    CMP(a->tick, b->tick);
+    return 0;
+}
+
+static int Mf_IndexHitCmp(const void *va, const void *vb)
+{
+    const MfIndexHit *a = (const MfIndexHit *) va, *b = (const MfIndexHit *) vb;
+    CMP(b->matches, a->matches);
+    CMP(a->file, b->file);
+    return 0;
+}
+
+static int Mf_IndexUintCmp(const void *va, const void *vb)
+{
+    const uint32_t *a = (const uint32_t *) va, *b = (const uint32_t *) vb;
+    CMP(*a, *b);
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFINDEX_H
+#define MIDIFINDEX_H
+
+#include "midifile.h"
+
+/* An inverted index of melodic n-grams over a corpus of MIDI files, for
+ * finding the files which contain a melody. Each channel but the drums is
+ * reduced to its top line (the highest note starting at each tick), and every
+ * run of MF_INDEX_GRAM notes in it becomes a term made of its pitch intervals
+ * and the ratios of its onset intervals, so terms don't change with
+ * transposition, tempo or resolution. Each term's postings are the file
+ * index and tick at which it starts.
+ *
+ * An index is a set of segment files, named <prefix>NNNNNN.mfi. Each holds a
+ * sorted term table and delta-coded postings, and is searched in place
+ * through mmap. Indexing more files just adds segments, and Mf_MergeIndex
+ * combines them when there are too many. */
+
+/* types */
+typedef struct __MfIndex MfIndex;
+typedef struct __MfIndexWriter MfIndexWriter;
+typedef struct __MfIndexHit MfIndexHit;
+
+#define MF_INDEX_GRAM   5 /* notes per term */
+
+/* a file matching a query */
+struct __MfIndexHit {
+    uint32_t file;
+    uint32_t matches; /* how many of the query's distinct terms it has */
+    uint32_t tick; /* where the earliest matching term starts */
+};
+
+/* start adding to the index at prefix. Postings are kept in memory until
+ * there are enough for a segment, or the writer is closed. A writer is for
+ * one thread at a time. */
+MfIndexWriter *Mf_OpenIndexWriter(const char *prefix);
+
+/* index a standard MIDI file in memory (without decoding it), or a decoded
+ * file */
+PmError Mf_IndexBuffer(MfIndexWriter *writer, uint32_t fileIndex, const unsigned char *buf, size_t length);
+PmError Mf_IndexFile(MfIndexWriter *writer, uint32_t fileIndex, MfFile *file);
+
+/* write out the last segment and finish */
+PmError Mf_CloseIndexWriter(MfIndexWriter *writer);
+
+/* index a whole corpus of files using up to threads threads. Each file's
+ * index is firstIndex plus its position in paths; files which can't be read
+ * are skipped. */
+PmError Mf_IndexCorpus(const char *prefix, const char **paths, uint32_t count, uint32_t firstIndex, int threads);
+
+/* combine all of an index's segments into one */
+PmError Mf_MergeIndex(const char *prefix);
+
+/* open an index for searching, or NULL if it has no segments */
+MfIndex *Mf_OpenIndex(const char *prefix);
+void Mf_CloseIndex(MfIndex *index);
+
+/* find the files containing a melody, given as the keys and onset ticks (at
+ * any resolution) of its notes, in order. At least MF_INDEX_GRAM notes are
+ * needed. Up to maxHits hits are stored, best first, and the number stored is
+ * returned. */
+int32_t Mf_IndexQuery(MfIndex *index, const uint8_t *keys, const uint32_t *ticks, int noteCt,
+                      MfIndexHit *hits, int32_t maxHits);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midifiter.h"
+
+#include "midifcodec.h"
+#include "midifile.h"
+#include "midifilealloc.h"
+
+/* file-local miscellany */
+static void Mf_IterAdvance(MfIter *iter, int trackno);
+static int Mf_IterDecode(MfIterTrack *track, int trackno);
+static int Mf_IterBignum(MfIterTrack *track, uint32_t *into);
+
+#define READ4(buf) (((uint32_t) (buf)[0] << 24) + ((buf)[1] << 16) + ((buf)[2] << 8) + (buf)[3])
+#define READ2(buf) (((buf)[0] << 8) + (buf)[1])
+
+/* start iterating over a file */
+PmError Mf_IterOpenFile(MfIter *iter, MfFile *file)
+{
+    int i;
+
+    memset(iter, 0, sizeof(MfIter));
+    iter->format = file->format;
+    iter->timeDivision = file->timeDivision;
+    iter->trackCt = file->trackCt;
+    iter->tracks = Mf_Calloc((file->trackCt ? file->trackCt : 1) * sizeof(MfIterTrack));
+
+    for (i = 0; i < file->trackCt; i++) {
+        Mf_WalkTrack(&iter->tracks[i].walk, file->tracks[i]);
+        iter->tracks[i].file = 1;
+        Mf_IterAdvance(iter, i);
+    }
+
+    return pmNoError;
+}
+
+/* start iterating over a standard MIDI file in memory */
+PmError Mf_IterOpenBuffer(MfIter *iter, const unsigned char *buf, size_t length)
+{
+    const unsigned char *cur, *end;
+    uint32_t chunkSize;
+    uint16_t expectedTracks;
+    MfIterTrack *track;
+    int i;
+
+    memset(iter, 0, sizeof(MfIter));
+
+    /* the header */
+    if (length < 14 || memcmp(buf, "MThd", 4)) return pmBadData;
+    chunkSize = READ4(buf + 4);
+    if (chunkSize < 6 || chunkSize > length - 8) return pmBadData;
+    iter->format = READ2(buf + 8);
+    expectedTracks = READ2(buf + 10);
+    iter->timeDivision = READ2(buf + 12);
+
+    /* find all the track chunks */
+    iter->tracks = Mf_Calloc((expectedTracks ? expectedTracks : 1) * sizeof(MfIterTrack));
+    cur = buf + 8 + chunkSize;
+    end = buf + length;
+    while (iter->trackCt < expectedTracks && end - cur >= 8) {
+        chunkSize = READ4(cur + 4);
+        if (chunkSize > (size_t) (end - cur - 8)) chunkSize = end - cur - 8;
+
+        if (!memcmp(cur, "MTrk", 4)) {
+            track = &iter->tracks[iter->trackCt++];
+            track->cur = cur + 8;
+            track->end = cur + 8 + chunkSize;
+        }
+
+        cur += 8 + chunkSize;
+    }
+
+    for (i = 0; i < iter->trackCt; i++) Mf_IterAdvance(iter, i);
+
+    return iter->perr;
+}
+
+/* get the next event, returning 0 at the end (or on error, see iter->perr) */
+int Mf_IterNext(MfIter *iter, MfIterEvent *into)
+{
+    int i, best = -1;
+    uint32_t bestTick = 0;
+    MfIterTrack *track;
+
+    for (i = 0; i < iter->trackCt; i++) {
+        track = &iter->tracks[i];
+        if (track->done) continue;
+        if (best < 0 || track->next.tick < bestTick) {
+            best = i;
+            bestTick = track->next.tick;
+        }
+    }
+
+    if (best < 0) return 0;
+
+    *into = iter->tracks[best].next;
+    Mf_IterAdvance(iter, best);
+    return 1;
+}
+
+/* finish iterating */
+void Mf_IterClose(MfIter *iter)
+{
+    AL.free(iter->tracks);
+    iter->tracks = NULL;
+}
+
+/* load the lookahead event for this track */
+static void Mf_IterAdvance(MfIter *iter, int trackno)
+{
+    MfIterTrack *track = &iter->tracks[trackno];
+    MfIterEvent *next = &track->next;
+    MfEvent *event;
+
+    if (!track->file) {
+        /* from bytes */
+        if (track->cur >= track->end) {
+            track->done = 1;
+        } else if (Mf_IterDecode(track, trackno)) {
+            track->done = 1;
+            iter->perr = pmBadData;
+        }
+        return;
+    }
+
+    /* from an MfFile, with patterns expanded */
+    event = Mf_WalkNext(&track->walk);
+    if (!event) {
+        track->done = 1;
+        return;
+    }
+
+    next->tick = track->walk.tick;
+    next->track = trackno;
+    next->status = Pm_MessageStatus(event->e.message);
+    next->data1 = Pm_MessageData1(event->e.message);
+    next->data2 = Pm_MessageData2(event->e.message);
+    next->event = event;
+    if (event->meta) {
+        next->metaType = event->meta->type;
+        next->metaLength = event->meta->length;
+        next->metaData = event->meta->data;
+    } else {
+        next->metaType = 0;
+        next->metaLength = 0;
+        next->metaData = NULL;
+    }
+}
+
+/* decode the next event from a byte track, returning nonzero on bad data */
+static int Mf_IterDecode(MfIterTrack *track, int trackno)
+{
+    MfIterEvent *next = &track->next;
+    const MfStatusInfo *info;
+    uint32_t deltaTm, length;
+    uint8_t status;
+
+    if (Mf_IterBignum(track, &deltaTm)) return 1;
+    next->tick += deltaTm;
+    next->track = trackno;
+    next->event = NULL;
+
+    if (track->cur >= track->end) return 1;
+    status = *track->cur;
+    info = &Mf_StatusTable[status];
+    if (info->kind == MF_KIND_DATA) {
+        /* running status */
+        status = track->status;
+        info = &Mf_StatusTable[status];
+        if (!info->running) return 1;
+    } else {
+        track->cur++;
+    }
+    next->status = status;
+
+    if (info->kind == MF_KIND_CHANNEL) {
+        track->status = status;
+        if (track->end - track->cur < info->dataLength) return 1;
+        next->data1 = track->cur[0];
+        next->data2 = (info->dataLength == 2) ? track->cur[1] : 0;
+        track->cur += info->dataLength;
+        next->metaType = 0;
+        next->metaLength = 0;
+        next->metaData = NULL;
+
+    } else if (info->kind == MF_KIND_SYSEX || info->kind == MF_KIND_META) {
+        if (info->kind == MF_KIND_META) {
+            if (track->cur >= track->end) return 1;
+            next->metaType = *track->cur++;
+        } else {
+            next->metaType = status;
+        }
+
+        if (Mf_IterBignum(track, &length)) return 1;
+        if (length > (size_t) (track->end - track->cur)) return 1;
+        next->metaLength = length;
+        next->metaData = track->cur;
+        track->cur += length;
+
+        next->data1 = (length >= 1) ? next->metaData[0] : 0;
+        next->data2 = (length >= 2) ? next->metaData[1] : 0;
+
+    } else {
+        return 1;
+
+    }
+
+    return 0;
+}
+
+static int Mf_IterBignum(MfIterTrack *track, uint32_t *into)
+{
+    uint32_t ret = 0;
+    unsigned char cur;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (track->cur >= track->end) return 1;
+        cur = *track->cur++;
+        ret = (ret << 7) + (cur & 0x7F);
+        if (!(cur & 0x80)) {
+            *into = ret;
+            return 0;
+        }
+    }
+
+    return 1;
+}
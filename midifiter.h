@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFITER_H
+#define MIDIFITER_H
+
+/* this is an internal header */
+#include "midifile.h"
+
+/* An iterator over all the events of a file in time order, merged across
+ * tracks. It can run over a decoded MfFile or directly over the bytes of a
+ * standard MIDI file, in which case nothing is allocated per event. */
+
+/* types */
+typedef struct __MfIter MfIter;
+typedef struct __MfIterTrack MfIterTrack;
+typedef struct __MfIterEvent MfIterEvent;
+
+/* an event as seen through an iterator */
+struct __MfIterEvent {
+    uint32_t tick;
+    int track;
+    uint8_t status, data1, data2;
+
+    /* meta-events and SysEx only */
+    uint8_t metaType;
+    uint32_t metaLength;
+    const unsigned char *metaData;
+
+    /* the underlying event, if iterating over an MfFile (its own times may be
+     * relative to a pattern) */
+    MfEvent *event;
+};
+
+/* per-track iteration state */
+struct __MfIterTrack {
+    /* over an MfFile */
+    int file;
+    MfWalk walk;
+
+    /* over SMF bytes */
+    const unsigned char *cur, *end;
+    uint8_t status;
+
+    /* lookahead */
+    int done;
+    MfIterEvent next;
+};
+
+struct __MfIter {
+    uint16_t format, timeDivision, trackCt;
+    MfIterTrack *tracks;
+    PmError perr;
+};
+
+/* start iterating over a file */
+PmError Mf_IterOpenFile(MfIter *iter, MfFile *file);
+
+/* start iterating over a standard MIDI file in memory */
+PmError Mf_IterOpenBuffer(MfIter *iter, const unsigned char *buf, size_t length);
+
+/* get the next event, returning 0 at the end (or on error, see iter->perr) */
+int Mf_IterNext(MfIter *iter, MfIterEvent *into);
+
+/* finish iterating */
+void Mf_IterClose(MfIter *iter);
+
+#endif
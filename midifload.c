@@ -0,0 +1,477 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef MF_HAVE_LIBURING
+#define _GNU_SOURCE /* for statx */
+#include <liburing.h>
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "midifload.h"
+
+#include "midifile.h"
+#include "midifilealloc.h"
+
+#define LOAD_DEPTH      64 /* files being read or waiting to be decoded */
+#define LOAD_READERS    16 /* reading threads, without io_uring */
+
+/* a loaded file waiting to be decoded */
+typedef struct __MfLoaded MfLoaded;
+struct __MfLoaded {
+    uint32_t index;
+    unsigned char *buf;
+    size_t length, size;
+};
+
+/* a buffer not in use */
+typedef struct __MfLoadBuffer MfLoadBuffer;
+struct __MfLoadBuffer {
+    unsigned char *buf;
+    size_t size;
+};
+
+typedef struct __MfLoader MfLoader;
+struct __MfLoader {
+    const char **paths;
+    uint32_t count, next;
+    MfLoadFunc func;
+    void *arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t readyCond, creditCond;
+
+    /* each file being read or decoded holds a credit, so memory is bounded */
+    int credits;
+
+    /* loaded files, in a ring */
+    MfLoaded ready[LOAD_DEPTH];
+    int readyHead, readyCt;
+
+    /* buffers to reuse */
+    MfLoadBuffer pool[LOAD_DEPTH];
+    int poolCt;
+
+    int readersLeft;
+    uint32_t loaded;
+};
+
+/* a decoding thread */
+typedef struct __MfLoadWorker MfLoadWorker;
+struct __MfLoadWorker {
+    MfLoader *loader;
+    int id;
+};
+
+#ifdef MF_HAVE_LIBURING
+/* a file in flight through io_uring */
+typedef struct __MfLoadSlot MfLoadSlot;
+struct __MfLoadSlot {
+    enum { SLOT_FREE, SLOT_OPEN, SLOT_STAT, SLOT_READ } stage;
+    uint32_t index;
+    int fd;
+    struct statx stx;
+    unsigned char *buf;
+    size_t size, length;
+};
+#endif
+
+/* file-local miscellany */
+static void *Mf_LoadReader(void *vl);
+static int Mf_LoadRead(MfLoader *l, uint32_t index, unsigned char **buf, size_t *size, size_t *length);
+static void *Mf_LoadWorkerThread(void *vw);
+static int Mf_LoadTake(MfLoader *l, uint32_t *index, int wait);
+static void Mf_LoadBuf(MfLoader *l, unsigned char **buf, size_t *size, size_t need);
+static void Mf_LoadReady(MfLoader *l, uint32_t index, unsigned char *buf, size_t length, size_t size);
+static void Mf_LoadRelease(MfLoader *l, unsigned char *buf, size_t size);
+static void Mf_LoadReadMidi(void *vinto, int worker, uint32_t index, unsigned char *buf, size_t length);
+#ifdef MF_HAVE_LIBURING
+static void *Mf_LoadUring(void *vring);
+#endif
+
+/* load a corpus */
+uint32_t Mf_LoadCorpus(const char **paths, uint32_t count, int threads, MfLoadFunc func, void *arg)
+{
+    MfLoader l;
+    MfLoadWorker *workers;
+    pthread_t *workerThreads, readerThreads[LOAD_READERS];
+    unsigned char *buf;
+    size_t size, length;
+    uint32_t index;
+    int i, workerCt, readerCt = 0;
+#ifdef MF_HAVE_LIBURING
+    struct io_uring ring;
+    void *uringArgs[2];
+#endif
+
+    if (threads < 1) threads = 1;
+
+    memset(&l, 0, sizeof(l));
+    l.paths = paths;
+    l.count = count;
+    l.func = func;
+    l.arg = arg;
+    l.credits = LOAD_DEPTH;
+    l.readersLeft = 1; /* until they're counted */
+    pthread_mutex_init(&l.lock, NULL);
+    pthread_cond_init(&l.readyCond, NULL);
+    pthread_cond_init(&l.creditCond, NULL);
+
+    /* start decoding */
+    workers = Mf_Malloc(threads * sizeof(MfLoadWorker));
+    workerThreads = Mf_Malloc(threads * sizeof(pthread_t));
+    for (workerCt = 0; workerCt < threads; workerCt++) {
+        workers[workerCt].loader = &l;
+        workers[workerCt].id = workerCt;
+        if (pthread_create(&workerThreads[workerCt], NULL, Mf_LoadWorkerThread, &workers[workerCt])) break;
+    }
+
+    /* and reading. The readers wait on the lock until they've all been
+     * counted. */
+    pthread_mutex_lock(&l.lock);
+#ifdef MF_HAVE_LIBURING
+    if (workerCt && io_uring_queue_init(LOAD_DEPTH, &ring, 0) == 0) {
+        uringArgs[0] = &l;
+        uringArgs[1] = &ring;
+        if (pthread_create(&readerThreads[0], NULL, Mf_LoadUring, uringArgs) == 0) readerCt = 1;
+        else io_uring_queue_exit(&ring);
+    }
+    if (!readerCt)
+#endif
+    {
+        if (workerCt) {
+            for (readerCt = 0; readerCt < LOAD_READERS; readerCt++) {
+                if (pthread_create(&readerThreads[readerCt], NULL, Mf_LoadReader, &l)) break;
+            }
+        }
+    }
+    l.readersLeft = readerCt ? readerCt : 1;
+    pthread_mutex_unlock(&l.lock);
+
+    if (!workerCt) {
+        /* no threads at all, so do it all here, one file at a time */
+        buf = NULL;
+        size = 0;
+        for (index = 0; index < count; index++) {
+            if (!Mf_LoadRead(&l, index, &buf, &size, &length)) continue;
+            func(arg, 0, index, buf, length);
+            l.loaded++;
+        }
+        if (buf) AL.free(buf);
+    } else if (!readerCt) {
+        Mf_LoadReader(&l);
+    }
+
+    while (readerCt > 0) pthread_join(readerThreads[--readerCt], NULL);
+    while (workerCt > 0) pthread_join(workerThreads[--workerCt], NULL);
+
+    for (i = 0; i < l.poolCt; i++) AL.free(l.pool[i].buf);
+    AL.free(workerThreads);
+    AL.free(workers);
+    pthread_cond_destroy(&l.creditCond);
+    pthread_cond_destroy(&l.readyCond);
+    pthread_mutex_destroy(&l.lock);
+
+    return l.loaded;
+}
+
+/* read in many MIDI files */
+uint32_t Mf_ReadMidiFiles(MfFile **into, const char **paths, uint32_t count, int threads)
+{
+    uint32_t i, ret = 0;
+
+    memset(into, 0, count * sizeof(MfFile *));
+    Mf_LoadCorpus(paths, count, threads, Mf_LoadReadMidi, into);
+    for (i = 0; i < count; i++) {
+        if (into[i]) ret++;
+    }
+    return ret;
+}
+
+static void Mf_LoadReadMidi(void *vinto, int worker, uint32_t index, unsigned char *buf, size_t length)
+{
+    MfFile **into = (MfFile **) vinto;
+    MfFile *file = NULL;
+
+    /* the buffer is reused, so nothing can be borrowed from it */
+    if (Mf_ReadMidiBuffer(&file, buf, length, 0)) {
+        if (file) Mf_FreeFile(file);
+        return;
+    }
+    into[index] = file;
+}
+
+/* a reading thread, with blocking reads */
+static void *Mf_LoadReader(void *vl)
+{
+    MfLoader *l = (MfLoader *) vl;
+    unsigned char *buf;
+    size_t size, length;
+    uint32_t index;
+
+    while (Mf_LoadTake(l, &index, 1)) {
+        buf = NULL;
+        size = 0;
+        if (Mf_LoadRead(l, index, &buf, &size, &length)) Mf_LoadReady(l, index, buf, length, size);
+        else Mf_LoadRelease(l, buf, size);
+    }
+
+    pthread_mutex_lock(&l->lock);
+    if (--l->readersLeft == 0) pthread_cond_broadcast(&l->readyCond);
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+/* read a whole file with blocking calls, into *buf if it's big enough or a
+ * buffer from the pool if not */
+static int Mf_LoadRead(MfLoader *l, uint32_t index, unsigned char **buf, size_t *size, size_t *length)
+{
+    struct stat sbuf;
+    ssize_t rd = 0;
+    int fd;
+
+    fd = open(l->paths[index], O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &sbuf) || sbuf.st_size <= 0) {
+        close(fd);
+        return 0;
+    }
+
+    if (*size < (size_t) sbuf.st_size) {
+        if (*buf) AL.free(*buf);
+        Mf_LoadBuf(l, buf, size, sbuf.st_size);
+    }
+    for (*length = 0; *length < (size_t) sbuf.st_size; *length += rd) {
+        rd = read(fd, *buf + *length, sbuf.st_size - *length);
+        if (rd <= 0) break;
+    }
+    close(fd);
+
+    return (rd >= 0);
+}
+
+/* a decoding thread */
+static void *Mf_LoadWorkerThread(void *vw)
+{
+    MfLoadWorker *w = (MfLoadWorker *) vw;
+    MfLoader *l = w->loader;
+    MfLoaded loaded;
+
+    while (1) {
+        pthread_mutex_lock(&l->lock);
+        while (!l->readyCt && l->readersLeft) pthread_cond_wait(&l->readyCond, &l->lock);
+        if (!l->readyCt) {
+            pthread_mutex_unlock(&l->lock);
+            break;
+        }
+        loaded = l->ready[l->readyHead];
+        l->readyHead = (l->readyHead + 1) % LOAD_DEPTH;
+        l->readyCt--;
+        pthread_mutex_unlock(&l->lock);
+
+        l->func(l->arg, w->id, loaded.index, loaded.buf, loaded.length);
+
+        pthread_mutex_lock(&l->lock);
+        l->loaded++;
+        pthread_mutex_unlock(&l->lock);
+        Mf_LoadRelease(l, loaded.buf, loaded.size);
+    }
+
+    return NULL;
+}
+
+/* take the next file to read, and a credit for it. If wait is 0, returns 0
+ * rather than waiting for a credit; *index is then count if there are no
+ * files left. */
+static int Mf_LoadTake(MfLoader *l, uint32_t *index, int wait)
+{
+    pthread_mutex_lock(&l->lock);
+    while (wait && !l->credits && l->next < l->count) pthread_cond_wait(&l->creditCond, &l->lock);
+    if (!l->credits || l->next >= l->count) {
+        *index = l->next;
+        pthread_mutex_unlock(&l->lock);
+        return 0;
+    }
+    l->credits--;
+    *index = l->next++;
+    pthread_mutex_unlock(&l->lock);
+    return 1;
+}
+
+/* get a buffer of at least need bytes, from the pool if possible */
+static void Mf_LoadBuf(MfLoader *l, unsigned char **buf, size_t *size, size_t need)
+{
+    MfLoadBuffer pooled;
+
+    pooled.buf = NULL;
+    pthread_mutex_lock(&l->lock);
+    if (l->poolCt) pooled = l->pool[--l->poolCt];
+    pthread_mutex_unlock(&l->lock);
+
+    if (pooled.buf && pooled.size < need) {
+        AL.free(pooled.buf);
+        pooled.buf = NULL;
+    }
+    if (!pooled.buf) {
+        pooled.buf = Mf_Malloc(need);
+        pooled.size = need;
+    }
+
+    *buf = pooled.buf;
+    *size = pooled.size;
+}
+
+/* hand a loaded file to the decoders */
+static void Mf_LoadReady(MfLoader *l, uint32_t index, unsigned char *buf, size_t length, size_t size)
+{
+    MfLoaded *loaded;
+
+    pthread_mutex_lock(&l->lock);
+    loaded = &l->ready[(l->readyHead + l->readyCt++) % LOAD_DEPTH];
+    loaded->index = index;
+    loaded->buf = buf;
+    loaded->length = length;
+    loaded->size = size;
+    pthread_cond_signal(&l->readyCond);
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* finish with a file, returning its buffer (if any) and credit */
+static void Mf_LoadRelease(MfLoader *l, unsigned char *buf, size_t size)
+{
+    pthread_mutex_lock(&l->lock);
+    if (buf) {
+        l->pool[l->poolCt].buf = buf;
+        l->pool[l->poolCt].size = size;
+        l->poolCt++;
+    }
+    l->credits++;
+    pthread_cond_signal(&l->creditCond);
+    pthread_mutex_unlock(&l->lock);
+}
+
+#ifdef MF_HAVE_LIBURING
+/* the reading thread with io_uring: each file is opened, sized and read by
+ * queued operations, with up to LOAD_DEPTH files in flight */
+static void *Mf_LoadUring(void *vargs)
+{
+    MfLoader *l = (MfLoader *) ((void **) vargs)[0];
+    struct io_uring *ring = (struct io_uring *) ((void **) vargs)[1];
+    MfLoadSlot slots[LOAD_DEPTH], *slot;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    uint32_t index;
+    int i, active = 0, res, failed;
+
+    for (i = 0; i < LOAD_DEPTH; i++) slots[i].stage = SLOT_FREE;
+
+    while (1) {
+        /* start as many files as there are credits for */
+        for (i = 0; i < LOAD_DEPTH; i++) {
+            if (slots[i].stage != SLOT_FREE) continue;
+            if (!Mf_LoadTake(l, &index, !active)) break;
+            slot = &slots[i];
+            slot->stage = SLOT_OPEN;
+            slot->index = index;
+            slot->fd = -1;
+            slot->buf = NULL;
+            slot->size = slot->length = 0;
+            sqe = io_uring_get_sqe(ring);
+            io_uring_prep_openat(sqe, AT_FDCWD, l->paths[index], O_RDONLY, 0);
+            io_uring_sqe_set_data(sqe, slot);
+            active++;
+        }
+        if (!active) break;
+
+        io_uring_submit(ring);
+        if (io_uring_wait_cqe(ring, &cqe)) break;
+
+        /* and move along everything that's finished a step */
+        do {
+            slot = (MfLoadSlot *) io_uring_cqe_get_data(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(ring, cqe);
+            failed = (res < 0);
+
+            if (!failed) switch (slot->stage) {
+                case SLOT_OPEN:
+                    slot->fd = res;
+                    slot->stage = SLOT_STAT;
+                    sqe = io_uring_get_sqe(ring);
+                    io_uring_prep_statx(sqe, slot->fd, "", AT_EMPTY_PATH, STATX_SIZE, &slot->stx);
+                    io_uring_sqe_set_data(sqe, slot);
+                    break;
+
+                case SLOT_STAT:
+                    if (slot->stx.stx_size == 0) {
+                        failed = 1;
+                        break;
+                    }
+                    Mf_LoadBuf(l, &slot->buf, &slot->size, slot->stx.stx_size);
+                    slot->stage = SLOT_READ;
+                    sqe = io_uring_get_sqe(ring);
+                    io_uring_prep_read(sqe, slot->fd, slot->buf, slot->stx.stx_size, 0);
+                    io_uring_sqe_set_data(sqe, slot);
+                    break;
+
+                case SLOT_READ:
+                    slot->length += res;
+                    if (res > 0 && slot->length < slot->stx.stx_size) {
+                        /* a short read, so keep going */
+                        sqe = io_uring_get_sqe(ring);
+                        io_uring_prep_read(sqe, slot->fd, slot->buf + slot->length,
+                                           slot->stx.stx_size - slot->length, slot->length);
+                        io_uring_sqe_set_data(sqe, slot);
+                        break;
+                    }
+                    close(slot->fd);
+                    Mf_LoadReady(l, slot->index, slot->buf, slot->length, slot->size);
+                    slot->stage = SLOT_FREE;
+                    active--;
+                    break;
+
+                default:
+                    break;
+            }
+
+            if (failed) {
+                if (slot->fd >= 0) close(slot->fd);
+                Mf_LoadRelease(l, slot->buf, slot->size);
+                slot->stage = SLOT_FREE;
+                active--;
+            }
+        } while (io_uring_peek_cqe(ring, &cqe) == 0);
+    }
+
+    io_uring_queue_exit(ring);
+
+    pthread_mutex_lock(&l->lock);
+    if (--l->readersLeft == 0) pthread_cond_broadcast(&l->readyCond);
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFLOAD_H
+#define MIDIFLOAD_H
+
+#include "midifile.h"
+
+/* Loading whole corpora of files, with many reads in flight at once and
+ * decoding overlapped with reading. Built with MF_HAVE_LIBURING (and linked
+ * with -luring), reads are queued through io_uring from a single thread;
+ * otherwise, or if io_uring isn't available at run time, a pool of threads
+ * reads with blocking calls. Either way, at most a fixed number of files are
+ * held in memory at once. */
+
+/* called with each loaded file. worker is the number of the calling thread,
+ * from 0 to threads-1, for keeping per-thread state. buf belongs to the
+ * loader and is only valid during the call. */
+typedef void (*MfLoadFunc)(void *arg, int worker, uint32_t index, unsigned char *buf, size_t length);
+
+/* load the files at paths, calling func for each from up to threads threads
+ * at once, in no particular order. Files which can't be read are skipped.
+ * Returns the number of files loaded. */
+uint32_t Mf_LoadCorpus(const char **paths, uint32_t count, int threads, MfLoadFunc func, void *arg);
+
+/* read in many MIDI files at once. Files which can't be read or decoded are
+ * left NULL. Returns the number read. */
+uint32_t Mf_ReadMidiFiles(MfFile **into, const char **paths, uint32_t count, int threads);
+
+#endif
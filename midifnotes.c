@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midifnotes.h"
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifilealloc.h"
+#include "midifiter.h"
+
+/* file-local miscellany */
+static PmError Mf_GetNotesIter(MfNotes **into, MfIter *iter);
+static void Mf_IndexNotes(MfNotes *notes);
+
+#define NO_NOTE ((uint32_t) -1)
+
+/* extract the notes from a decoded file */
+PmError Mf_GetNotes(MfNotes **into, MfFile *file)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenFile(&iter, file))) return perr;
+    perr = Mf_GetNotesIter(into, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+/* extract the notes from a standard MIDI file in memory */
+PmError Mf_GetNotesBuffer(MfNotes **into, const unsigned char *buf, size_t length)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenBuffer(&iter, buf, length))) {
+        Mf_IterClose(&iter);
+        return perr;
+    }
+    perr = Mf_GetNotesIter(into, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+static PmError Mf_GetNotesIter(MfNotes **into, MfIter *iter)
+{
+    MfNotes *notes;
+    MfNote *note;
+    MfIterEvent ev;
+    uint32_t cap = 0, i, lastTick = 0;
+    uint8_t type, channel, key;
+
+    /* open notes are kept as a FIFO per channel and key, linked through
+     * openNext */
+    uint32_t openHead[16][128], openTail[16][128];
+    uint32_t *openNext = NULL;
+
+    memset(openHead, 0xFF, sizeof(openHead));
+    memset(openTail, 0xFF, sizeof(openTail));
+
+    notes = Mf_New(MfNotes);
+
+    /* events come in time order, so notes are created sorted by start */
+    while (Mf_IterNext(iter, &ev)) {
+        lastTick = ev.tick;
+        if (ev.status >= 0xF0) continue;
+
+        type = ev.status >> 4;
+        channel = ev.status & 0xF;
+        key = ev.data1 & 0x7F;
+
+        if (type == MIDI_NOTE_ON && ev.data2) {
+            if (notes->noteCt == cap) {
+                MfNote *newNotes;
+                uint32_t *newNext;
+
+                cap = cap ? cap * 2 : 256;
+                newNotes = Mf_Malloc(cap * sizeof(MfNote));
+                newNext = Mf_Malloc(cap * sizeof(uint32_t));
+                if (notes->notes) {
+                    memcpy(newNotes, notes->notes, notes->noteCt * sizeof(MfNote));
+                    memcpy(newNext, openNext, notes->noteCt * sizeof(uint32_t));
+                    AL.free(notes->notes);
+                    AL.free(openNext);
+                }
+                notes->notes = newNotes;
+                openNext = newNext;
+            }
+
+            i = notes->noteCt++;
+            note = &notes->notes[i];
+            note->startTm = note->endTm = ev.tick;
+            note->track = ev.track;
+            note->key = key;
+            note->velocity = ev.data2;
+            note->channel = channel;
+
+            /* add it to the open list */
+            openNext[i] = NO_NOTE;
+            if (openTail[channel][key] == NO_NOTE) openHead[channel][key] = i;
+            else openNext[openTail[channel][key]] = i;
+            openTail[channel][key] = i;
+
+        } else if (type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF) {
+            /* close the oldest open note */
+            i = openHead[channel][key];
+            if (i == NO_NOTE) continue;
+            notes->notes[i].endTm = ev.tick;
+            openHead[channel][key] = openNext[i];
+            if (openHead[channel][key] == NO_NOTE) openTail[channel][key] = NO_NOTE;
+
+        }
+    }
+
+    /* anything left open lasts until the end */
+    for (channel = 0; channel < 16; channel++) {
+        for (key = 0; key < 128; key++) {
+            for (i = openHead[channel][key]; i != NO_NOTE; i = openNext[i])
+                notes->notes[i].endTm = lastTick;
+        }
+    }
+    if (openNext) AL.free(openNext);
+
+    Mf_IndexNotes(notes);
+
+    *into = notes;
+    return iter->perr;
+}
+
+void Mf_FreeNotes(MfNotes *notes)
+{
+    if (notes->notes) AL.free(notes->notes);
+    if (notes->maxEnd) AL.free(notes->maxEnd);
+    AL.free(notes);
+}
+
+/* build the interval tree. The sorted array is itself the tree: leaves are at
+ * even indexes, and a node at level k has its children k-1 levels down at
+ * i - 2^(k-1) and i + 2^(k-1). */
+static void Mf_IndexNotes(MfNotes *notes)
+{
+    uint32_t n = notes->noteCt, i, lastI = 0, last = 0, x, left, right, e;
+    uint32_t *maxEnd;
+    int k;
+
+    notes->rootLevel = -1;
+    if (n == 0) return;
+    maxEnd = notes->maxEnd = Mf_Malloc(n * sizeof(uint32_t));
+
+    /* leaves */
+    for (i = 0; i < n; i += 2) {
+        lastI = i;
+        last = maxEnd[i] = notes->notes[i].endTm;
+    }
+
+    /* then internal nodes, bottom up */
+    for (k = 1; ((uint64_t) 1 << k) <= n; k++) {
+        x = (uint32_t) 1 << (k - 1);
+        for (i = (x << 1) - 1; i < n; i += x << 2) {
+            left = maxEnd[i - x];
+            right = (i + x < n) ? maxEnd[i + x] : last;
+            e = notes->notes[i].endTm;
+            if (left > e) e = left;
+            if (right > e) e = right;
+            maxEnd[i] = e;
+        }
+
+        /* move lastI up to its parent, keeping last as the max of the
+         * rightmost subtree */
+        lastI = ((lastI >> k) & 1) ? lastI - x : lastI + x;
+        if (lastI < n && maxEnd[lastI] > last) last = maxEnd[lastI];
+    }
+
+    notes->rootLevel = k - 1;
+}
+
+/* find all notes sounding in [startTm, endTm) */
+uint32_t Mf_NotesQuery(MfNotes *notes, uint32_t startTm, uint32_t endTm, uint32_t *into, uint32_t length)
+{
+    struct {
+        uint64_t x;
+        int k, w;
+    } stack[64], z;
+    int t = 0;
+    uint32_t found = 0;
+    uint64_t i, i1, n = notes->noteCt, y;
+    MfNote *all = notes->notes;
+
+#define FOUND(idx) do { \
+    if (found < length) into[found] = (idx); \
+    found++; \
+} while (0)
+
+    if (notes->rootLevel < 0) return 0;
+
+    /* walk the tree top down, left to right, so results come out sorted */
+    stack[t].k = notes->rootLevel;
+    stack[t].x = ((uint64_t) 1 << notes->rootLevel) - 1;
+    stack[t++].w = 0;
+    while (t) {
+        z = stack[--t];
+        if (z.k <= 3) {
+            /* small subtree, just scan it */
+            i = z.x >> z.k << z.k;
+            i1 = i + ((uint64_t) 1 << (z.k + 1)) - 1;
+            if (i1 > n) i1 = n;
+            for (; i < i1 && all[i].startTm < endTm; i++) {
+                if (startTm < all[i].endTm) FOUND(i);
+            }
+
+        } else if (z.w == 0) {
+            /* come back to this node after its left child */
+            y = z.x - ((uint64_t) 1 << (z.k - 1));
+            stack[t].k = z.k;
+            stack[t].x = z.x;
+            stack[t++].w = 1;
+            if (y >= n || notes->maxEnd[y] > startTm) {
+                stack[t].k = z.k - 1;
+                stack[t].x = y;
+                stack[t++].w = 0;
+            }
+
+        } else if (z.x < n && all[z.x].startTm < endTm) {
+            /* this node, then its right child */
+            if (startTm < all[z.x].endTm) FOUND(z.x);
+            stack[t].k = z.k - 1;
+            stack[t].x = z.x + ((uint64_t) 1 << (z.k - 1));
+            stack[t++].w = 0;
+
+        }
+    }
+
+#undef FOUND
+
+    return found;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFNOTES_H
+#define MIDIFNOTES_H
+
+#include "midifile.h"
+
+/* Notes as intervals: note-ons are paired with their note-offs (or velocity-0
+ * note-ons) per channel and key, first on first off, and stored sorted by
+ * start tick with an implicit interval tree over them for range queries. */
+
+/* types */
+typedef struct __MfNote MfNote;
+typedef struct __MfNotes MfNotes;
+
+struct __MfNote {
+    uint32_t startTm, endTm;
+    uint16_t track;
+    uint8_t key, velocity, channel;
+};
+
+struct __MfNotes {
+    uint32_t noteCt;
+    MfNote *notes; /* sorted by startTm */
+
+    /* the interval tree: the maximum endTm in each node's subtree, and the
+     * level of the root */
+    uint32_t *maxEnd;
+    int rootLevel;
+};
+
+/* extract the notes from a decoded file */
+PmError Mf_GetNotes(MfNotes **into, MfFile *file);
+
+/* extract the notes from a standard MIDI file in memory */
+PmError Mf_GetNotesBuffer(MfNotes **into, const unsigned char *buf, size_t length);
+
+void Mf_FreeNotes(MfNotes *notes);
+
+/* find all notes sounding in [startTm, endTm). Up to length indexes into
+ * notes->notes are written into into, in order of start tick, and the total
+ * number of matching notes is returned. */
+uint32_t Mf_NotesQuery(MfNotes *notes, uint32_t startTm, uint32_t endTm, uint32_t *into, uint32_t length);
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "midifoptimize.h"
+
+#include "midi.h"
+#include "midifcodec.h"
+#include "midifilealloc.h"
+
+#define OPT_QUEUE   4096    /* events ready to send */
+#define OPT_SLOTS   129     /* values per channel: each controller, then pitch bend */
+#define OPT_BEND    128
+
+/* what's known about one controller (or pitch bend) on one channel */
+typedef struct __MfOptimizerSlot MfOptimizerSlot;
+struct __MfOptimizerSlot {
+    /* the last value sent (-1 if unknown), and when, if it's been sent */
+    int16_t last;
+    uint8_t sent, pending;
+    PtTimestamp sentAt;
+
+    /* the value held back, from what track, when it was due and when it'll
+     * be sent */
+    int16_t value;
+    int track;
+    PtTimestamp valueTs, due;
+};
+
+struct __MfOptimizer {
+    int flags;
+    int32_t interval; /* milliseconds between thinned values */
+    uint32_t bytesPerSecond;
+
+    /* what's known about the port: each value, how many of each note are on,
+     * running status in and out, and when the byte budget next has room, in
+     * microseconds */
+    MfOptimizerSlot slots[16][OPT_SLOTS];
+    uint8_t notes[16][128];
+    uint8_t inStatus, outStatus;
+    int64_t budgetFree;
+
+    /* slots (channel * OPT_SLOTS + slot) holding values back, in order of
+     * when they're due */
+    uint16_t pending[16 * OPT_SLOTS];
+    int32_t pendingCt;
+
+    /* events ready to send */
+    PmEvent queue[OPT_QUEUE];
+    int queueTracks[OPT_QUEUE];
+    int32_t head, used;
+
+    MfOptimizerStats stats;
+};
+
+/* file-local miscellany */
+static uint32_t Mf_OptimizerBytes(uint8_t *pstatus, PmMessage message);
+static void Mf_OptimizerEmit(MfOptimizer *opt, PmMessage message, PtTimestamp timestamp, int track);
+static void Mf_OptimizerValue(MfOptimizer *opt, int channel, int slot, int value, PtTimestamp timestamp, int track);
+static void Mf_OptimizerSend(MfOptimizer *opt, int channel, int slot, int value, PtTimestamp timestamp, int track);
+static void Mf_OptimizerHold(MfOptimizer *opt, int channel, int slot);
+static void Mf_OptimizerRelease(MfOptimizer *opt, PtTimestamp until);
+static void Mf_OptimizerReleaseChannel(MfOptimizer *opt, int channel, PtTimestamp timestamp);
+static void Mf_OptimizerReleaseSlot(MfOptimizer *opt, int index, PtTimestamp timestamp);
+
+/* make an optimizer */
+MfOptimizer *Mf_NewOptimizer(int flags, uint32_t ccRate, uint32_t bytesPerSecond)
+{
+    MfOptimizer *ret = Mf_New(MfOptimizer);
+
+    ret->flags = flags;
+    if (ccRate) ret->interval = (1000 + ccRate - 1) / ccRate;
+    ret->bytesPerSecond = bytesPerSecond;
+    Mf_OptimizerReset(ret);
+    return ret;
+}
+
+void Mf_FreeOptimizer(MfOptimizer *opt)
+{
+    AL.free(opt);
+}
+
+/* forget everything known about the port */
+void Mf_OptimizerReset(MfOptimizer *opt)
+{
+    int c, s;
+
+    memset(opt->slots, 0, sizeof(opt->slots));
+    for (c = 0; c < 16; c++)
+        for (s = 0; s < OPT_SLOTS; s++)
+            opt->slots[c][s].last = -1;
+    memset(opt->notes, 0, sizeof(opt->notes));
+    opt->inStatus = opt->outStatus = 0;
+    opt->budgetFree = 0;
+    opt->pendingCt = 0;
+    opt->head = opt->used = 0;
+}
+
+/* how many more events can be pushed */
+int32_t Mf_OptimizerRoom(MfOptimizer *opt)
+{
+    /* each push sends at most itself and everything held back */
+    int32_t room = OPT_QUEUE - opt->used - opt->pendingCt;
+    return (room > 0) ? room : 0;
+}
+
+/* push an event */
+void Mf_OptimizerPush(MfOptimizer *opt, PmEvent *event, int track)
+{
+    PmMessage message = event->message;
+    PtTimestamp ts = event->timestamp;
+    int type = Pm_MessageType(message), channel = Pm_MessageChannel(message);
+    int data1 = Pm_MessageData1(message), data2 = Pm_MessageData2(message);
+    int i;
+
+    opt->stats.inMessages++;
+    opt->stats.inBytes += Mf_OptimizerBytes(&opt->inStatus, message);
+
+    /* anything held back which is due by now goes first */
+    Mf_OptimizerRelease(opt, ts);
+
+    switch (type) {
+        case MIDI_NOTE_ON:
+            if (data2) {
+                /* the note has to start with the values before it */
+                Mf_OptimizerReleaseChannel(opt, channel, ts);
+                if (opt->notes[channel][data1] < 255) opt->notes[channel][data1]++;
+                break;
+            }
+            /* fallthrough */
+
+        case MIDI_NOTE_OFF:
+            if (opt->flags & MF_OPTIMIZE_NOTE_OFFS) {
+                if (!opt->notes[channel][data1]) {
+                    opt->stats.noteOffs++;
+                    return;
+                }
+            }
+            if (opt->notes[channel][data1]) opt->notes[channel][data1]--;
+
+            if ((opt->flags & MF_OPTIMIZE_RUNNING) && type == MIDI_NOTE_OFF &&
+                opt->outStatus == Pm_MessageStatusGen(MIDI_NOTE_ON, channel) &&
+                (data2 == 0 || data2 == 64)) {
+                message = Pm_Message(opt->outStatus, data1, 0);
+                opt->stats.converted++;
+            }
+            break;
+
+        case MIDI_CONTROLLER:
+            if (data1 == 120 || data1 == 123) {
+                /* all sound off or all notes off */
+                memset(opt->notes[channel], 0, sizeof(opt->notes[channel]));
+            } else if (data1 == 121) {
+                /* reset all controllers, so nothing's known any more; the
+                 * reset itself mustn't be overtaken by held back values */
+                Mf_OptimizerReleaseChannel(opt, channel, ts);
+                Mf_OptimizerEmit(opt, message, ts, track);
+                for (i = 0; i < OPT_SLOTS; i++) opt->slots[channel][i].last = -1;
+                return;
+            }
+
+            if (Mf_ControllerTable[data1] != MF_CC_EVERY) {
+                Mf_OptimizerValue(opt, channel, data1, data2, ts, track);
+                return;
+            }
+
+            /* sequences like RPNs can't have values overtaking them */
+            Mf_OptimizerReleaseChannel(opt, channel, ts);
+            break;
+
+        case MIDI_PITCH_BEND:
+            Mf_OptimizerValue(opt, channel, OPT_BEND, data1 | (data2 << 7), ts, track);
+            return;
+    }
+
+    Mf_OptimizerEmit(opt, message, ts, track);
+}
+
+/* take events ready to send */
+int32_t Mf_OptimizerDrain(MfOptimizer *opt, PtTimestamp now, PmEvent *into, int *track, int32_t length)
+{
+    int32_t rd = 0;
+
+    /* values held back go after everything already pushed */
+    if (!opt->used) Mf_OptimizerRelease(opt, now);
+
+    while (rd < length && opt->used) {
+        into[rd] = opt->queue[opt->head];
+        if (track) track[rd] = opt->queueTracks[opt->head];
+        rd++;
+        opt->head = (opt->head + 1) % OPT_QUEUE;
+        opt->used--;
+        if (!opt->used) Mf_OptimizerRelease(opt, now);
+    }
+
+    return rd;
+}
+
+/* is anything waiting? */
+int Mf_OptimizerPending(MfOptimizer *opt)
+{
+    return opt->used || opt->pendingCt;
+}
+
+/* get the optimizer's statistics */
+void Mf_OptimizerGetStats(MfOptimizer *opt, MfOptimizerStats *into)
+{
+    *into = opt->stats;
+}
+
+/* bytes a message takes on the wire, with running status */
+static uint32_t Mf_OptimizerBytes(uint8_t *pstatus, PmMessage message)
+{
+    uint8_t status = Pm_MessageStatus(message);
+    const MfStatusInfo *info = &Mf_StatusTable[status];
+    uint32_t bytes;
+
+    if (info->kind == MF_KIND_CHANNEL) {
+        bytes = info->dataLength + (status != *pstatus);
+        *pstatus = status;
+        return bytes;
+    }
+
+    /* real-time messages don't interrupt running status, anything else does */
+    if (status < 0xF8) *pstatus = 0;
+    switch (status) {
+        case 0xF1: case 0xF3:   return 2;
+        case 0xF2:              return 3;
+        default:                return 1;
+    }
+}
+
+/* queue a message to be sent */
+static void Mf_OptimizerEmit(MfOptimizer *opt, PmMessage message, PtTimestamp timestamp, int track)
+{
+    int32_t at = (opt->head + opt->used) % OPT_QUEUE;
+    uint32_t bytes = Mf_OptimizerBytes(&opt->outStatus, message);
+    int64_t start, due;
+
+    opt->queue[at].message = message;
+    opt->queue[at].timestamp = timestamp;
+    opt->queueTracks[at] = track;
+    opt->used++;
+
+    opt->stats.outMessages++;
+    opt->stats.outBytes += bytes;
+
+    /* charge it to the port's budget */
+    if (opt->bytesPerSecond) {
+        due = (int64_t) timestamp * 1000;
+        start = (opt->budgetFree > due) ? opt->budgetFree : due;
+        opt->budgetFree = start + (int64_t) bytes * 1000000 / opt->bytesPerSecond;
+        if (start > due) {
+            opt->stats.overBudget++;
+            if (start - due > opt->stats.maxBacklog)
+                opt->stats.maxBacklog = (start - due > UINT32_MAX) ? UINT32_MAX : start - due;
+        }
+    }
+}
+
+/* handle a new controller or pitch bend value */
+static void Mf_OptimizerValue(MfOptimizer *opt, int channel, int slot, int value, PtTimestamp timestamp, int track)
+{
+    MfOptimizerSlot *s = &opt->slots[channel][slot];
+
+    if ((opt->flags & MF_OPTIMIZE_THIN) && opt->interval &&
+        (slot == OPT_BEND || Mf_ControllerTable[slot] == MF_CC_CONTINUOUS) &&
+        s->sent && timestamp < s->sentAt + opt->interval) {
+        /* too soon, so hold it back (instead of anything already held) */
+        if (s->pending) opt->stats.thinned++;
+        else Mf_OptimizerHold(opt, channel, slot);
+        s->value = value;
+        s->track = track;
+        s->valueTs = timestamp;
+        return;
+    }
+
+    Mf_OptimizerSend(opt, channel, slot, value, timestamp, track);
+}
+
+/* send a value, unless it's redundant */
+static void Mf_OptimizerSend(MfOptimizer *opt, int channel, int slot, int value, PtTimestamp timestamp, int track)
+{
+    MfOptimizerSlot *s = &opt->slots[channel][slot];
+
+    if ((opt->flags & MF_OPTIMIZE_REDUNDANT) && s->last == value) {
+        opt->stats.redundant++;
+        return;
+    }
+
+    s->last = value;
+    s->sent = 1;
+    s->sentAt = timestamp;
+    if (slot == OPT_BEND) {
+        Mf_OptimizerEmit(opt, Pm_Message(Pm_MessageStatusGen(MIDI_PITCH_BEND, channel), value & 0x7F, value >> 7),
+                         timestamp, track);
+    } else {
+        Mf_OptimizerEmit(opt, Pm_Message(Pm_MessageStatusGen(MIDI_CONTROLLER, channel), slot, value),
+                         timestamp, track);
+    }
+}
+
+/* start holding back a slot's values, keeping the list in order of due */
+static void Mf_OptimizerHold(MfOptimizer *opt, int channel, int slot)
+{
+    MfOptimizerSlot *s = &opt->slots[channel][slot];
+    uint16_t index = channel * OPT_SLOTS + slot;
+    int32_t i;
+
+    s->pending = 1;
+    s->due = s->sentAt + opt->interval;
+
+    /* usually the latest, so look from the end */
+    for (i = opt->pendingCt; i > 0; i--) {
+        uint16_t other = opt->pending[i - 1];
+        if (opt->slots[other / OPT_SLOTS][other % OPT_SLOTS].due <= s->due) break;
+        opt->pending[i] = other;
+    }
+    opt->pending[i] = index;
+    opt->pendingCt++;
+}
+
+/* send values held back which are due by until */
+static void Mf_OptimizerRelease(MfOptimizer *opt, PtTimestamp until)
+{
+    int32_t i, ct = 0;
+    uint16_t index;
+    MfOptimizerSlot *s;
+
+    while (ct < opt->pendingCt) {
+        index = opt->pending[ct];
+        s = &opt->slots[index / OPT_SLOTS][index % OPT_SLOTS];
+        if (s->due > until) break;
+        Mf_OptimizerReleaseSlot(opt, index, s->due);
+        ct++;
+    }
+
+    if (ct) {
+        for (i = ct; i < opt->pendingCt; i++) opt->pending[i - ct] = opt->pending[i];
+        opt->pendingCt -= ct;
+    }
+}
+
+/* send everything held back on a channel now */
+static void Mf_OptimizerReleaseChannel(MfOptimizer *opt, int channel, PtTimestamp timestamp)
+{
+    int32_t i, kept = 0;
+    uint16_t index;
+
+    for (i = 0; i < opt->pendingCt; i++) {
+        index = opt->pending[i];
+        if (index / OPT_SLOTS == channel) {
+            Mf_OptimizerReleaseSlot(opt, index, timestamp);
+        } else {
+            opt->pending[kept++] = index;
+        }
+    }
+    opt->pendingCt = kept;
+}
+
+/* send a slot's held back value at timestamp (leaving the pending list to
+ * the caller) */
+static void Mf_OptimizerReleaseSlot(MfOptimizer *opt, int index, PtTimestamp timestamp)
+{
+    int channel = index / OPT_SLOTS, slot = index % OPT_SLOTS;
+    MfOptimizerSlot *s = &opt->slots[channel][slot];
+
+    s->pending = 0;
+    if (timestamp - s->valueTs > opt->stats.maxAddedLatency)
+        opt->stats.maxAddedLatency = timestamp - s->valueTs;
+    Mf_OptimizerSend(opt, channel, slot, s->value, timestamp, s->track);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFOPTIMIZE_H
+#define MIDIFOPTIMIZE_H
+
+#include "midifile.h"
+#include "porttime.h"
+
+/* An output stage which cuts down the bytes sent to a MIDI port, for links
+ * (like 5-pin DIN) which dense controller data can saturate. It sits between
+ * the events read for a port and the port itself, and knows what's been
+ * sent to the port, so it has to see everything sent there. It never
+ * allocates or locks, so it can run in real time.
+ *
+ * It only changes controllers which are continuous or switches: bank select,
+ * data entry, (N)RPNs, portamento control and channel mode messages are
+ * always sent as they are. */
+
+/* types */
+typedef struct __MfOptimizer MfOptimizer;
+typedef struct __MfOptimizerStats MfOptimizerStats;
+
+/* drop controller and pitch bend values which don't change anything */
+#define MF_OPTIMIZE_REDUNDANT   1
+/* send continuous controllers and pitch bend at most ccRate times a second
+ * each, holding back the latest value until it's time */
+#define MF_OPTIMIZE_THIN        2
+/* drop note-offs for notes which aren't on */
+#define MF_OPTIMIZE_NOTE_OFFS   4
+/* send note-offs (without a release velocity) as note-ons of velocity 0
+ * where that continues running status */
+#define MF_OPTIMIZE_RUNNING     8
+#define MF_OPTIMIZE_ALL         15
+
+struct __MfOptimizerStats {
+    /* messages in and out, and their bytes on the wire (with running status);
+     * the difference is what's been saved */
+    uint32_t inMessages, outMessages;
+    uint64_t inBytes, outBytes;
+
+    /* messages dropped as redundant, thinned out or duplicate note-offs, and
+     * note-offs converted to note-ons */
+    uint32_t redundant, thinned, noteOffs, converted;
+
+    /* the most any held back value was delayed, in milliseconds */
+    int32_t maxAddedLatency;
+
+    /* messages sent when the port's byte budget was already spent, and the
+     * most the port fell behind, in microseconds */
+    uint32_t overBudget, maxBacklog;
+};
+
+/* make an optimizer doing flags (MF_OPTIMIZE_*), for a port which can take
+ * bytesPerSecond (0 for no budget) */
+MfOptimizer *Mf_NewOptimizer(int flags, uint32_t ccRate, uint32_t bytesPerSecond);
+void Mf_FreeOptimizer(MfOptimizer *opt);
+
+/* forget everything known about the port, and anything held back (e.g. after
+ * the port has been reset or reopened) */
+void Mf_OptimizerReset(MfOptimizer *opt);
+
+/* how many more events can be pushed before draining */
+int32_t Mf_OptimizerRoom(MfOptimizer *opt);
+
+/* push an event (in time order), from track */
+void Mf_OptimizerPush(MfOptimizer *opt, PmEvent *event, int track);
+
+/* take up to length events ready to send at time now, with their tracks if
+ * track isn't NULL. Returns the number taken. */
+int32_t Mf_OptimizerDrain(MfOptimizer *opt, PtTimestamp now, PmEvent *into, int *track, int32_t length);
+
+/* is anything waiting to be drained, now or later? */
+int Mf_OptimizerPending(MfOptimizer *opt);
+
+/* get the optimizer's statistics so far */
+void Mf_OptimizerGetStats(MfOptimizer *opt, MfOptimizerStats *into);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midifpattern.h"
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifilealloc.h"
+
+/* file-local miscellany */
+static uint32_t Mf_HashEvent(MfEvent *event, int withDelta);
+static int Mf_EventsEqual(MfEvent *a, MfEvent *b, int withDelta);
+static int Mf_RunsEqual(MfEvent **events, uint32_t a, uint32_t b, uint32_t length);
+static int Mf_RunFree(uint8_t *used, uint32_t at, uint32_t length);
+
+#define FNV_PRIME 16777619
+
+/* compact a track by sharing repeated runs of events */
+uint32_t Mf_CompactTrack(MfTrack *track, uint32_t minEvents)
+{
+    MfEvent **events, *event, *ref;
+    MfPattern **patterns, *pattern;
+    uint32_t *starts, *lengths, *hashes, *slots;
+    uint32_t n, i, j, k, p, hash, mask, slot, patternCt = 0, saved = 0;
+    uint8_t *used;
+
+    if (minEvents < 2) minEvents = 2;
+    Mf_ExpandTrack(track);
+
+    /* flatten the track */
+    n = 0;
+    for (event = track->head; event; event = event->next) n++;
+    if (n < minEvents * 2) return 0;
+    events = Mf_Malloc(n * sizeof(MfEvent *));
+    n = 0;
+    for (event = track->head; event; event = event->next) events[n++] = event;
+
+    /* starts[i] is the pattern (plus one) of a run starting at i */
+    starts = Mf_Calloc(n * sizeof(uint32_t));
+    lengths = Mf_Calloc(n * sizeof(uint32_t));
+    used = Mf_Calloc(n);
+    patterns = Mf_Malloc(n / minEvents * sizeof(MfPattern *));
+
+    /* a hash table from the hash of each window of minEvents events (with
+     * the first one's delta time ignored) to where it was first seen */
+    for (mask = 1; mask < n * 2; mask <<= 1);
+    hashes = Mf_Malloc(mask * sizeof(uint32_t));
+    slots = Mf_Calloc(mask * sizeof(uint32_t));
+    mask--;
+
+    i = 0;
+    while (i + minEvents <= n) {
+        hash = Mf_HashEvent(events[i], 0);
+        for (k = 1; k < minEvents; k++) hash = (hash * FNV_PRIME) ^ Mf_HashEvent(events[i + k], 1);
+
+        /* find an earlier run the same as this one, or remember this one */
+        for (slot = hash & mask; slots[slot]; slot = (slot + 1) & mask) {
+            if (hashes[slot] == hash && Mf_RunsEqual(events, slots[slot] - 1, i, minEvents)) break;
+        }
+        if (!slots[slot]) {
+            hashes[slot] = hash;
+            slots[slot] = i + 1;
+            i++;
+            continue;
+        }
+        j = slots[slot] - 1;
+
+        if (starts[j]) {
+            /* that's already a pattern, so this must repeat all of it */
+            k = lengths[j];
+            if (j + k > i || i + k > n || !Mf_RunsEqual(events, j, i, k)) {
+                i++;
+                continue;
+            }
+
+        } else {
+            /* make a new pattern of as much as repeats, without overlapping */
+            if (j + minEvents > i || !Mf_RunFree(used, j, minEvents)) {
+                i++;
+                continue;
+            }
+            for (k = minEvents;
+                 j + k < i && i + k < n && !used[j + k] && Mf_EventsEqual(events[j + k], events[i + k], 1);
+                 k++);
+
+            pattern = Mf_CtxNew(track->ctx, MfPattern);
+            pattern->ctx = track->ctx;
+            patterns[patternCt++] = pattern;
+            starts[j] = patternCt;
+            lengths[j] = k;
+            memset(used + j, 1, k);
+
+        }
+
+        starts[i] = starts[j];
+        lengths[i] = k;
+        memset(used + i, 1, k);
+        i += k;
+    }
+
+    /* now rebuild the track with references */
+    track->head = track->tail = NULL;
+    for (i = 0; i < n; i = p) {
+        if (!starts[i]) {
+            event = events[i];
+            p = i + 1;
+
+        } else {
+            pattern = patterns[starts[i] - 1];
+            k = lengths[i];
+            p = i + k;
+
+            ref = Mf_NewEventCtx(track->ctx);
+            ref->deltaTm = events[i]->deltaTm;
+            ref->absoluteTm = events[i]->absoluteTm;
+            ref->e.message = Pm_Message(MIDI_STATUS_META, 0, 0);
+            ref->meta = Mf_NewMetaCtx(track->ctx, 0);
+            ref->meta->type = 0xFF;
+            ref->meta->flags = MF_META_PATTERN;
+            ref->meta->data = (unsigned char *) pattern;
+            pattern->refs++;
+
+            if (!pattern->head) {
+                /* the first one becomes the pattern */
+                for (j = i; j < p; j++) {
+                    events[j]->absoluteTm -= ref->absoluteTm;
+                    events[j]->next = (j + 1 < p) ? events[j + 1] : NULL;
+                }
+                events[i]->deltaTm = 0;
+                pattern->head = events[i];
+                pattern->tail = events[p - 1];
+                pattern->eventCt = k;
+            } else {
+                for (j = i; j < p; j++) Mf_FreeEventCtx(track->ctx, events[j]);
+                saved += k;
+            }
+            saved--;
+            event = ref;
+
+        }
+
+        event->next = NULL;
+        if (track->tail) track->tail->next = event;
+        else track->head = event;
+        track->tail = event;
+    }
+
+    AL.free(events);
+    AL.free(starts);
+    AL.free(lengths);
+    AL.free(used);
+    AL.free(patterns);
+    AL.free(hashes);
+    AL.free(slots);
+
+    return saved;
+}
+
+uint32_t Mf_CompactFile(MfFile *file, uint32_t minEvents)
+{
+    uint32_t saved = 0;
+    int i;
+    for (i = 0; i < file->trackCt; i++) {
+        saved += Mf_CompactTrack(file->tracks[i], minEvents);
+    }
+    return saved;
+}
+
+/* replace pattern references with copies of their events */
+void Mf_ExpandTrack(MfTrack *track)
+{
+    MfEvent *event, *next, *prev = NULL, *pevent, *copy, *first, *last;
+    MfPattern *pattern;
+
+    for (event = track->head; event; event = next) {
+        next = event->next;
+        if (!(pattern = Mf_EventPattern(event))) {
+            prev = event;
+            continue;
+        }
+
+        first = last = NULL;
+        for (pevent = pattern->head; pevent; pevent = pevent->next) {
+            copy = Mf_CopyEventCtx(track->ctx, pevent);
+            copy->absoluteTm += event->absoluteTm;
+            if (last) last->next = copy;
+            else first = copy;
+            last = copy;
+        }
+        first->deltaTm = event->deltaTm;
+
+        /* and splice them in */
+        if (prev) prev->next = first;
+        else track->head = first;
+        last->next = next;
+        if (!next) track->tail = last;
+        prev = last;
+
+        Mf_FreeEventCtx(track->ctx, event);
+    }
+}
+
+void Mf_ExpandFile(MfFile *file)
+{
+    int i;
+    for (i = 0; i < file->trackCt; i++) {
+        Mf_ExpandTrack(file->tracks[i]);
+    }
+}
+
+/* hash an event's message and meta-event */
+static uint32_t Mf_HashEvent(MfEvent *event, int withDelta)
+{
+    uint32_t hash = 2166136261u, i;
+
+    hash = (hash ^ event->e.message) * FNV_PRIME;
+    if (withDelta) hash = (hash ^ event->deltaTm) * FNV_PRIME;
+    if (event->meta) {
+        hash = (hash ^ event->meta->type) * FNV_PRIME;
+        hash = (hash ^ event->meta->length) * FNV_PRIME;
+        for (i = 0; i < event->meta->length && i < 16; i++)
+            hash = (hash ^ event->meta->data[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static int Mf_EventsEqual(MfEvent *a, MfEvent *b, int withDelta)
+{
+    if (withDelta && a->deltaTm != b->deltaTm) return 0;
+    if (a->e.message != b->e.message) return 0;
+    if (!a->meta || !b->meta) return a->meta == b->meta;
+    return a->meta->type == b->meta->type &&
+           a->meta->length == b->meta->length &&
+           !memcmp(a->meta->data, b->meta->data, a->meta->length);
+}
+
+/* are the runs of length events at a and b the same, by relative time? */
+static int Mf_RunsEqual(MfEvent **events, uint32_t a, uint32_t b, uint32_t length)
+{
+    uint32_t i;
+    if (!Mf_EventsEqual(events[a], events[b], 0)) return 0;
+    for (i = 1; i < length; i++) {
+        if (!Mf_EventsEqual(events[a + i], events[b + i], 1)) return 0;
+    }
+    return 1;
+}
+
+/* is none of this run already part of a pattern? */
+static int Mf_RunFree(uint8_t *used, uint32_t at, uint32_t length)
+{
+    uint32_t i;
+    for (i = 0; i < length; i++) {
+        if (used[at + i]) return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFPATTERN_H
+#define MIDIFPATTERN_H
+
+#include "midifile.h"
+
+/* find runs of at least minEvents events repeated within a track (the same
+ * messages and meta-events at the same relative times) and store each run
+ * once as a shared pattern, replacing every repetition with a reference (see
+ * MfPattern). Any patterns already in the track are expanded first. Returns
+ * the number of events saved. Writing, streams and iteration all see the
+ * track as if expanded. */
+uint32_t Mf_CompactTrack(MfTrack *track, uint32_t minEvents);
+uint32_t Mf_CompactFile(MfFile *file, uint32_t minEvents);
+
+/* replace pattern references with copies of their events */
+void Mf_ExpandTrack(MfTrack *track);
+void Mf_ExpandFile(MfFile *file);
+
+#endif
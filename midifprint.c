@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midifprint.h"
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifiter.h"
+
+/* notes at the same time are gathered to be put in a canonical order. If
+ * there are ever more than this at once, they're ordered in batches. */
+#define GROUP_MAX 256
+
+/* the common resolution, in ticks per quarter note */
+#define CANONICAL_DIVISION 960
+
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+
+/* fingerprinting state */
+typedef struct __MfFingerprinter MfFingerprinter;
+struct __MfFingerprinter {
+    MfFingerprint *into;
+    uint64_t tick, lastTick;
+    uint32_t group[GROUP_MAX];
+    int groupCt, lastKey;
+};
+
+/* file-local miscellany */
+static PmError Mf_Fingerprint(MfFingerprint *into, MfIter *iter);
+static void Mf_FingerprintFlush(MfFingerprinter *fp);
+static uint32_t Mf_Mix32(uint32_t x);
+
+/* fingerprint a standard MIDI file in memory */
+PmError Mf_FingerprintBuffer(MfFingerprint *into, const unsigned char *buf, size_t length)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenBuffer(&iter, buf, length))) {
+        Mf_IterClose(&iter);
+        return perr;
+    }
+    perr = Mf_Fingerprint(into, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+/* fingerprint a decoded file */
+PmError Mf_FingerprintFile(MfFingerprint *into, MfFile *file)
+{
+    MfIter iter;
+    PmError perr;
+
+    if ((perr = Mf_IterOpenFile(&iter, file))) return perr;
+    perr = Mf_Fingerprint(into, &iter);
+    Mf_IterClose(&iter);
+    return perr;
+}
+
+/* estimate similarity, as the Jaccard similarity of the features */
+double Mf_FingerprintSimilarity(const MfFingerprint *a, const MfFingerprint *b)
+{
+    int i, same = 0, used = 0;
+
+    for (i = 0; i < MF_FINGERPRINT_BINS; i++) {
+        if (a->sketch[i] == MF_FINGERPRINT_EMPTY && b->sketch[i] == MF_FINGERPRINT_EMPTY) continue;
+        used++;
+        if (a->sketch[i] == b->sketch[i]) same++;
+    }
+
+    if (!used) return (a->hash == b->hash) ? 1 : 0;
+    return (double) same / used;
+}
+
+static PmError Mf_Fingerprint(MfFingerprint *into, MfIter *iter)
+{
+    MfFingerprinter fp;
+    MfIterEvent ev;
+    uint64_t tick;
+
+    memset(into, 0, sizeof(MfFingerprint));
+    memset(into->sketch, 0xFF, sizeof(into->sketch));
+    into->hash = FNV64_OFFSET;
+
+    memset(&fp, 0, sizeof(fp));
+    fp.into = into;
+    fp.lastKey = -1;
+
+    while (Mf_IterNext(iter, &ev)) {
+        if ((ev.status >> 4) != MIDI_NOTE_ON || !ev.data2) continue;
+
+        /* bring the time to the common resolution (SMPTE times are left as
+         * they are) */
+        tick = ev.tick;
+        if (iter->timeDivision && !(iter->timeDivision & 0x8000))
+            tick = (tick * CANONICAL_DIVISION + iter->timeDivision / 2) / iter->timeDivision;
+
+        if (fp.groupCt && (tick != fp.tick || fp.groupCt == GROUP_MAX)) Mf_FingerprintFlush(&fp);
+        fp.tick = tick;
+        fp.group[fp.groupCt++] = ((ev.status & 0xF) << 16) + ((ev.data1 & 0x7F) << 8) + (ev.data2 & 0x7F);
+    }
+    Mf_FingerprintFlush(&fp);
+
+    return iter->perr;
+}
+
+/* hash a group of simultaneous notes */
+static void Mf_FingerprintFlush(MfFingerprinter *fp)
+{
+    MfFingerprint *into = fp->into;
+    uint32_t note, gap, feature, bin;
+    int i, j, key;
+
+    if (!fp->groupCt) return;
+
+    /* sort them (there are usually only a few) */
+    for (i = 1; i < fp->groupCt; i++) {
+        note = fp->group[i];
+        for (j = i; j > 0 && fp->group[j - 1] > note; j--) fp->group[j] = fp->group[j - 1];
+        fp->group[j] = note;
+    }
+
+    gap = fp->tick - fp->lastTick;
+    for (i = 0; i < fp->groupCt; i++) {
+        note = fp->group[i];
+
+        /* the exact hash covers everything */
+        into->hash = (into->hash ^ gap) * FNV64_PRIME;
+        into->hash = (into->hash ^ note) * FNV64_PRIME;
+        into->noteCount++;
+
+        /* the sketch covers only pitch movement and rhythm, with the gap in
+         * sixteenth notes */
+        key = (note >> 8) & 0x7F;
+        feature = Mf_Mix32(((uint32_t) (fp->lastKey & 0xFF) << 24) + (key << 16) +
+                           (((gap + CANONICAL_DIVISION / 8) / (CANONICAL_DIVISION / 4)) & 0xFFFF));
+        bin = feature % MF_FINGERPRINT_BINS;
+        feature /= MF_FINGERPRINT_BINS;
+        if (feature < into->sketch[bin]) into->sketch[bin] = feature;
+
+        fp->lastKey = key;
+        gap = 0;
+    }
+
+    fp->lastTick = fp->tick;
+    fp->groupCt = 0;
+}
+
+/* a 32-bit integer hash */
+static uint32_t Mf_Mix32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    return x;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFPRINT_H
+#define MIDIFPRINT_H
+
+#include "midifile.h"
+
+/* content fingerprints of MIDI files, for finding copies of the same music
+ * which differ only in track order, running status, meta-events or tick
+ * resolution */
+
+/* types */
+typedef struct __MfFingerprint MfFingerprint;
+
+#define MF_FINGERPRINT_BINS     64
+#define MF_FINGERPRINT_EMPTY    0xFFFFFFFF
+
+struct __MfFingerprint {
+    /* exact hash of the notes (time, channel, key and velocity of each
+     * note-on), with times at a common resolution and simultaneous notes in a
+     * canonical order */
+    uint64_t hash;
+    uint32_t noteCount;
+
+    /* a one-permutation MinHash sketch of pitch and onset features, for
+     * estimating similarity. Empty bins are MF_FINGERPRINT_EMPTY. */
+    uint32_t sketch[MF_FINGERPRINT_BINS];
+};
+
+/* fingerprint a standard MIDI file in memory, in one pass without decoding
+ * it */
+PmError Mf_FingerprintBuffer(MfFingerprint *into, const unsigned char *buf, size_t length);
+
+/* fingerprint a decoded file */
+PmError Mf_FingerprintFile(MfFingerprint *into, MfFile *file);
+
+/* estimate how similar two fingerprinted files are, from 0 to 1 */
+double Mf_FingerprintSimilarity(const MfFingerprint *a, const MfFingerprint *b);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "midifrecord.h"
+
+#include "midifile.h"
+#include "midifilealloc.h"
+#include "midifstream.h"
+
+/* a queued input event */
+typedef struct __MfRecorderItem MfRecorderItem;
+struct __MfRecorderItem {
+    PmEvent e;
+    int port;
+};
+
+struct __MfRecorder {
+    MfStream *stream;
+    int flags;
+
+    /* the queue: single producer, single consumer. head is only written by
+     * the consumer, tail only by the producer. */
+    MfRecorderItem *queue;
+    uint32_t mask;
+    uint32_t head, tail;
+
+    pthread_t thread;
+    int running, stop;
+
+    MfRecorderStats stats;
+};
+
+/* file-local miscellany */
+static void *Mf_RecorderThread(void *vrecorder);
+static int Mf_RecorderDrain(MfRecorder *recorder);
+
+#define LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+/* how long the background thread sleeps when the queue is empty */
+#define IDLE_NS 1000000
+
+/* how many events the background thread records at a time */
+#define DRAIN_MAX 256
+
+/* create a recorder writing into this stream */
+MfRecorder *Mf_NewRecorder(MfStream *stream, uint32_t capacity, int flags)
+{
+    MfRecorder *ret = Mf_New(MfRecorder);
+    uint32_t size = 2;
+
+    while (size < capacity && size < 0x80000000) size <<= 1;
+
+    ret->stream = stream;
+    ret->flags = flags ? flags : MF_RECORD_BY_CHANNEL;
+    ret->queue = Mf_Malloc(size * sizeof(MfRecorderItem));
+    ret->mask = size - 1;
+
+    return ret;
+}
+
+/* start the background thread */
+PmError Mf_StartRecorder(MfRecorder *recorder)
+{
+    if (recorder->running) return pmNoError;
+
+    STORE(&recorder->stop, 0);
+    if (pthread_create(&recorder->thread, NULL, Mf_RecorderThread, recorder)) return pmHostError;
+    recorder->running = 1;
+
+    return pmNoError;
+}
+
+/* stop the background thread, recording everything still queued first */
+void Mf_StopRecorder(MfRecorder *recorder)
+{
+    if (!recorder->running) return;
+
+    STORE(&recorder->stop, 1);
+    pthread_join(recorder->thread, NULL);
+    recorder->running = 0;
+}
+
+void Mf_FreeRecorder(MfRecorder *recorder)
+{
+    Mf_StopRecorder(recorder);
+    AL.free(recorder->queue);
+    AL.free(recorder);
+}
+
+/* queue input events from this port */
+int Mf_RecorderPush(MfRecorder *recorder, int port, PmEvent *events, int count)
+{
+    uint32_t head, tail, queued;
+    int i;
+
+    head = LOAD(&recorder->head);
+    tail = recorder->tail;
+
+    for (i = 0; i < count; i++) {
+        if (tail - head > recorder->mask) break;
+        recorder->queue[tail & recorder->mask].e = events[i];
+        recorder->queue[tail & recorder->mask].port = port;
+        tail++;
+    }
+
+    STORE(&recorder->tail, tail);
+
+    /* stats belonging to the input side */
+    queued = tail - head;
+    STORE(&recorder->stats.received, recorder->stats.received + count);
+    if (i < count) STORE(&recorder->stats.dropped, recorder->stats.dropped + (count - i));
+    if (queued > recorder->stats.maxQueued) STORE(&recorder->stats.maxQueued, queued);
+
+    return i;
+}
+
+/* read whatever's available from a PortMidi input and queue it */
+int Mf_RecorderPollInput(MfRecorder *recorder, PortMidiStream *in, int port)
+{
+    PmEvent buf[64];
+    int rd, total = 0;
+
+    while ((rd = Pm_Read(in, buf, 64)) > 0) {
+        total += Mf_RecorderPush(recorder, port, buf, rd);
+    }
+
+    return total;
+}
+
+void Mf_RecorderGetStats(MfRecorder *recorder, MfRecorderStats *stats)
+{
+    stats->received = LOAD(&recorder->stats.received);
+    stats->recorded = LOAD(&recorder->stats.recorded);
+    stats->dropped = LOAD(&recorder->stats.dropped);
+    stats->ignored = LOAD(&recorder->stats.ignored);
+    stats->maxQueued = LOAD(&recorder->stats.maxQueued);
+}
+
+static void *Mf_RecorderThread(void *vrecorder)
+{
+    MfRecorder *recorder = (MfRecorder *) vrecorder;
+    struct timespec idle;
+    int stop;
+
+    idle.tv_sec = 0;
+    idle.tv_nsec = IDLE_NS;
+
+    while (1) {
+        /* check for stop before draining, so nothing queued before the stop
+         * is lost */
+        stop = LOAD(&recorder->stop);
+        if (Mf_RecorderDrain(recorder) == 0) {
+            if (stop) break;
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/* record some queued events, returning how many were taken off the queue */
+static int Mf_RecorderDrain(MfRecorder *recorder)
+{
+    MfStream *stream = recorder->stream;
+    MfRecorderItem *item;
+    MfEvent *event;
+    MfTrack *track;
+    uint32_t head, tail, tick;
+    uint8_t status;
+    int trackno, taken = 0;
+
+    head = recorder->head;
+    tail = LOAD(&recorder->tail);
+
+    for (; head != tail && taken < DRAIN_MAX; head++, taken++) {
+        item = &recorder->queue[head & recorder->mask];
+        status = Pm_MessageStatus(item->e.message);
+        if (status < 0x80 || status >= 0xF0) {
+            STORE(&recorder->stats.ignored, recorder->stats.ignored + 1);
+            continue;
+        }
+
+        /* choose the track */
+        if ((recorder->flags & MF_RECORD_BY_PORT) && (recorder->flags & MF_RECORD_BY_CHANNEL)) {
+            trackno = item->port * 16 + (status & 0xF);
+        } else if (recorder->flags & MF_RECORD_BY_PORT) {
+            trackno = item->port;
+        } else {
+            trackno = status & 0xF;
+        }
+
+        /* and the time, which can't go backwards within a track */
+        tick = Mf_StreamGetTick(stream, item->e.timestamp);
+        track = (trackno < stream->file->trackCt) ? stream->file->tracks[trackno] : NULL;
+        if (track && track->tail && tick < track->tail->absoluteTm) tick = track->tail->absoluteTm;
+
+        event = Mf_NewEventCtx(stream->file->ctx);
+        event->e = item->e;
+        event->absoluteTm = tick;
+        Mf_StreamWriteOne(stream, trackno, event);
+        STORE(&recorder->stats.recorded, recorder->stats.recorded + 1);
+    }
+
+    STORE(&recorder->head, head);
+    return taken;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFRECORD_H
+#define MIDIFRECORD_H
+
+#include "midifile.h"
+#include "midifstream.h"
+
+/* Recording MIDI input into a stream. The input side only copies PmEvents
+ * into a preallocated lock-free queue, so it's safe to call from a real-time
+ * input callback; a background thread converts them to ticks with the
+ * stream's tempo and writes them into the stream. There may be only one
+ * input thread pushing into a recorder. */
+
+/* types */
+typedef struct __MfRecorder MfRecorder;
+typedef struct __MfRecorderStats MfRecorderStats;
+
+struct __MfRecorderStats {
+    uint64_t received, recorded;
+    uint64_t dropped; /* because the queue was full */
+    uint64_t ignored; /* system messages, which aren't recorded */
+    uint32_t maxQueued;
+};
+
+/* how to split input into tracks: by channel (track = channel), by port
+ * (track = port), or both (track = port * 16 + channel) */
+#define MF_RECORD_BY_CHANNEL    1
+#define MF_RECORD_BY_PORT       2
+
+/* create a recorder writing into this stream, queueing up to capacity events
+ * (rounded up to a power of two) between the input and background threads.
+ * The stream must be started, and mustn't be used by anything else until the
+ * recorder is stopped. */
+MfRecorder *Mf_NewRecorder(MfStream *stream, uint32_t capacity, int flags);
+
+/* start and stop the background thread. Stopping records everything still
+ * queued first. */
+PmError Mf_StartRecorder(MfRecorder *recorder);
+void Mf_StopRecorder(MfRecorder *recorder);
+
+void Mf_FreeRecorder(MfRecorder *recorder);
+
+/* queue input events from this port, returning how many fit. Never blocks or
+ * allocates. */
+int Mf_RecorderPush(MfRecorder *recorder, int port, PmEvent *events, int count);
+
+/* read whatever's available from a PortMidi input and queue it */
+int Mf_RecorderPollInput(MfRecorder *recorder, PortMidiStream *in, int port);
+
+void Mf_RecorderGetStats(MfRecorder *recorder, MfRecorderStats *stats);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "midifsched.h"
+
+#include "midi.h"
+#include "midifcodec.h"
+#include "midifilealloc.h"
+
+#define SCHED_QUEUE     65536   /* default bytes of SysEx to queue */
+#define SCHED_HOLD      256     /* channel messages held during a SysEx message */
+#define SCHED_BATCH     64      /* PmEvents written at once */
+
+/* a queued SysEx message, followed by its bytes as they go on the wire */
+typedef struct __MfSchedulerEntry MfSchedulerEntry;
+struct __MfSchedulerEntry {
+    uint32_t length;
+    PtTimestamp when;
+};
+
+/* when a message written at now is due (messages written late are due
+ * immediately, so only lateness caused by the link counts) */
+#define SCHED_DUE(timestamp, now) (((timestamp) > (now)) ? (timestamp) : (now))
+
+/* bytes taken in the queue by a message of this length, keeping alignment */
+#define ENTRY_SIZE(length) (sizeof(MfSchedulerEntry) + (((length) + 3) & ~(uint32_t) 3))
+
+struct __MfScheduler {
+    PortMidiStream *out;
+    uint32_t bytesPerSecond;
+    int32_t maxDelay;
+
+    /* bytes sent at a time from large SysEx messages (a multiple of 4, so
+     * each chunk fills whole PmEvents) */
+    uint32_t chunk;
+
+    /* when the link will be idle, in microseconds on the Pt_Time scale */
+    int64_t linkFree;
+
+    /* the queued messages, from head to tail, and how much of the first has
+     * been sent */
+    unsigned char *queue;
+    uint32_t queueSize, head, tail, sending;
+
+    /* whether a SysEx message split into packets has been started but not
+     * ended, so channel messages must wait for its continuation */
+    int open;
+
+    /* channel messages held until the message being sent is finished, with
+     * their timestamps set to when they were due */
+    PmEvent held[SCHED_HOLD];
+    int32_t heldCt;
+
+    MfSchedulerStats stats;
+};
+
+/* file-local miscellany */
+static uint32_t Mf_SchedulerMessageBytes(PmMessage message);
+static int64_t Mf_SchedulerCharge(MfScheduler *sched, int64_t nowUs, int64_t dueUs, uint32_t bytes);
+static void Mf_SchedulerChannel(MfScheduler *sched, PtTimestamp now, PtTimestamp due, PmEvent *event);
+static PmError Mf_SchedulerSendBytes(MfScheduler *sched, PtTimestamp now, unsigned char *data, uint32_t length);
+static void Mf_SchedulerPop(MfScheduler *sched);
+static void Mf_SchedulerEnded(MfScheduler *sched, unsigned char *data, uint32_t length);
+static PmError Mf_SchedulerFlush(MfScheduler *sched, PtTimestamp now);
+static PmError Mf_SchedulerFinish(MfScheduler *sched, PtTimestamp now);
+
+/* open a scheduler */
+MfScheduler *Mf_OpenScheduler(PortMidiStream *out, uint32_t bytesPerSecond, uint32_t queueBytes, int32_t maxDelay)
+{
+    MfScheduler *ret = Mf_New(MfScheduler);
+
+    if (!bytesPerSecond) bytesPerSecond = MF_DIN_BYTES_PER_SECOND;
+    if (!queueBytes) queueBytes = SCHED_QUEUE;
+
+    ret->out = out;
+    ret->bytesPerSecond = bytesPerSecond;
+    ret->maxDelay = maxDelay;
+
+    /* about 4ms of the link at a time */
+    ret->chunk = (bytesPerSecond / 250 + 3) & ~(uint32_t) 3;
+    if (ret->chunk < 4) ret->chunk = 4;
+
+    ret->queue = Mf_Malloc(queueBytes);
+    ret->queueSize = queueBytes;
+    return ret;
+}
+
+/* close a scheduler */
+void Mf_CloseScheduler(MfScheduler *sched)
+{
+    AL.free(sched->queue);
+    AL.free(sched);
+}
+
+/* send channel messages */
+PmError Mf_SchedulerWrite(MfScheduler *sched, PtTimestamp now, PmEvent *events, int32_t length)
+{
+    int32_t i, from = 0;
+    PmError perr;
+
+    for (i = 0; i < length; i++) {
+        /* nothing but real-time messages can go in the middle of a SysEx
+         * message */
+        if ((!sched->sending && !sched->open) || Pm_MessageStatus(events[i].message) >= 0xF8) {
+            Mf_SchedulerChannel(sched, now, SCHED_DUE(events[i].timestamp, now), events + i);
+            continue;
+        }
+
+        /* send what came before, then hold this one */
+        if (i > from && (perr = Pm_Write(sched->out, events + from, i - from))) return perr;
+        from = i + 1;
+        if (sched->heldCt == SCHED_HOLD) {
+            /* out of room, so get the message out of the way now */
+            if ((perr = Mf_SchedulerFinish(sched, now))) return perr;
+            Mf_SchedulerChannel(sched, now, SCHED_DUE(events[i].timestamp, now), events + i);
+            from = i;
+            continue;
+        }
+        sched->held[sched->heldCt] = events[i];
+        sched->held[sched->heldCt].timestamp = SCHED_DUE(events[i].timestamp, now);
+        sched->heldCt++;
+    }
+
+    if (i > from) return Pm_Write(sched->out, events + from, i - from);
+    return pmNoError;
+}
+
+/* queue SysEx */
+void Mf_SchedulerSysEx(void *vsched, PtTimestamp when, uint8_t status, const unsigned char *data, uint32_t length)
+{
+    MfScheduler *sched = (MfScheduler *) vsched;
+    MfSchedulerEntry *entry;
+    unsigned char *into;
+    uint32_t bytes, size;
+
+    /* a SysEx message goes out with its status, an escape as is */
+    bytes = length + (status == MIDI_STATUS_SYSEX);
+    size = ENTRY_SIZE(bytes);
+    if (!bytes) return;
+
+    if (sched->tail + size > sched->queueSize) {
+        if (sched->tail - sched->head + size > sched->queueSize) {
+            sched->stats.dropped++;
+            return;
+        }
+
+        /* move what's waiting back to the start to make room */
+        memmove(sched->queue, sched->queue + sched->head, sched->tail - sched->head);
+        sched->tail -= sched->head;
+        sched->head = 0;
+    }
+
+    entry = (MfSchedulerEntry *) (sched->queue + sched->tail);
+    entry->length = bytes;
+    entry->when = when;
+    into = (unsigned char *) (entry + 1);
+    if (status == MIDI_STATUS_SYSEX) *into++ = status;
+    memcpy(into, data, length);
+    sched->tail += size;
+
+    sched->stats.queuedMessages++;
+    sched->stats.queuedBytes += bytes;
+    if (sched->stats.queuedBytes > sched->stats.maxQueuedBytes)
+        sched->stats.maxQueuedBytes = sched->stats.queuedBytes;
+}
+
+/* send queued SysEx as the link allows */
+PmError Mf_SchedulerRun(MfScheduler *sched, PtTimestamp now, PtTimestamp nextDue)
+{
+    MfSchedulerEntry *entry;
+    unsigned char *data;
+    int64_t nowUs = (int64_t) now * 1000;
+    uint32_t n;
+    PmError perr;
+
+    while (sched->head != sched->tail && sched->linkFree <= nowUs) {
+        entry = (MfSchedulerEntry *) (sched->queue + sched->head);
+        data = (unsigned char *) (entry + 1);
+
+        if (!sched->sending) {
+            if (entry->when > now) break;
+            if (sched->open && data[0] == MIDI_STATUS_SYSEX) {
+                /* the last SysEx message never ended, so give up on it */
+                sched->open = 0;
+                if ((perr = Mf_SchedulerFlush(sched, now))) return perr;
+            }
+        }
+
+        if (!sched->sending && !sched->open) {
+            /* wait for a gap in the channel messages big enough for it,
+             * unless it's waited too long already */
+            if (nextDue >= 0 && now - entry->when < sched->maxDelay &&
+                nowUs + (int64_t) entry->length * 1000000 / sched->bytesPerSecond > (int64_t) nextDue * 1000)
+                break;
+            if (now - entry->when > sched->stats.maxSysExDelay)
+                sched->stats.maxSysExDelay = now - entry->when;
+
+            /* small, complete messages go in one go */
+            if (entry->length <= sched->chunk && data[0] == MIDI_STATUS_SYSEX &&
+                data[entry->length - 1] == MIDI_STATUS_SYSEX_END) {
+                Mf_SchedulerCharge(sched, nowUs, nowUs, entry->length);
+                perr = Pm_WriteSysEx(sched->out, now, data);
+                Mf_SchedulerPop(sched);
+                if (perr) return perr;
+                continue;
+            }
+        }
+
+        /* anything else, a chunk at a time */
+        n = entry->length - sched->sending;
+        if (n > sched->chunk) n = sched->chunk;
+        Mf_SchedulerCharge(sched, nowUs, nowUs, n);
+        perr = Mf_SchedulerSendBytes(sched, now, data + sched->sending, n);
+        sched->sending += n;
+        if (!perr && sched->sending == entry->length) {
+            Mf_SchedulerEnded(sched, data, entry->length);
+            Mf_SchedulerPop(sched);
+            if (!sched->open) perr = Mf_SchedulerFlush(sched, now);
+        }
+        if (perr) return perr;
+    }
+
+    return pmNoError;
+}
+
+/* get the scheduler's statistics */
+void Mf_SchedulerGetStats(MfScheduler *sched, MfSchedulerStats *into)
+{
+    *into = sched->stats;
+}
+
+/* bytes a message takes on the wire (without running status, which not all
+ * drivers use) */
+static uint32_t Mf_SchedulerMessageBytes(PmMessage message)
+{
+    uint8_t status = Pm_MessageStatus(message);
+    const MfStatusInfo *info = &Mf_StatusTable[status];
+
+    if (info->kind == MF_KIND_CHANNEL) return 1 + info->dataLength;
+    switch (status) {
+        case 0xF1: case 0xF3:   return 2;
+        case 0xF2:              return 3;
+        default:                return 1;
+    }
+}
+
+/* account for bytes due at dueUs going out on the link, no earlier than
+ * nowUs, returning how late they start */
+static int64_t Mf_SchedulerCharge(MfScheduler *sched, int64_t nowUs, int64_t dueUs, uint32_t bytes)
+{
+    int64_t start = dueUs;
+
+    if (start < nowUs) start = nowUs;
+    if (start < sched->linkFree) start = sched->linkFree;
+    sched->linkFree = start + (int64_t) bytes * 1000000 / sched->bytesPerSecond;
+    return start - dueUs;
+}
+
+/* account for a channel message due at due going out now (or as soon as the
+ * link is free) */
+static void Mf_SchedulerChannel(MfScheduler *sched, PtTimestamp now, PtTimestamp due, PmEvent *event)
+{
+    int64_t late = Mf_SchedulerCharge(sched, (int64_t) now * 1000, (int64_t) due * 1000,
+                              Mf_SchedulerMessageBytes(event->message));
+    if (late > 0) {
+        sched->stats.lateMessages++;
+        if (late > UINT32_MAX) late = UINT32_MAX;
+        if (late > sched->stats.maxLateness) sched->stats.maxLateness = late;
+    }
+}
+
+/* send raw bytes, packed four to a PmEvent as PortMidi does SysEx */
+static PmError Mf_SchedulerSendBytes(MfScheduler *sched, PtTimestamp now, unsigned char *data, uint32_t length)
+{
+    PmEvent events[SCHED_BATCH];
+    PmMessage message;
+    uint32_t i, j;
+    int32_t ct = 0;
+    PmError perr;
+
+    for (i = 0; i < length; i += 4) {
+        message = 0;
+        for (j = 0; j < 4 && i + j < length; j++)
+            message |= (PmMessage) data[i + j] << (8 * j);
+        events[ct].message = message;
+        events[ct].timestamp = now;
+        if (++ct == SCHED_BATCH) {
+            if ((perr = Pm_Write(sched->out, events, ct))) return perr;
+            ct = 0;
+        }
+    }
+
+    if (ct) return Pm_Write(sched->out, events, ct);
+    return pmNoError;
+}
+
+/* take the first message, now sent, off the queue */
+static void Mf_SchedulerPop(MfScheduler *sched)
+{
+    MfSchedulerEntry *entry = (MfSchedulerEntry *) (sched->queue + sched->head);
+
+    sched->stats.queuedMessages--;
+    sched->stats.queuedBytes -= entry->length;
+    sched->stats.sentMessages++;
+    sched->stats.sentBytes += entry->length;
+
+    sched->head += ENTRY_SIZE(entry->length);
+    if (sched->head == sched->tail) sched->head = sched->tail = 0;
+    sched->sending = 0;
+}
+
+/* note whether a message just sent leaves a SysEx message open (one that
+ * started with F0, and hasn't ended with F7) */
+static void Mf_SchedulerEnded(MfScheduler *sched, unsigned char *data, uint32_t length)
+{
+    sched->open = data[length - 1] != MIDI_STATUS_SYSEX_END &&
+        (sched->open || data[0] == MIDI_STATUS_SYSEX);
+}
+
+/* send the channel messages held during a SysEx message */
+static PmError Mf_SchedulerFlush(MfScheduler *sched, PtTimestamp now)
+{
+    int32_t i, ct = sched->heldCt;
+
+    if (!ct) return pmNoError;
+    for (i = 0; i < ct; i++)
+        Mf_SchedulerChannel(sched, now, sched->held[i].timestamp, sched->held + i);
+    sched->heldCt = 0;
+    return Pm_Write(sched->out, sched->held, ct);
+}
+
+/* send the rest of the message being sent at once, along with the rest of
+ * its packets, and what was held */
+static PmError Mf_SchedulerFinish(MfScheduler *sched, PtTimestamp now)
+{
+    MfSchedulerEntry *entry;
+    unsigned char *data;
+    int64_t nowUs = (int64_t) now * 1000;
+    PmError perr;
+
+    while (sched->head != sched->tail && (sched->sending || sched->open)) {
+        entry = (MfSchedulerEntry *) (sched->queue + sched->head);
+        data = (unsigned char *) (entry + 1);
+        if (!sched->sending && data[0] == MIDI_STATUS_SYSEX) break;
+
+        Mf_SchedulerCharge(sched, nowUs, nowUs, entry->length - sched->sending);
+        perr = Mf_SchedulerSendBytes(sched, now, data + sched->sending, entry->length - sched->sending);
+        Mf_SchedulerEnded(sched, data, entry->length);
+        Mf_SchedulerPop(sched);
+        if (perr) return perr;
+    }
+
+    /* if the rest of it hasn't been queued, it'll have to do without */
+    sched->open = 0;
+    return Mf_SchedulerFlush(sched, now);
+}
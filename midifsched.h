@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFSCHED_H
+#define MIDIFSCHED_H
+
+#include "midifile.h"
+#include "porttime.h"
+
+/* Output scheduling for a MIDI link of limited bandwidth (by default, a 5-pin
+ * DIN link at 31.25 kbaud, which carries 3125 bytes a second). Channel
+ * messages are time-critical, so they're sent as soon as they're written;
+ * SysEx is queued, and sent only as the link has room for it, fitted into
+ * the gaps between channel messages where possible. Nothing can be sent in
+ * the middle of a SysEx message but real-time messages, so large messages
+ * are sent in paced chunks, with channel messages held until they're done.
+ * A SysEx message split into packets (an F0 packet without an F7, then F7
+ * continuation packets) counts as one message until the packet ending in
+ * 0xF7 has gone out.
+ *
+ * A scheduler isn't locked: write to it, queue SysEx to it and run it from
+ * the same thread (normally the one playing the stream). */
+
+#define MF_DIN_BYTES_PER_SECOND 3125
+
+/* types */
+typedef struct __MfScheduler MfScheduler;
+typedef struct __MfSchedulerStats MfSchedulerStats;
+
+struct __MfSchedulerStats {
+    /* SysEx waiting to be sent, and the most bytes ever waiting */
+    uint32_t queuedMessages, queuedBytes, maxQueuedBytes;
+
+    /* SysEx sent, and messages dropped because the queue was full */
+    uint32_t sentMessages, sentBytes, dropped;
+
+    /* channel messages which went out later than they were due because the
+     * link was busy, and the latest any went out, in microseconds */
+    uint32_t lateMessages, maxLateness;
+
+    /* the longest any SysEx message waited to be started, in milliseconds */
+    int32_t maxSysExDelay;
+};
+
+/* open a scheduler for output at bytesPerSecond (0 for
+ * MF_DIN_BYTES_PER_SECOND), queueing up to queueBytes of SysEx. A SysEx
+ * message waits for a gap in the channel messages for at most maxDelay
+ * milliseconds, after which it's sent regardless. The scheduler doesn't take
+ * ownership of the output. */
+MfScheduler *Mf_OpenScheduler(PortMidiStream *out, uint32_t bytesPerSecond, uint32_t queueBytes, int32_t maxDelay);
+
+/* close a scheduler, dropping anything still queued */
+void Mf_CloseScheduler(MfScheduler *sched);
+
+/* send channel (and real-time) messages, written at time now */
+PmError Mf_SchedulerWrite(MfScheduler *sched, PtTimestamp now, PmEvent *events, int32_t length);
+
+/* queue SysEx to be sent no earlier than when, as from Mf_StreamSetSysEx (so
+ * this can be given to it directly, with the scheduler as its argument).
+ * Continuation packets are sent as they come due, without waiting for gaps.
+ * Never allocates. */
+void Mf_SchedulerSysEx(void *sched, PtTimestamp when, uint8_t status, const unsigned char *data, uint32_t length);
+
+/* send queued SysEx as the link allows at time now. nextDue is when the next
+ * channel message is due, or negative if there's none coming. Call this
+ * regularly, at least every millisecond or so while SysEx is queued. */
+PmError Mf_SchedulerRun(MfScheduler *sched, PtTimestamp now, PtTimestamp nextDue);
+
+/* get the scheduler's statistics so far */
+void Mf_SchedulerGetStats(MfScheduler *sched, MfSchedulerStats *into);
+
+#endif
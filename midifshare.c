@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "midifshare.h"
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifilealloc.h"
+#include "midifiter.h"
+
+#define SHARED_MAGIC    "MFSH"
+#define SHARED_VERSION  1
+
+/* bytes taken by meta-event data of this length, keeping alignment */
+#define META_SIZE(length) ((offsetof(MfSharedMeta, data) + (length) + 3) & ~(uint64_t) 3)
+
+/* file-local miscellany */
+static int64_t Mf_SharedTickNs(MfShared *shared, uint32_t index, uint32_t tick);
+
+/* publish a file */
+PmError Mf_PublishFile(const char *name, MfFile *file)
+{
+    MfIter iter;
+    MfIterEvent ev;
+    MfSharedHeader *header;
+    MfSharedEvent *event;
+    MfSharedMeta *meta;
+    unsigned char *map;
+    uint64_t size, metaAt, nsDiv = 0;
+    uint32_t eventCt = 0, tempo = 500000, lastTick = 0;
+    uint16_t div = file->timeDivision;
+    double smpte = 0;
+    PmError perr;
+    int fd;
+
+    /* first size it up */
+    size = sizeof(MfSharedHeader);
+    if ((perr = Mf_IterOpenFile(&iter, file))) return perr;
+    while (Mf_IterNext(&iter, &ev)) {
+        eventCt++;
+        if (ev.status >= 0xF0) size += META_SIZE(ev.metaLength);
+    }
+    Mf_IterClose(&iter);
+    if (iter.perr) return iter.perr;
+    size = (size + 7) & ~(uint64_t) 7;
+    size += (uint64_t) eventCt * sizeof(MfSharedEvent);
+
+    /* make a fresh segment, so anybody attached to an old one keeps it */
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return pmHostError;
+    if (ftruncate(fd, size) ||
+        (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        shm_unlink(name);
+        return pmHostError;
+    }
+    close(fd);
+
+    header = (MfSharedHeader *) map;
+    header->version = SHARED_VERSION;
+    header->size = size;
+    header->format = file->format;
+    header->timeDivision = div;
+    header->trackCt = file->trackCt;
+    header->eventCt = eventCt;
+    header->events = size - (uint64_t) eventCt * sizeof(MfSharedEvent);
+
+    if (div & 0x8000) {
+        /* SMPTE: frames per second in the high byte, ticks per frame in the low */
+        smpte = -(int8_t) (div >> 8);
+        if (smpte == 29) smpte = 29.97;
+        smpte *= div & 0xFF;
+    }
+
+    /* then fill it in */
+    event = (MfSharedEvent *) (map + header->events);
+    metaAt = sizeof(MfSharedHeader);
+    Mf_IterOpenFile(&iter, file);
+    while (Mf_IterNext(&iter, &ev)) {
+        if (smpte > 0) {
+            event->ns = (int64_t) (ev.tick * 1000000000.0 / smpte);
+        } else if (div) {
+            nsDiv += (uint64_t) (ev.tick - lastTick) * tempo * 1000;
+            event->ns = nsDiv / div;
+        } else {
+            event->ns = 0;
+        }
+        lastTick = ev.tick;
+
+        event->tick = ev.tick;
+        event->track = ev.track;
+        event->meta = 0;
+
+        if (ev.status >= 0xF0) {
+            event->message = Pm_Message(ev.status, (ev.status == MIDI_STATUS_META) ? ev.metaType : 0, 0);
+            event->meta = metaAt;
+            meta = (MfSharedMeta *) (map + metaAt);
+            meta->length = ev.metaLength;
+            meta->type = ev.metaType;
+            if (ev.metaLength) memcpy(meta->data, ev.metaData, ev.metaLength);
+            metaAt += META_SIZE(ev.metaLength);
+
+            if (ev.status == MIDI_STATUS_META && ev.metaType == MIDI_M_TEMPO &&
+                ev.metaLength == MIDI_M_TEMPO_LENGTH)
+                tempo = MIDI_M_TEMPO_N(ev.metaData);
+        } else {
+            event->message = Pm_Message(ev.status, ev.data1, ev.data2);
+        }
+
+        event++;
+    }
+    Mf_IterClose(&iter);
+
+    /* only now is it ready to be seen */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SHARED_MAGIC, 4);
+
+    munmap(map, size);
+    return pmNoError;
+}
+
+/* remove a published name */
+PmError Mf_UnpublishFile(const char *name)
+{
+    return shm_unlink(name) ? pmHostError : pmNoError;
+}
+
+/* attach to a published file */
+MfShared *Mf_AttachFile(const char *name)
+{
+    MfShared *ret;
+    const MfSharedHeader *header;
+    struct stat sbuf;
+    void *map;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &sbuf) || sbuf.st_size < (off_t) sizeof(MfSharedHeader) ||
+        (map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    /* make sure it's whole */
+    header = (const MfSharedHeader *) map;
+    if (memcmp(header->magic, SHARED_MAGIC, 4) || header->version != SHARED_VERSION ||
+        header->size > (uint64_t) sbuf.st_size || header->events > header->size ||
+        (header->size - header->events) / sizeof(MfSharedEvent) < header->eventCt) {
+        munmap(map, sbuf.st_size);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    ret = Mf_New(MfShared);
+    ret->header = header;
+    ret->events = (const MfSharedEvent *) ((const char *) map + header->events);
+    ret->size = sbuf.st_size;
+    return ret;
+}
+
+/* detach from a file */
+void Mf_DetachFile(MfShared *shared)
+{
+    munmap((void *) shared->header, shared->size);
+    AL.free(shared);
+}
+
+/* start a cursor */
+void Mf_SharedOpenCursor(MfSharedCursor *cursor, MfShared *shared, PtTimestamp ts)
+{
+    cursor->shared = shared;
+    cursor->next = 0;
+    cursor->startNs = (int64_t) ts * 1000000;
+}
+
+/* move a cursor */
+void Mf_SharedSeek(MfSharedCursor *cursor, uint32_t tick, PtTimestamp ts)
+{
+    MfShared *shared = cursor->shared;
+    uint32_t lo = 0, hi = shared->header->eventCt, mid;
+
+    /* the first event at or after tick */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (shared->events[mid].tick < tick) lo = mid + 1;
+        else hi = mid;
+    }
+
+    cursor->next = lo;
+    cursor->startNs = (int64_t) ts * 1000000 - Mf_SharedTickNs(shared, lo, tick);
+}
+
+/* the time of a tick, which is at or before event index. The tempo can only
+ * change at an event, so between two events it's a straight line. */
+static int64_t Mf_SharedTickNs(MfShared *shared, uint32_t index, uint32_t tick)
+{
+    const MfSharedEvent *next, *prev;
+    int64_t prevNs = 0;
+    uint32_t prevTick = 0;
+
+    if (index >= shared->header->eventCt) {
+        /* past the end, where time stands still */
+        return index ? shared->events[index-1].ns : 0;
+    }
+
+    next = &shared->events[index];
+    if (next->tick == tick) return next->ns;
+    if (index) {
+        prev = &shared->events[index-1];
+        prevNs = prev->ns;
+        prevTick = prev->tick;
+    }
+    return prevNs + (int64_t) ((double) (next->ns - prevNs) * (tick - prevTick) / (next->tick - prevTick));
+}
+
+/* read events from a cursor */
+int Mf_SharedRead(MfSharedCursor *cursor, PmEvent *into, int *track, int32_t length, PtTimestamp until)
+{
+    const MfSharedEvent *event;
+    uint32_t eventCt = cursor->shared->header->eventCt;
+    int64_t untilNs = (int64_t) until * 1000000 - cursor->startNs;
+    int ct = 0;
+
+    while (ct < length && cursor->next < eventCt) {
+        event = &cursor->shared->events[cursor->next];
+        if (event->ns > untilNs) break;
+        cursor->next++;
+        if (event->meta) continue;
+
+        into[ct].message = event->message;
+        into[ct].timestamp = (cursor->startNs + event->ns) / 1000000;
+        if (track) track[ct] = event->track;
+        ct++;
+    }
+
+    return ct;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFSHARE_H
+#define MIDIFSHARE_H
+
+#include "midifile.h"
+#include "porttime.h"
+
+/* Sharing decoded files between processes. A file is published as an
+ * immutable image in a named POSIX shared memory segment, which any number
+ * of processes can then attach read-only and play from, each with its own
+ * cursor, so there's one copy of the file however many players there are.
+ *
+ * The image holds no pointers, only offsets from its start, so it can be
+ * mapped anywhere. Its events are merged across tracks into time order (with
+ * patterns expanded), and each carries its time from the start of the file,
+ * worked out from the tempo map when it was published, so playing from an
+ * image needs no tempo tracking, and seeking is a binary search. The image is
+ * in the host's byte order, for processes on the same machine. */
+
+/* types */
+typedef struct __MfShared MfShared;
+typedef struct __MfSharedHeader MfSharedHeader;
+typedef struct __MfSharedEvent MfSharedEvent;
+typedef struct __MfSharedMeta MfSharedMeta;
+typedef struct __MfSharedCursor MfSharedCursor;
+
+/* the start of an image */
+struct __MfSharedHeader {
+    char magic[4]; /* written last, so an image is never seen half-made */
+    uint32_t version;
+    uint64_t size;
+    uint16_t format, timeDivision, trackCt;
+    uint32_t eventCt;
+    uint64_t events; /* offset of the events */
+};
+
+/* an event in an image */
+struct __MfSharedEvent {
+    int64_t ns; /* time from the start of the file */
+    uint32_t tick;
+    PmMessage message;
+    uint32_t meta; /* offset of the meta-event or SysEx data, or 0 */
+    uint16_t track;
+};
+
+/* meta-event or SysEx data in an image */
+struct __MfSharedMeta {
+    uint32_t length;
+    uint8_t type;
+    unsigned char data[1];
+};
+
+/* an attached image */
+struct __MfShared {
+    const MfSharedHeader *header;
+    const MfSharedEvent *events;
+    size_t size;
+};
+
+/* the meta-event or SysEx data of an event in an image, or NULL */
+#define Mf_SharedMeta(shared, event) \
+    ((event)->meta ? (const MfSharedMeta *) ((const char *) (shared)->header + (event)->meta) : NULL)
+
+/* one player's place in an image */
+struct __MfSharedCursor {
+    MfShared *shared;
+    uint32_t next; /* the next event */
+    int64_t startNs; /* when the start of the file is played, in Pt_Time
+                      * nanoseconds */
+};
+
+/* publish a file under a shared memory name (like "/song"), replacing
+ * anything already published under it. Processes already attached to the old
+ * image keep it until they detach. */
+PmError Mf_PublishFile(const char *name, MfFile *file);
+
+/* remove a published name (attached processes are unaffected) */
+PmError Mf_UnpublishFile(const char *name);
+
+/* attach to a published file, or NULL if there isn't one (or it isn't
+ * finished being published yet) */
+MfShared *Mf_AttachFile(const char *name);
+void Mf_DetachFile(MfShared *shared);
+
+/* start a cursor at the beginning of an image, to be played from timestamp
+ * ts */
+void Mf_SharedOpenCursor(MfSharedCursor *cursor, MfShared *shared, PtTimestamp ts);
+
+/* move a cursor to the first event at or after tick, to be played from
+ * timestamp ts. Loops and rewinds are this, and cost nothing. */
+void Mf_SharedSeek(MfSharedCursor *cursor, uint32_t tick, PtTimestamp ts);
+
+/* read events due by timestamp until into PmEvents ready for Pm_Write,
+ * skipping meta-events and SysEx. track may be NULL. Never allocates, locks or
+ * writes to the image. */
+int Mf_SharedRead(MfSharedCursor *cursor, PmEvent *into, int *track, int32_t length, PtTimestamp until);
+
+/* has a cursor reached the end? */
+#define Mf_SharedCursorDone(cursor) ((cursor)->next >= (cursor)->shared->header->eventCt)
+
+#endif
@@ -23,37 +23,218 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "midifstream.h"
 
+#include "midi.h"
+#include "midifcodec.h"
 #include "midifile.h"
 #include "midifilealloc.h"
+#include "midifpattern.h"
+#include "midiftrace.h"
+
+/* an encoded track being written by a stream writer */
+typedef struct __MfStreamWriterTrack MfStreamWriterTrack;
+struct __MfStreamWriterTrack {
+    FILE *fh; /* the output itself, or a spill file */
+    uint32_t length, lastTick;
+    uint8_t status;
+};
+
+struct __MfStreamWriter {
+    FILE *into;
+    int flags;
+    long start; /* offset of the header in the output */
+    PmError perr;
+
+    int trackCt;
+    MfStreamWriterTrack *tracks;
+};
+
+/* where a shared stream has got to in a track: the next event, with patterns
+ * walked through rather than expanded */
+struct __MfStreamCursor {
+    MfWalk walk;
+    MfEvent *event; /* NULL at the end */
+    uint32_t tick;
+};
+
+struct __MfStreamMark {
+    int trackCt;
+    uint32_t tick, tempo;
+    MfStreamCursor *cursors;
+};
 
 /* file-local miscellany */
 static void Mf_FinalizeTrack(MfTrack *track);
 static MfTrack *Mf_AssertTrack(MfFile *file, int track);
+static void Mf_StreamAnchorTick(MfStream *stream, uint32_t tick);
+static uint32_t Mf_StreamDefaultTempo(MfStream *stream);
+static MfStreamWriterTrack *Mf_AssertWriterTrack(MfStreamWriter *writer, int track);
+static PmError Mf_StreamWriterWrite(MfStreamWriter *writer, MfStreamWriterTrack *track, MfEvent *event);
+static PmError Mf_StreamWriterPatch(MfStreamWriter *writer, long at, uint32_t val, int bytes);
+static PmError Mf_FinishStreamWriter(MfStream *stream);
+static int Mf_StreamKeepEvent(MfStream *stream, MfEvent *event, uint32_t tick, PmMessage *message);
+static int Mf_StreamEventTempo(MfEvent *event, uint32_t *tempo);
+static void Mf_StreamCursorNext(MfStreamCursor *cursor);
+static void Mf_StreamJumped(MfStream *stream, PtTimestamp ts);
+static void Mf_StreamCountNote(MfStream *stream, PmMessage message);
+static int32_t Mf_StreamReleaseNotes(MfStream *stream, PmEvent *into, int *ptrack, int32_t rd, int32_t length);
+static int Mf_StreamReadShared(MfStream *stream, PmEvent *into, int *ptrack, int32_t length);
+static int Mf_StreamReadBatch(MfStream *stream, MfEvent **into, PmEvent *pmInto, int *ptrack, int32_t length);
+static int Mf_StreamReadOptimized(MfStream *stream, PmEvent *into, int *ptrack, int32_t length);
+static void Mf_StreamRetireChain(MfStream *stream, MfEvent *head, MfEvent *tail);
+
+#define WRITE_BE(buf, val, bytes) do { \
+    int __i; \
+    for (__i = 0; __i < (bytes); __i++) \
+        (buf)[__i] = ((val) >> (((bytes) - __i - 1) * 8)) & 0xFF; \
+} while (0)
 
 /* open a stream for a file */
 MfStream *Mf_OpenStream(MfFile *of)
 {
     MfStream *ret = Mf_New(MfStream);
+
+    /* reading takes events off the file, so patterns have to be expanded */
+    Mf_ExpandFile(of);
+    ret->file = of;
+    return ret;
+}
+
+/* open a shared stream for a file */
+MfStream *Mf_OpenSharedStream(MfFile *of)
+{
+    MfStream *ret = Mf_New(MfStream);
+
     ret->file = of;
+    ret->cursors = Mf_Calloc((of->trackCt + 1) * sizeof(MfStreamCursor));
+    ret->sounding = Mf_Calloc(16 * 128);
+    Mf_StreamSeek(ret, 0, 0);
     return ret;
 }
 
 /* start a stream at this timestamp, only necessary for time-based reading */
 PmError Mf_StartStream(MfStream *stream, PtTimestamp timestamp)
 {
-    Mf_StreamSetTempo(stream, timestamp, 0, 0, 500000); /* 120BPM */
+    Mf_StreamSetTempo(stream, timestamp, 0, 0, Mf_StreamDefaultTempo(stream));
+    return pmNoError;
+}
+
+/* start a stream at this time in nanoseconds */
+PmError Mf_StartStreamNs(MfStream *stream, int64_t ns)
+{
+    Mf_StreamSetTempo(stream, 0, 0, 0, Mf_StreamDefaultTempo(stream));
+    stream->startNs = ns;
+    Mf_StreamAnchorTick(stream, 0);
     return pmNoError;
 }
 
+/* the tempo until the file sets one: 120BPM, through any transform */
+static uint32_t Mf_StreamDefaultTempo(MfStream *stream)
+{
+    if (stream->transform) return Mf_TransformTempo(stream->transform, 500000);
+    return 500000;
+}
+
+/* use a different clock for this stream */
+void Mf_StreamSetClock(MfStream *stream, MfClock clock, void *arg)
+{
+    stream->clock = clock;
+    stream->clockArg = arg;
+}
+
+/* the current time on this stream's clock */
+int64_t Mf_StreamNowNs(MfStream *stream)
+{
+    if (stream->clock) return stream->clock(stream->clockArg);
+    return (int64_t) Pt_Time() * 1000000;
+}
+
+/* a clock source reading the system's monotonic clock */
+int64_t Mf_MonotonicClock(void *ignore)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* open a stream which encodes events into a MIDI file as they're written */
+MfStream *Mf_OpenStreamWriter(FILE *into, uint16_t timeDivision, int flags)
+{
+    MfStream *ret = Mf_OpenStream(Mf_NewFile(timeDivision));
+    MfStreamWriter *writer = Mf_New(MfStreamWriter);
+    unsigned char header[22];
+
+    writer->into = into;
+    writer->flags = flags;
+    writer->start = ftell(into);
+    if (writer->start < 0) writer->start = 0;
+    ret->writer = writer;
+
+    /* the header, with the track count filled in later */
+    memcpy(header, "MThd\0\0\0\x06", 8);
+    WRITE_BE(header + 8, (flags & MF_STREAM_SPILL) ? 1 : 0, 2);
+    WRITE_BE(header + 10, (flags & MF_STREAM_SPILL) ? 0 : 1, 2);
+    WRITE_BE(header + 12, timeDivision, 2);
+
+    if (flags & MF_STREAM_SPILL) {
+        fwrite(header, 1, 14, into);
+    } else {
+        /* and the one track chunk, with its length filled in later */
+        memcpy(header + 14, "MTrk\0\0\0\0", 8);
+        fwrite(header, 1, 22, into);
+        Mf_AssertWriterTrack(writer, 0);
+    }
+    if (ferror(into)) writer->perr = pmHostError;
+
+    return ret;
+}
+
+/* flush a stream writer, and fix up the header and chunk lengths */
+PmError Mf_StreamSync(MfStream *stream)
+{
+    MfStreamWriter *writer = stream->writer;
+    int i;
+
+    if (!writer) return pmNoError;
+
+    if (writer->flags & MF_STREAM_SPILL) {
+        for (i = 0; i < writer->trackCt; i++) {
+            if (fflush(writer->tracks[i].fh)) writer->perr = pmHostError;
+        }
+    } else {
+        Mf_StreamWriterPatch(writer, writer->start + 18, writer->tracks[0].length, 4);
+    }
+
+    if (fflush(writer->into)) writer->perr = pmHostError;
+    return writer->perr;
+}
+
 /* close a stream, returning the now-complete file if you were writing (also
  * adds TrkEnd events and sets the format) */
 MfFile *Mf_CloseStream(MfStream *stream)
 {
     int i;
     MfFile *file = stream->file;
+
+    Mf_StreamCollect(stream);
+
+    if (stream->cursors) {
+        /* the file was never ours */
+        AL.free(stream->cursors);
+        AL.free(stream->sounding);
+        AL.free(stream);
+        return NULL;
+    }
+
+    if (stream->writer) {
+        /* everything's already been written */
+        Mf_CloseStreamWriter(stream);
+        return NULL;
+    }
+
     AL.free(stream);
 
     /* finalize all the tracks */
@@ -67,6 +248,20 @@ MfFile *Mf_CloseStream(MfStream *stream)
     return file;
 }
 
+/* close a stream writer, reporting any error writing it */
+PmError Mf_CloseStreamWriter(MfStream *stream)
+{
+    PmError perr;
+
+    if (!stream->writer) return pmBadPtr;
+
+    Mf_StreamCollect(stream);
+    perr = Mf_FinishStreamWriter(stream);
+    Mf_FreeFile(stream->file);
+    AL.free(stream);
+    return perr;
+}
+
 static void Mf_FinalizeTrack(MfTrack *track)
 {
     MfEvent *event;
@@ -83,9 +278,9 @@ static void Mf_FinalizeTrack(MfTrack *track)
 
     if (mustFinalize) {
         /* OK, we have to finalize */
-        event = Mf_NewEvent();
+        event = Mf_NewEventCtx(track->ctx);
         event->e.message = Pm_Message(0xFF, 0, 0);
-        event->meta = Mf_NewMeta(0);
+        event->meta = Mf_NewMetaCtx(track->ctx, 0);
         event->meta->type = 0x2F;
         Mf_PushEvent(track, event);
     }
@@ -100,7 +295,8 @@ PmError Mf_StreamPoll(MfStream *stream)
     uint32_t curTick;
 
     /* calculate the current tick */
-    curTick = Mf_StreamGetTick(stream, Pt_Time());
+    curTick = Mf_StreamGetTickNs(stream, Mf_StreamNowNs(stream));
+    if (stream->cursors) return (Mf_StreamNext(stream) <= curTick) ? TRUE : FALSE;
 
     file = stream->file;
     for (i = 0; i < file->trackCt; i++) {
@@ -121,6 +317,16 @@ uint32_t Mf_StreamNext(MfStream *stream)
     MfEvent *event;
 
     file = stream->file;
+    if (stream->cursors) {
+        for (i = 0; i < file->trackCt; i++) {
+            if (stream->cursors[i].event && stream->cursors[i].tick < next) next = stream->cursors[i].tick;
+        }
+
+        /* a loop goes on forever */
+        if (stream->loopFrom && next >= stream->loopTo) next = stream->loopTo;
+        return next;
+    }
+
     for (i = 0; i < file->trackCt; i++) {
         track = file->tracks[i];
         event = track->head;
@@ -133,6 +339,8 @@ uint32_t Mf_StreamNext(MfStream *stream)
 /* is the stream empty? */
 PmError Mf_StreamEmpty(MfStream *stream)
 {
+    if (stream->optimizer && Mf_OptimizerPending(stream->optimizer)) return FALSE;
+    if (stream->releasing) return FALSE;
     if (Mf_StreamNext(stream) == (uint32_t) -1) {
         return TRUE;
     } else {
@@ -148,6 +356,9 @@ int Mf_StreamReadUntil(MfStream *stream, MfEvent **into, int *ptrack, int32_t le
     MfTrack *track;
     MfEvent *event;
 
+    /* shared streams can't hand out their events */
+    if (stream->cursors) return pmBadPtr;
+
     file = stream->file;
     for (i = 0; i < file->trackCt; i++) {
         track = file->tracks[i];
@@ -180,7 +391,7 @@ int Mf_StreamRead(MfStream *stream, MfEvent **into, int *ptrack, int32_t length)
     uint32_t curTick;
 
     /* calculate the current tick */
-    curTick = Mf_StreamGetTick(stream, Pt_Time());
+    curTick = Mf_StreamGetTickNs(stream, Mf_StreamNowNs(stream));
 
     return Mf_StreamReadUntil(stream, into, ptrack, length, curTick);
 }
@@ -189,34 +400,433 @@ int Mf_StreamReadNormal(MfStream *stream, MfEvent **into, int *ptrack, int32_t l
 {
     int32_t i;
     MfEvent *event;
+    MF_TRACE_BEGIN(span);
+
+    if (stream->cursors) return pmBadPtr;
 
     for (i = 0; i < length; i++) {
         if (Mf_StreamRead(stream, into + i, ptrack + i, 1) == 1) {
             event = into[i];
 
-            /* check if it's a meta-event */
-            if (event->meta) {
-                /* don't send it to the user, just check it */
+            /* check if it's a meta-event or transformed away */
+            if (!Mf_StreamKeepEvent(stream, event, event->absoluteTm, &event->e.message)) {
+                /* don't send it to the user */
                 i--;
-                if (event->meta->type == 0x51 && event->meta->length == 3) { /* tempo change */
-                    /* send the tempo change back */
-                    PtTimestamp ts;
-                    unsigned char *data = event->meta->data;
-                    uint32_t tempo = (data[0] << 16) +
-                        (data[1] << 8) +
-                        data[2];
-                    Mf_StreamSetTempoTick(stream, &ts, event->absoluteTm, tempo);
-                }
-                Mf_FreeEvent(event);
+                Mf_FreeEventCtx(stream->file->ctx, event);
             }
         } else {
             break;
         }
     }
 
+    MF_TRACE_END(span, "Mf_StreamReadNormal");
     return i;
 }
 
+/* real-time-safe reading */
+int Mf_StreamReadRT(MfStream *stream, MfEvent **into, int *ptrack, int32_t length)
+{
+    if (stream->cursors) return pmBadPtr;
+    return Mf_StreamReadBatch(stream, into, NULL, ptrack, length);
+}
+
+/* real-time-safe reading straight into PmEvents */
+int Mf_StreamReadPm(MfStream *stream, PmEvent *into, int *ptrack, int32_t length)
+{
+    if (stream->optimizer) return Mf_StreamReadOptimized(stream, into, ptrack, length);
+    if (stream->cursors) return Mf_StreamReadShared(stream, into, ptrack, length);
+    return Mf_StreamReadBatch(stream, NULL, into, ptrack, length);
+}
+
+/* read a batch of due events, either handing them out in into, or copying
+ * them into pmInto and retiring them */
+static int Mf_StreamReadBatch(MfStream *stream, MfEvent **into, PmEvent *pmInto, int *ptrack, int32_t length)
+{
+    MfFile *file = stream->file;
+    MfTrack *track;
+    MfEvent *event, *retired = NULL, *retiredTail = NULL;
+    int64_t now;
+    uint32_t curTick, bestTm = 0;
+    int32_t rd = 0, work;
+    int i, best;
+    MF_TRACE_BEGIN(span);
+
+    Mf_EnterRealTime();
+
+    /* one clock read for the whole batch */
+    now = Mf_StreamNowNs(stream);
+    curTick = Mf_StreamGetTickNs(stream, now);
+
+    for (work = 0; work < length; work++) {
+        /* find the earliest due event */
+        best = -1;
+        for (i = 0; i < file->trackCt; i++) {
+            event = file->tracks[i]->head;
+            if (event && event->absoluteTm <= curTick && (best < 0 || event->absoluteTm < bestTm)) {
+                best = i;
+                bestTm = event->absoluteTm;
+            }
+        }
+        if (best < 0) break;
+
+        /* take it off its track */
+        track = file->tracks[best];
+        event = track->head;
+        track->head = event->next;
+        if (!(track->head)) track->tail = NULL;
+        event->next = NULL;
+
+        if (!Mf_StreamKeepEvent(stream, event, event->absoluteTm, &event->e.message)) {
+            /* retire it instead of freeing it, and recalculate the tick in
+             * case the tempo changed */
+            if (!retiredTail) retiredTail = event;
+            event->next = retired;
+            retired = event;
+            curTick = Mf_StreamGetTickNs(stream, now);
+            continue;
+        }
+
+        event->e.timestamp = Mf_StreamGetTimestamp(stream, NULL, event->absoluteTm);
+        if (ptrack) ptrack[rd] = best;
+        if (pmInto) {
+            /* the user only gets a copy, so we're done with it */
+            pmInto[rd++] = event->e;
+            if (!retiredTail) retiredTail = event;
+            event->next = retired;
+            retired = event;
+        } else {
+            into[rd++] = event;
+        }
+    }
+
+    if (retired) Mf_StreamRetireChain(stream, retired, retiredTail);
+
+    Mf_LeaveRealTime();
+    MF_TRACE_END(span, pmInto ? "Mf_StreamReadPm" : "Mf_StreamReadRT");
+    return rd;
+}
+
+/* read due events through the stream's optimizer */
+static int Mf_StreamReadOptimized(MfStream *stream, PmEvent *into, int *ptrack, int32_t length)
+{
+    MfOptimizer *opt = stream->optimizer;
+    PmEvent events[64];
+    int tracks[64];
+    PtTimestamp now = Mf_StreamNowNs(stream) / 1000000;
+    int32_t rd, ct, room, i;
+
+    rd = Mf_OptimizerDrain(opt, now, into, ptrack, length);
+    while (rd < length) {
+        room = Mf_OptimizerRoom(opt);
+        if (room > 64) room = 64;
+        if (room <= 0) break;
+
+        if (stream->cursors) ct = Mf_StreamReadShared(stream, events, tracks, room);
+        else ct = Mf_StreamReadBatch(stream, NULL, events, tracks, room);
+        if (ct <= 0) break;
+
+        for (i = 0; i < ct; i++) Mf_OptimizerPush(opt, events + i, tracks[i]);
+        rd += Mf_OptimizerDrain(opt, now, into + rd, ptrack ? ptrack + rd : NULL, length - rd);
+    }
+
+    return rd;
+}
+
+/* read due events from a shared stream's cursors, copying them */
+static int Mf_StreamReadShared(MfStream *stream, PmEvent *into, int *ptrack, int32_t length)
+{
+    MfFile *file = stream->file;
+    MfStreamCursor *cursor;
+    MfStreamMark *mark;
+    PmMessage message;
+    int64_t now;
+    uint32_t curTick, bestTm = 0;
+    int32_t rd = 0, work;
+    int i, best;
+    MF_TRACE_BEGIN(span);
+
+    Mf_EnterRealTime();
+
+    now = Mf_StreamNowNs(stream);
+    curTick = Mf_StreamGetTickNs(stream, now);
+
+    for (work = 0; work < length && rd < length; work++) {
+        /* end the notes left sounding by a jump first */
+        if (stream->releasing) {
+            rd = Mf_StreamReleaseNotes(stream, into, ptrack, rd, length);
+            if (rd >= length) break;
+        }
+
+        /* find the earliest due event */
+        best = -1;
+        for (i = 0; i < file->trackCt; i++) {
+            cursor = &stream->cursors[i];
+            if (cursor->event && cursor->tick <= curTick && (best < 0 || cursor->tick < bestTm)) {
+                best = i;
+                bestTm = cursor->tick;
+            }
+        }
+
+        if (stream->loopFrom && curTick >= stream->loopTo && (best < 0 || bestTm >= stream->loopTo)) {
+            /* the end of the loop, so carry on from its start at exactly the
+             * time of its end */
+            mark = stream->loopFrom;
+            Mf_StreamAnchorTick(stream, stream->loopTo);
+            Mf_StreamJumped(stream, stream->tempoTs);
+            memcpy(stream->cursors, mark->cursors, file->trackCt * sizeof(MfStreamCursor));
+            stream->tempoTick = stream->cursorTick = mark->tick;
+            stream->tempo = mark->tempo;
+            curTick = Mf_StreamGetTickNs(stream, now);
+            continue;
+        }
+        if (best < 0) break;
+
+        /* step past it */
+        cursor = &stream->cursors[best];
+        message = cursor->event->e.message;
+        if (!Mf_StreamKeepEvent(stream, cursor->event, bestTm, &message)) {
+            Mf_StreamCursorNext(cursor);
+            curTick = Mf_StreamGetTickNs(stream, now);
+            continue;
+        }
+        Mf_StreamCursorNext(cursor);
+        Mf_StreamCountNote(stream, message);
+
+        into[rd].message = message;
+        into[rd].timestamp = Mf_StreamGetTimestamp(stream, NULL, bestTm);
+        if (ptrack) ptrack[rd] = best;
+        rd++;
+    }
+    stream->cursorTick = curTick;
+
+    Mf_LeaveRealTime();
+    MF_TRACE_END(span, "Mf_StreamReadPm");
+    return rd;
+}
+
+static void Mf_StreamCursorNext(MfStreamCursor *cursor)
+{
+    cursor->event = Mf_WalkNext(&cursor->walk);
+    cursor->tick = cursor->walk.tick;
+}
+
+/* a shared stream has jumped, so the notes sounding need ending at ts */
+static void Mf_StreamJumped(MfStream *stream, PtTimestamp ts)
+{
+    if (!stream->soundingCt) return;
+    stream->releasing = 1;
+    stream->releaseTs = ts;
+}
+
+/* keep count of the notes a shared stream has sounding */
+static void Mf_StreamCountNote(MfStream *stream, PmMessage message)
+{
+    uint8_t *count;
+    int type = Pm_MessageType(message);
+
+    if (type != MIDI_NOTE_OFF && type != MIDI_NOTE_ON) return;
+    count = &stream->sounding[Pm_MessageChannel(message) * 128 + (Pm_MessageData1(message) & 0x7F)];
+
+    if (type == MIDI_NOTE_ON && Pm_MessageData2(message)) {
+        if (*count < 255) {
+            (*count)++;
+            stream->soundingCt++;
+        }
+    } else if (*count) {
+        (*count)--;
+        stream->soundingCt--;
+    }
+}
+
+/* write note-offs for the notes left sounding by a jump, as many as fit,
+ * returning the new read count */
+static int32_t Mf_StreamReleaseNotes(MfStream *stream, PmEvent *into, int *ptrack, int32_t rd, int32_t length)
+{
+    int i;
+
+    for (i = 0; i < 16 * 128 && stream->soundingCt; i++) {
+        while (stream->sounding[i]) {
+            if (rd >= length) return rd;
+            into[rd].message = Pm_Message(Pm_MessageStatusGen(MIDI_NOTE_OFF, i / 128), i % 128, 0);
+            into[rd].timestamp = stream->releaseTs;
+            if (ptrack) ptrack[rd] = 0;
+            rd++;
+            stream->sounding[i]--;
+            stream->soundingCt--;
+        }
+    }
+
+    stream->releasing = 0;
+    return rd;
+}
+
+/* move a shared stream */
+void Mf_StreamSeek(MfStream *stream, uint32_t tick, PtTimestamp ts)
+{
+    MfFile *file = stream->file;
+    MfStreamCursor *cursor;
+    uint32_t tempo = 0, tempoTick = 0, eventTempo;
+    int i, found = 0;
+
+    if (!stream->cursors) return;
+
+    for (i = 0; i < file->trackCt; i++) {
+        cursor = &stream->cursors[i];
+        Mf_WalkTrack(&cursor->walk, file->tracks[i]);
+        Mf_StreamCursorNext(cursor);
+
+        /* find the tempo on the way */
+        while (cursor->event && cursor->tick < tick) {
+            if (Mf_StreamEventTempo(cursor->event, &eventTempo) && (!found || cursor->tick >= tempoTick)) {
+                tempo = eventTempo;
+                tempoTick = cursor->tick;
+                found = 1;
+            }
+            Mf_StreamCursorNext(cursor);
+        }
+    }
+    if (!found) tempo = Mf_StreamDefaultTempo(stream);
+    else if (stream->transform) tempo = Mf_TransformTempo(stream->transform, tempo);
+
+    stream->cursorTick = tick;
+    Mf_StreamSetTempo(stream, ts, 0, tick, tempo);
+    Mf_StreamJumped(stream, ts);
+}
+
+/* remember where a shared stream is */
+MfStreamMark *Mf_StreamMark(MfStream *stream)
+{
+    MfStreamMark *ret;
+    int trackCt = stream->file->trackCt;
+
+    if (!stream->cursors) return NULL;
+
+    ret = Mf_New(MfStreamMark);
+    ret->trackCt = trackCt;
+    ret->tick = stream->cursorTick;
+    ret->tempo = stream->tempo;
+    ret->cursors = Mf_Malloc((trackCt + 1) * sizeof(MfStreamCursor));
+    memcpy(ret->cursors, stream->cursors, trackCt * sizeof(MfStreamCursor));
+    return ret;
+}
+
+void Mf_FreeStreamMark(MfStreamMark *mark)
+{
+    AL.free(mark->cursors);
+    AL.free(mark);
+}
+
+/* go back to a mark */
+void Mf_StreamRestore(MfStream *stream, MfStreamMark *mark, PtTimestamp ts)
+{
+    if (!stream->cursors || mark->trackCt != stream->file->trackCt) return;
+
+    memcpy(stream->cursors, mark->cursors, mark->trackCt * sizeof(MfStreamCursor));
+    stream->cursorTick = mark->tick;
+    Mf_StreamSetTempo(stream, ts, 0, mark->tick, mark->tempo);
+    Mf_StreamJumped(stream, ts);
+}
+
+/* loop a shared stream */
+void Mf_StreamLoop(MfStream *stream, MfStreamMark *from, uint32_t to)
+{
+    if (from && (!stream->cursors || from->trackCt != stream->file->trackCt || from->tick >= to)) return;
+    stream->loopFrom = from;
+    stream->loopTo = to;
+}
+
+/* give events back to the stream to be freed by Mf_StreamCollect */
+void Mf_StreamRetire(MfStream *stream, MfEvent **events, int32_t length)
+{
+    int32_t i;
+
+    if (length <= 0) return;
+    for (i = 0; i < length - 1; i++) events[i]->next = events[i + 1];
+    Mf_StreamRetireChain(stream, events[0], events[length - 1]);
+}
+
+/* free retired events */
+int Mf_StreamCollect(MfStream *stream)
+{
+    MfEvent *event, *next;
+    int ct = 0;
+
+    event = __atomic_exchange_n(&stream->retired, NULL, __ATOMIC_ACQUIRE);
+    for (; event; event = next) {
+        next = event->next;
+        Mf_FreeEventCtx(stream->file->ctx, event);
+        ct++;
+    }
+
+    return ct;
+}
+
+/* push a chain of events onto the retired list, without locks */
+static void Mf_StreamRetireChain(MfStream *stream, MfEvent *head, MfEvent *tail)
+{
+    MfEvent *old = __atomic_load_n(&stream->retired, __ATOMIC_RELAXED);
+
+    do {
+        tail->next = old;
+    } while (!__atomic_compare_exchange_n(&stream->retired, &old, head, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* handle a meta-event or SysEx at tick or transform a message read from the
+ * stream (in place in *message), returning whether the event should be passed
+ * on to the user */
+static int Mf_StreamKeepEvent(MfStream *stream, MfEvent *event, uint32_t tick, PmMessage *message)
+{
+    uint32_t tempo;
+    PtTimestamp ts;
+
+    if (event->meta) {
+        if (Mf_StreamEventTempo(event, &tempo)) {
+            /* send the tempo change back */
+            if (stream->transform) tempo = Mf_TransformTempo(stream->transform, tempo);
+            Mf_StreamSetTempoTick(stream, &ts, tick, tempo);
+        } else if (stream->sysex &&
+                   Mf_StatusTable[Pm_MessageStatus(event->e.message)].kind == MF_KIND_SYSEX) {
+            stream->sysex(stream->sysexArg, Mf_StreamGetTimestamp(stream, NULL, tick),
+                          event->meta->type, event->meta->data, event->meta->length);
+        }
+        return 0;
+    }
+
+    if (stream->transform && !Mf_TransformMessage(stream->transform, message))
+        return 0;
+
+    return 1;
+}
+
+/* get the tempo from a tempo change */
+static int Mf_StreamEventTempo(MfEvent *event, uint32_t *tempo)
+{
+    if (!event->meta || event->meta->type != MIDI_M_TEMPO || event->meta->length != MIDI_M_TEMPO_LENGTH)
+        return 0;
+    *tempo = MIDI_M_TEMPO_N(event->meta->data);
+    return 1;
+}
+
+/* apply a transform to events read with Mf_StreamReadNormal */
+void Mf_StreamSetTransform(MfStream *stream, MfTransform *transform)
+{
+    stream->transform = transform;
+}
+
+/* hand SysEx read from the stream to func */
+void Mf_StreamSetSysEx(MfStream *stream, MfSysExFunc func, void *arg)
+{
+    stream->sysex = func;
+    stream->sysexArg = arg;
+}
+
+/* pass events read with Mf_StreamReadPm through an output optimizer */
+void Mf_StreamSetOptimizer(MfStream *stream, MfOptimizer *opt)
+{
+    stream->optimizer = opt;
+}
+
 /* write events into the stream (takes ownership of events) */
 PmError Mf_StreamWrite(MfStream *stream, int track, MfEvent **events, int32_t length)
 {
@@ -232,7 +842,23 @@ PmError Mf_StreamWrite(MfStream *stream, int track, MfEvent **events, int32_t le
 
 PmError Mf_StreamWriteOne(MfStream *stream, int trackno, MfEvent *event)
 {
-    MfTrack *track = Mf_AssertTrack(stream->file, trackno);
+    MfTrack *track;
+    MfStreamWriterTrack *wtrack = NULL;
+    uint32_t lastTick;
+
+    if (stream->cursors) {
+        Mf_FreeEventCtx(stream->file->ctx, event);
+        return pmBadPtr;
+    }
+    track = Mf_AssertTrack(stream->file, trackno);
+
+    if (stream->writer) {
+        wtrack = Mf_AssertWriterTrack(stream->writer,
+            (stream->writer->flags & MF_STREAM_SPILL) ? trackno : 0);
+        lastTick = wtrack->lastTick;
+    } else {
+        lastTick = track->tail ? track->tail->absoluteTm : 0;
+    }
 
     /* first correct the event's delta time */
     if (event->deltaTm == 0) {
@@ -243,15 +869,16 @@ PmError Mf_StreamWriteOne(MfStream *stream, int trackno, MfEvent *event)
 
         if (event->absoluteTm != 0) {
             /* subtract away the delta */
-            if (track->tail) {
-                event->deltaTm = event->absoluteTm - track->tail->absoluteTm;
-            } else {
-                event->deltaTm = event->absoluteTm;
+            if (wtrack && event->absoluteTm < lastTick) {
+                /* merged tracks can't go back in time */
+                event->absoluteTm = lastTick;
             }
+            event->deltaTm = event->absoluteTm - lastTick;
         }
     }
 
     /* then add it */
+    if (wtrack) return Mf_StreamWriterWrite(stream->writer, wtrack, event);
     Mf_PushEvent(track, event);
     return pmNoError;
 }
@@ -262,6 +889,127 @@ static MfTrack *Mf_AssertTrack(MfFile *file, int track)
     return file->tracks[track];
 }
 
+static MfStreamWriterTrack *Mf_AssertWriterTrack(MfStreamWriter *writer, int track)
+{
+    MfStreamWriterTrack *newTracks;
+    int newCt;
+
+    if (track < writer->trackCt) return &writer->tracks[track];
+
+    newCt = track + 1;
+    newTracks = Mf_Calloc(newCt * sizeof(MfStreamWriterTrack));
+    if (writer->tracks) {
+        memcpy(newTracks, writer->tracks, writer->trackCt * sizeof(MfStreamWriterTrack));
+        AL.free(writer->tracks);
+    }
+    writer->tracks = newTracks;
+
+    for (; writer->trackCt < newCt; writer->trackCt++) {
+        if (writer->flags & MF_STREAM_SPILL) {
+            newTracks[writer->trackCt].fh = tmpfile();
+            if (!newTracks[writer->trackCt].fh) writer->perr = pmHostError;
+        } else {
+            newTracks[writer->trackCt].fh = writer->into;
+        }
+    }
+
+    return &writer->tracks[track];
+}
+
+/* encode an event into a stream writer's track, taking ownership of it */
+static PmError Mf_StreamWriterWrite(MfStreamWriter *writer, MfStreamWriterTrack *track, MfEvent *event)
+{
+    PmError perr;
+    uint32_t sz;
+
+    if (!track->fh) {
+        Mf_FreeEvent(event);
+        return writer->perr;
+    }
+
+    perr = Mf_EncodeMidiEvent(track->fh, event, &track->status, &sz);
+    track->length += sz;
+    track->lastTick += event->deltaTm;
+    Mf_FreeEvent(event);
+
+    if (perr) writer->perr = perr;
+    if (ferror(track->fh)) writer->perr = pmHostError;
+    return writer->perr;
+}
+
+/* overwrite a big-endian number earlier in the output */
+static PmError Mf_StreamWriterPatch(MfStreamWriter *writer, long at, uint32_t val, int bytes)
+{
+    unsigned char buf[4];
+    long end = ftell(writer->into);
+
+    WRITE_BE(buf, val, bytes);
+    if (end < 0 ||
+        fseek(writer->into, at, SEEK_SET) ||
+        fwrite(buf, 1, bytes, writer->into) != (size_t) bytes ||
+        fseek(writer->into, end, SEEK_SET))
+        writer->perr = pmHostError;
+
+    return writer->perr;
+}
+
+/* finish off a stream writer's output and free it */
+static PmError Mf_FinishStreamWriter(MfStream *stream)
+{
+    MfStreamWriter *writer = stream->writer;
+    MfStreamWriterTrack *track;
+    MfEvent *event;
+    unsigned char buf[4096];
+    size_t rd, copied;
+    PmError perr;
+    int i;
+
+    /* end all the tracks */
+    for (i = 0; i < writer->trackCt; i++) {
+        event = Mf_NewEvent();
+        event->e.message = Pm_Message(MIDI_STATUS_META, 0, 0);
+        event->meta = Mf_NewMeta(0);
+        event->meta->type = MIDI_M_END;
+        Mf_StreamWriterWrite(writer, &writer->tracks[i], event);
+    }
+
+    if (writer->flags & MF_STREAM_SPILL) {
+        /* copy in all the spilled tracks */
+        for (i = 0; i < writer->trackCt; i++) {
+            track = &writer->tracks[i];
+            if (!track->fh) continue;
+
+            memcpy(buf, "MTrk", 4);
+            fwrite(buf, 1, 4, writer->into);
+            WRITE_BE(buf, track->length, 4);
+            fwrite(buf, 1, 4, writer->into);
+
+            /* a track short of its length would make the whole file bad */
+            rewind(track->fh);
+            copied = 0;
+            while ((rd = fread(buf, 1, sizeof(buf), track->fh)) > 0) {
+                if (fwrite(buf, 1, rd, writer->into) != rd) break;
+                copied += rd;
+            }
+            if (ferror(track->fh) || ferror(writer->into) || copied != track->length)
+                writer->perr = pmHostError;
+            fclose(track->fh);
+        }
+        Mf_StreamWriterPatch(writer, writer->start + 10, writer->trackCt, 2);
+        if (fflush(writer->into)) writer->perr = pmHostError;
+
+    } else {
+        Mf_StreamSync(stream);
+
+    }
+
+    perr = writer->perr;
+    AL.free(writer->tracks);
+    AL.free(writer);
+    stream->writer = NULL;
+    return perr;
+}
+
 /* get the current tempo from this filestream */
 uint32_t Mf_StreamGetTempo(MfStream *stream)
 {
@@ -271,34 +1019,59 @@ uint32_t Mf_StreamGetTempo(MfStream *stream)
 /* get a tick from this filestream */
 uint32_t Mf_StreamGetTick(MfStream *stream, PtTimestamp timestamp)
 {
-    uint64_t tsus = 0;
+    return Mf_StreamGetTickNs(stream, (int64_t) timestamp * 1000000);
+}
 
-    /* adjust for the current tick */
-    timestamp -= stream->tempoTs;
-    if (stream->tempoUs > 0) {
-        timestamp--;
-        tsus = 1000 - stream->tempoUs;
-    }
-    tsus += (uint64_t) timestamp * 1000;
+/* get a timestamp from this filestream at a given tick */
+PtTimestamp Mf_StreamGetTimestamp(MfStream *stream, int *us, uint32_t tick)
+{
+    int64_t ns = Mf_StreamGetTimeNs(stream, tick);
+
+    if (us) *us = (ns / 1000) % 1000;
+    return ns / 1000000;
+}
 
+/* get a tick from this filestream at a time in nanoseconds */
+uint32_t Mf_StreamGetTickNs(MfStream *stream, int64_t ns)
+{
     /* tempo is in microseconds per quarter note, ticks are timeDivision per
      * quarter note, so the algo is:
-     * tsus / tempo * timeDivision */
-    return stream->tempoTick + tsus * stream->file->timeDivision / stream->tempo;
+     * ns / (tempo * 1000) * timeDivision
+     * relative to the last tempo change */
+    int64_t nsDiv = (int64_t) ((__int128) (ns - stream->startNs) * stream->file->timeDivision - stream->tempoNsDiv);
+    int64_t perTick = (int64_t) stream->tempo * 1000;
+    int64_t ticks;
+
+    /* round towards the past, even before the last tempo change */
+    ticks = nsDiv / perTick;
+    if (nsDiv % perTick < 0) ticks--;
+    ticks += stream->tempoTick;
+
+    return (ticks < 0) ? 0 : ticks;
 }
 
-/* get a timestamp from this filestream at a given tick */
-PtTimestamp Mf_StreamGetTimestamp(MfStream *stream, int *us, uint32_t tick)
+/* get a time in nanoseconds from this filestream at a given tick */
+int64_t Mf_StreamGetTimeNs(MfStream *stream, uint32_t tick)
 {
-    uint64_t tickl = tick - stream->tempoTick;
-    uint64_t tsbase = ((uint64_t) stream->tempoTs * 1000) + stream->tempoUs;
+    int64_t tickl = (int64_t) tick - stream->tempoTick;
+    __int128 nsDiv = stream->tempoNsDiv + (__int128) tickl * stream->tempo * 1000;
 
-    tsbase = tsbase + tickl * stream->tempo / stream->file->timeDivision;
+    /* round towards the future, so that the tick has been reached by then */
+    if (nsDiv > 0) nsDiv += stream->file->timeDivision - 1;
+    return stream->startNs + (int64_t) (nsDiv / stream->file->timeDivision);
+}
 
-    if (us) *us = tsbase % 1000;
-    tsbase /= 1000;
+/* move the tempo anchor to this tick, exactly */
+static void Mf_StreamAnchorTick(MfStream *stream, uint32_t tick)
+{
+    int64_t ns;
+
+    stream->tempoNsDiv += (int64_t) ((__int128) ((int64_t) tick - stream->tempoTick) * stream->tempo * 1000);
+    stream->tempoTick = tick;
 
-    return tsbase;
+    ns = stream->startNs + stream->tempoNsDiv / stream->file->timeDivision;
+    stream->tempoTs = ns / 1000000;
+    stream->tempoUs = (ns / 1000) % 1000;
 }
 
 /* update all tempo info for this filestream */
@@ -306,6 +1079,8 @@ PmError Mf_StreamSetTempo(MfStream *stream, PtTimestamp ts, int us, uint32_t tic
 {
     stream->tempoTs = ts;
     stream->tempoUs = us;
+    stream->startNs = (int64_t) ts * 1000000 + (int64_t) us * 1000;
+    stream->tempoNsDiv = 0;
     stream->tempoTick = tick;
     stream->tempo = tempo;
     return pmNoError;
@@ -314,11 +1089,10 @@ PmError Mf_StreamSetTempo(MfStream *stream, PtTimestamp ts, int us, uint32_t tic
 /* update the tempo for this filestream at a tick, writes the timestamp of the update into ts */
 PmError Mf_StreamSetTempoTick(MfStream *stream, PtTimestamp *ts, uint32_t tick, uint32_t tempo)
 {
-    int us;
-    *ts = Mf_StreamGetTimestamp(stream, &us, tick);
-    stream->tempoTs = *ts;
-    stream->tempoUs = us;
-    stream->tempoTick = tick;
+    MF_TRACE_INSTANT("tempo change");
+
+    Mf_StreamAnchorTick(stream, tick);
+    *ts = stream->tempoTs;
     stream->tempo = tempo;
     return pmNoError;
 }
@@ -326,10 +1100,12 @@ PmError Mf_StreamSetTempoTick(MfStream *stream, PtTimestamp *ts, uint32_t tick,
 /* update the tempo for this filestream at a timestamp, writes the tick of the update into tick */
 PmError Mf_StreamSetTempoTimestamp(MfStream *stream, uint32_t *tick, PtTimestamp ts, uint32_t tempo)
 {
+    MF_TRACE_INSTANT("tempo change");
+
+    /* the change takes effect from the tick at that time, so that the anchor
+     * stays exact */
     *tick = Mf_StreamGetTick(stream, ts);
-    stream->tempoTs = ts;
-    stream->tempoUs = 0;
-    stream->tempoTick = *tick;
+    Mf_StreamAnchorTick(stream, *tick);
     stream->tempo = tempo;
     return pmNoError;
 }
@@ -24,10 +24,24 @@
 #define MIDIFSTREAM_H
 
 #include "midifile.h"
+#include "midifoptimize.h"
+#include "midiftransform.h"
 #include "porttime.h"
 
 /* types */
 typedef struct __MfStream MfStream;
+typedef struct __MfStreamWriter MfStreamWriter;
+typedef struct __MfStreamCursor MfStreamCursor;
+typedef struct __MfStreamMark MfStreamMark;
+
+/* a clock source, returning monotonic time in nanoseconds */
+typedef int64_t (*MfClock)(void *arg);
+
+/* a receiver for SysEx read from a stream, due at timestamp when. status is
+ * 0xF0 for a SysEx message (data being the rest of it, normally ending with
+ * 0xF7) or 0xF7 for an escape (data being sent exactly as is). data is only
+ * valid during the call. */
+typedef void (*MfSysExFunc)(void *arg, PtTimestamp when, uint8_t status, const unsigned char *data, uint32_t length);
 
 /* an active filestream */
 struct __MfStream {
@@ -38,18 +52,104 @@ struct __MfStream {
     PtTimestamp tempoTs;
     int tempoUs; /* microseconds */
     uint32_t tempoTick, tempo;
+
+    /* the time the stream was started (or last moved) at, in nanoseconds,
+     * and the exact time of tempoTick after that, in nanoseconds multiplied
+     * by the time division, so converting between ticks and time never
+     * accumulates rounding error. Keeping the product relative to startNs
+     * keeps it in range however large the clock's values are. tempoTs and
+     * tempoUs are kept in step with them. */
+    int64_t startNs, tempoNsDiv;
+
+    /* the clock read by Mf_StreamRead and Mf_StreamPoll (Pt_Time by default) */
+    MfClock clock;
+    void *clockArg;
+
+    /* transform applied to events read with Mf_StreamReadNormal */
+    MfTransform *transform;
+
+    /* where SysEx read from the stream goes, see Mf_StreamSetSysEx */
+    MfSysExFunc sysex;
+    void *sysexArg;
+
+    /* output optimizer for events read with Mf_StreamReadPm */
+    MfOptimizer *optimizer;
+
+    /* state for writing straight to a file, see Mf_OpenStreamWriter */
+    MfStreamWriter *writer;
+
+    /* events retired by real-time reading, waiting for Mf_StreamCollect */
+    MfEvent *retired;
+
+    /* for shared streams, where each track has got to, the tick read up to,
+     * and the loop being played, if any */
+    MfStreamCursor *cursors;
+    uint32_t cursorTick;
+    MfStreamMark *loopFrom;
+    uint32_t loopTo;
+
+    /* for shared streams, how many of each note (channel * 128 + key) are
+     * sounding, so that jumping can end them, and whether that's still to be
+     * done, and when */
+    uint8_t *sounding;
+    uint32_t soundingCt;
+    int releasing;
+    PtTimestamp releaseTs;
 };
 
-/* open a stream for a file */
+/* open a stream for a file (expanding any patterns in it) */
 MfStream *Mf_OpenStream(MfFile *of);
 
+/* open a shared stream for a file. A shared stream reads through its own
+ * cursors, without changing the file, so any number of shared streams can
+ * play the same file at once, and can seek, loop and rewind without reloading
+ * it. The file mustn't change while any are open, and remains the caller's,
+ * to free after closing them. Shared streams can only be read with
+ * Mf_StreamReadPm (and not written); the other reading functions fail with
+ * pmBadPtr. */
+MfStream *Mf_OpenSharedStream(MfFile *of);
+
 /* start a stream at this timestamp */
 PmError Mf_StartStream(MfStream *stream, PtTimestamp timestamp);
 
+/* start a stream at this time in nanoseconds, as given by its clock */
+PmError Mf_StartStreamNs(MfStream *stream, int64_t ns);
+
+/* use a different clock for this stream (NULL for Pt_Time). Start the stream
+ * with Mf_StartStreamNs in the same clock's time. */
+void Mf_StreamSetClock(MfStream *stream, MfClock clock, void *arg);
+
+/* the current time on this stream's clock */
+int64_t Mf_StreamNowNs(MfStream *stream);
+
+/* a clock source reading the system's monotonic clock */
+int64_t Mf_MonotonicClock(void *ignore);
+
+/* open a stream which encodes events into a MIDI file as they're written,
+ * instead of keeping the whole file in memory. By default all tracks are
+ * merged into a single track chunk (format 0) written directly into the
+ * output, which must be seekable; after each Mf_StreamSync the output is a
+ * complete, readable MIDI file (lacking only the final end-of-track), so a
+ * crash loses at most what was written since. With MF_STREAM_SPILL, each
+ * track is instead spilled to its own temporary file and they're all copied
+ * into the output as a format 1 file on close. */
+#define MF_STREAM_SPILL 1
+MfStream *Mf_OpenStreamWriter(FILE *into, uint16_t timeDivision, int flags);
+
+/* flush a stream writer, and fix up the header and chunk lengths so that the
+ * output is valid so far */
+PmError Mf_StreamSync(MfStream *stream);
+
 /* close a stream, returning the now-complete file if you were writing (also
- * adds TrkEnd events and sets the format) */
+ * adds TrkEnd events and sets the format). Stream writers finish writing
+ * their output and return NULL, as do shared streams. */
 MfFile *Mf_CloseStream(MfStream *stream);
 
+/* close a stream writer as Mf_CloseStream does, but returning whether the
+ * output was written completely (pmHostError if not), which Mf_CloseStream
+ * can't report. Gives pmBadPtr, closing nothing, for other streams. */
+PmError Mf_CloseStreamWriter(MfStream *stream);
+
 /* poll for events from the stream */
 PmError Mf_StreamPoll(MfStream *stream);
 
@@ -59,12 +159,83 @@ uint32_t Mf_StreamNext(MfStream *stream);
 /* is the stream empty? */
 PmError Mf_StreamEmpty(MfStream *stream);
 
-/* read events from the stream (loses ownership of events) */
+/* read events from the stream (loses ownership of events, which were made
+ * with the file's context). Shared streams can't be read this way, and give
+ * pmBadPtr. */
 int Mf_StreamReadUntil(MfStream *stream, MfEvent **into, int *track, int32_t length, uint32_t maxTm);
 int Mf_StreamRead(MfStream *stream, MfEvent **into, int *track, int32_t length);
 int Mf_StreamReadNormal(MfStream *stream, MfEvent **into, int *track, int32_t length);
 
-/* write events into the stream (takes ownership of events) */
+/* real-time-safe reading, like Mf_StreamReadNormal but in time order across
+ * tracks, and:
+ *  - never allocates or frees (meta-events are retired, not freed),
+ *  - never locks,
+ *  - reads the stream's clock once per call,
+ *  - takes at most length events (including meta-events) off the stream.
+ * Events read this way still need freeing, so hand them back with
+ * Mf_StreamRetire when done with them. Retired events are freed by
+ * Mf_StreamCollect, which should be called regularly from a thread that isn't
+ * real-time (and is also called by Mf_CloseStream). Shared streams give
+ * pmBadPtr. */
+int Mf_StreamReadRT(MfStream *stream, MfEvent **into, int *track, int32_t length);
+
+/* the same, but copying the events (with their timestamps) into PmEvents
+ * ready for Pm_Write, so there's nothing to hand back. track may be NULL. */
+int Mf_StreamReadPm(MfStream *stream, PmEvent *into, int *track, int32_t length);
+void Mf_StreamRetire(MfStream *stream, MfEvent **events, int32_t length);
+int Mf_StreamCollect(MfStream *stream);
+
+/* move a shared stream to the first events at or after tick, with the tempo
+ * in effect there, to be played from timestamp ts (which starts the stream,
+ * in place of Mf_StartStream). This walks the file up to tick, except that
+ * seeking to 0 (rewinding) is immediate. Notes sounding are ended at ts, as
+ * with Mf_StreamLoop. */
+void Mf_StreamSeek(MfStream *stream, uint32_t tick, PtTimestamp ts);
+
+/* remember where a shared stream is (the tick it's read up to, and the tempo
+ * there), to go back there later. A mark can be used by any shared stream of
+ * the same file. Returns NULL for other streams. */
+MfStreamMark *Mf_StreamMark(MfStream *stream);
+void Mf_FreeStreamMark(MfStreamMark *mark);
+
+/* go back to a mark, to be played from timestamp ts. This never allocates,
+ * and takes time only in proportion to the number of tracks. Notes sounding
+ * are ended at ts, as with Mf_StreamLoop. */
+void Mf_StreamRestore(MfStream *stream, MfStreamMark *mark, PtTimestamp ts);
+
+/* loop a shared stream: whenever reading reaches tick to, carry on from the
+ * mark from instead, seamlessly in time. Events at to itself aren't played.
+ * from must be before to; NULL stops looping. The stream doesn't take
+ * ownership of the mark.
+ *
+ * Any notes still sounding when the stream jumps (by looping, seeking or
+ * restoring a mark) would never get their note-offs, so the stream keeps
+ * count of the notes it's played, and Mf_StreamReadPm sends a note-off for
+ * each one still sounding, timestamped at the jump, before anything after
+ * it. They're reported as coming from track 0. */
+void Mf_StreamLoop(MfStream *stream, MfStreamMark *from, uint32_t to);
+
+/* apply a transform to events (and tempo changes) read with
+ * Mf_StreamReadNormal. The stream doesn't take ownership of the transform.
+ * Set it before starting the stream (or seeking it), so that the default
+ * tempo, used until the file sets one, is transformed too. */
+void Mf_StreamSetTransform(MfStream *stream, MfTransform *transform);
+
+/* hand SysEx read from the stream (by any of the reading functions) to func,
+ * instead of dropping it like other meta-events. func is called from within
+ * the read, so for real-time reading it mustn't allocate or lock either. NULL
+ * drops SysEx again. */
+void Mf_StreamSetSysEx(MfStream *stream, MfSysExFunc func, void *arg);
+
+/* pass events read with Mf_StreamReadPm through an output optimizer for the
+ * port they're going to (NULL for none). Values it holds back come out of
+ * later reads, and the stream isn't empty until they have. With an
+ * optimizer, a read may take more than length events off the stream, as
+ * some are dropped. The stream doesn't take ownership of the optimizer. */
+void Mf_StreamSetOptimizer(MfStream *stream, MfOptimizer *opt);
+
+/* write events into the stream (takes ownership of events, which must have
+ * been made with the file's context) */
 PmError Mf_StreamWrite(MfStream *stream, int track, MfEvent **events, int32_t length);
 PmError Mf_StreamWriteOne(MfStream *stream, int track, MfEvent *event);
 
@@ -77,6 +248,10 @@ uint32_t Mf_StreamGetTick(MfStream *stream, PtTimestamp timestamp);
 /* get a timestamp from this filestream at a given tick */
 PtTimestamp Mf_StreamGetTimestamp(MfStream *stream, int *us, uint32_t tick);
 
+/* the same in nanoseconds, without rounding to milliseconds */
+uint32_t Mf_StreamGetTickNs(MfStream *stream, int64_t ns);
+int64_t Mf_StreamGetTimeNs(MfStream *stream, uint32_t tick);
+
 /* update all tempo info for this filestream */
 PmError Mf_StreamSetTempo(MfStream *stream, PtTimestamp ts, int us, uint32_t tick, uint32_t tempo);
 
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "midiftrace.h"
+
+#ifdef MF_TRACE
+
+#define MF_TRACE_RING 4096 /* must be a power of two */
+
+/* a recorded span (or instant event if dur < 0) */
+typedef struct __MfTraceEvent MfTraceEvent;
+struct __MfTraceEvent {
+    const char *name;
+    int64_t start, dur;
+};
+
+/* a thread's ring of events */
+typedef struct __MfTraceRing MfTraceRing;
+struct __MfTraceRing {
+    MfTraceRing *next;
+    int tid;
+    uint32_t head; /* total events recorded */
+    MfTraceEvent events[MF_TRACE_RING];
+};
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static MfTraceRing *traceRings = NULL;
+static int traceTids = 0;
+static __thread MfTraceRing *traceRing = NULL;
+
+/* get this thread's ring, making it if needed. This deliberately uses calloc
+ * rather than the library's allocators, so that tracing a real-time section
+ * doesn't trip MF_RT_DEBUG, and rings live until exit so they can be exported
+ * after their threads are gone. */
+static MfTraceRing *Mf_TraceGetRing(void)
+{
+    MfTraceRing *ring = traceRing;
+    if (ring) return ring;
+
+    ring = calloc(1, sizeof(MfTraceRing));
+    if (!ring) return NULL;
+
+    pthread_mutex_lock(&traceLock);
+    ring->tid = ++traceTids;
+    ring->next = traceRings;
+    traceRings = ring;
+    pthread_mutex_unlock(&traceLock);
+
+    traceRing = ring;
+    return ring;
+}
+
+int64_t Mf_TraceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void Mf_TraceRecord(const char *name, int64_t start, int64_t dur)
+{
+    MfTraceRing *ring = Mf_TraceGetRing();
+    MfTraceEvent *event;
+    uint32_t head;
+
+    if (!ring) return;
+    head = ring->head;
+    event = &ring->events[head & (MF_TRACE_RING - 1)];
+    event->name = name;
+    event->start = start;
+    event->dur = dur;
+
+    /* publish it to Mf_TraceExport */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void Mf_TraceSpan(const char *name, int64_t start)
+{
+    Mf_TraceRecord(name, start, Mf_TraceNow() - start);
+}
+
+void Mf_TraceInstant(const char *name)
+{
+    Mf_TraceRecord(name, Mf_TraceNow(), -1);
+}
+
+/* write out everything recorded so far. Threads still tracing may overwrite
+ * the oldest events of their ring while this runs, so those are skipped. */
+int Mf_TraceExport(FILE *into)
+{
+    MfTraceRing *ring;
+    MfTraceEvent *event;
+    uint32_t head, i;
+    int pid = getpid(), first = 1;
+
+    fprintf(into, "{\"traceEvents\":[");
+
+    pthread_mutex_lock(&traceLock);
+    for (ring = traceRings; ring; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        /* once it's wrapped, leave some slack for events being written */
+        i = (head > MF_TRACE_RING) ? head - MF_TRACE_RING + MF_TRACE_RING / 8 : 0;
+        for (; i < head; i++) {
+            event = &ring->events[i & (MF_TRACE_RING - 1)];
+            fprintf(into, "%s\n{\"name\":\"%s\",\"cat\":\"midifile\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                    first ? "" : ",", event->name, pid, ring->tid, event->start / 1000.0);
+            if (event->dur >= 0)
+                fprintf(into, ",\"ph\":\"X\",\"dur\":%.3f}", event->dur / 1000.0);
+            else
+                fprintf(into, ",\"ph\":\"i\",\"s\":\"t\"}");
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&traceLock);
+
+    fprintf(into, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return ferror(into) ? -1 : 0;
+}
+
+#else
+
+int Mf_TraceExport(FILE *into)
+{
+    fprintf(into, "{\"traceEvents\":[]}\n");
+    return ferror(into) ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFTRACE_H
+#define MIDIFTRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* tracing of where time goes in loading, writing and playback. Tracing is
+ * only compiled in with MF_TRACE defined; otherwise these macros expand to
+ * nothing. Spans are recorded into a ring buffer per thread (so old spans are
+ * overwritten if they aren't exported in time). */
+#ifdef MF_TRACE
+#define MF_TRACE_BEGIN(span) int64_t span = Mf_TraceNow()
+#define MF_TRACE_END(span, name) Mf_TraceSpan((name), (span))
+#define MF_TRACE_INSTANT(name) Mf_TraceInstant(name)
+
+/* the current trace time, in nanoseconds */
+int64_t Mf_TraceNow(void);
+
+/* record a span from start until now. name must be a static string. */
+void Mf_TraceSpan(const char *name, int64_t start);
+
+/* record an instantaneous event */
+void Mf_TraceInstant(const char *name);
+
+#else
+#define MF_TRACE_BEGIN(span)
+#define MF_TRACE_END(span, name)
+#define MF_TRACE_INSTANT(name)
+#endif
+
+/* write out everything recorded so far in Chrome trace-event JSON format,
+ * which can be loaded by chrome://tracing or Perfetto. Without MF_TRACE this
+ * writes an empty trace. */
+int Mf_TraceExport(FILE *into);
+
+#endif
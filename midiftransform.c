@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midiftransform.h"
+
+#include "midi.h"
+#include "midifile.h"
+#include "midifilealloc.h"
+#include "midifpattern.h"
+
+/* the fused tables, indexed by the original channel and data */
+struct __MfTransform {
+    uint8_t channel[16];
+    int16_t key[16][128]; /* -1 to drop */
+    uint8_t velocity[16][128];
+    uint8_t dropController[16][128];
+    double tempoScale;
+};
+
+/* file-local miscellany */
+static uint8_t Mf_ClampVelocity(double velocity);
+static int Mf_TransformIsTempo(MfEvent *event);
+
+/* does this stage apply to events originally on channel i? Stages see the
+ * channel as remapped by any earlier stages. */
+#define STAGE_APPLIES(transform, channels, i) ((channels) & (1 << (transform)->channel[i]))
+
+MfTransform *Mf_NewTransform()
+{
+    MfTransform *ret = Mf_New(MfTransform);
+    int i, j;
+
+    /* start with the identity */
+    for (i = 0; i < 16; i++) {
+        ret->channel[i] = i;
+        for (j = 0; j < 128; j++) {
+            ret->key[i][j] = j;
+            ret->velocity[i][j] = j;
+        }
+    }
+    ret->tempoScale = 1;
+
+    return ret;
+}
+
+void Mf_FreeTransform(MfTransform *transform)
+{
+    AL.free(transform);
+}
+
+/* transpose notes on these channels */
+void Mf_TransformTranspose(MfTransform *transform, uint16_t channels, int semitones)
+{
+    int i, j, key;
+
+    for (i = 0; i < 16; i++) {
+        if (!STAGE_APPLIES(transform, channels, i)) continue;
+        for (j = 0; j < 128; j++) {
+            key = transform->key[i][j];
+            if (key < 0) continue;
+            key += semitones;
+            transform->key[i][j] = (key >= 0 && key < 128) ? key : -1;
+        }
+    }
+}
+
+/* scale note-on velocities on these channels */
+void Mf_TransformVelocityScale(MfTransform *transform, uint16_t channels, double scale, int offset)
+{
+    int i, j;
+
+    for (i = 0; i < 16; i++) {
+        if (!STAGE_APPLIES(transform, channels, i)) continue;
+        for (j = 1; j < 128; j++) {
+            transform->velocity[i][j] = Mf_ClampVelocity(transform->velocity[i][j] * scale + offset);
+        }
+    }
+}
+
+/* map note-on velocities on these channels through a curve */
+void Mf_TransformVelocityCurve(MfTransform *transform, uint16_t channels, const uint8_t *curve)
+{
+    int i, j;
+
+    for (i = 0; i < 16; i++) {
+        if (!STAGE_APPLIES(transform, channels, i)) continue;
+        for (j = 1; j < 128; j++) {
+            transform->velocity[i][j] = Mf_ClampVelocity(curve[transform->velocity[i][j]]);
+        }
+    }
+}
+
+/* move everything on one channel to another */
+void Mf_TransformRemapChannel(MfTransform *transform, int from, int to)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        if (transform->channel[i] == from) transform->channel[i] = to & 0xF;
+    }
+}
+
+/* drop a controller on these channels */
+void Mf_TransformFilterController(MfTransform *transform, uint16_t channels, int controller)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        if (STAGE_APPLIES(transform, channels, i)) transform->dropController[i][controller & 0x7F] = 1;
+    }
+}
+
+/* multiply tempos by scale */
+void Mf_TransformTempoScale(MfTransform *transform, double scale)
+{
+    transform->tempoScale *= scale;
+}
+
+/* transform a single message, returning 0 if it should be dropped */
+int Mf_TransformMessage(MfTransform *transform, PmMessage *msg)
+{
+    uint8_t status, channel, data1, data2;
+    int16_t key;
+
+    status = Pm_MessageStatus(*msg);
+    if (status < 0x80 || status >= 0xF0) return 1;
+    channel = status & 0xF;
+    data1 = Pm_MessageData1(*msg) & 0x7F;
+    data2 = Pm_MessageData2(*msg) & 0x7F;
+
+    switch (status >> 4) {
+        case MIDI_NOTE_ON:
+            data2 = transform->velocity[channel][data2];
+            /* fall through */
+        case MIDI_NOTE_OFF:
+        case MIDI_NOTE_AFTERTOUCH:
+            key = transform->key[channel][data1];
+            if (key < 0) return 0;
+            data1 = key;
+            break;
+
+        case MIDI_CONTROLLER:
+            if (transform->dropController[channel][data1]) return 0;
+            break;
+    }
+
+    *msg = Pm_Message(Pm_MessageStatusGen(status >> 4, transform->channel[channel]), data1, data2);
+    return 1;
+}
+
+/* get a tempo through the transform */
+uint32_t Mf_TransformTempo(MfTransform *transform, uint32_t tempo)
+{
+    double scaled = tempo * transform->tempoScale + 0.5;
+    if (scaled < 1) return 1;
+    if (scaled > 0xFFFFFF) return 0xFFFFFF;
+    return scaled;
+}
+
+/* transform packed messages in place */
+int Mf_TransformMessages(MfTransform *transform, PmMessage *msgs, int count)
+{
+    int i, o = 0;
+
+    for (i = 0; i < count; i++) {
+        msgs[o] = msgs[i];
+        if (Mf_TransformMessage(transform, &msgs[o])) o++;
+    }
+
+    return o;
+}
+
+/* transform events in place, freeing and removing dropped ones */
+int Mf_TransformEvents(MfTransform *transform, MfEvent **events, int *tracks, int count)
+{
+    return Mf_TransformEventsCtx(transform, NULL, events, tracks, count);
+}
+
+int Mf_TransformEventsCtx(MfTransform *transform, MfContext *ctx, MfEvent **events, int *tracks, int count)
+{
+    int i, o = 0;
+    MfEvent *event;
+
+    for (i = 0; i < count; i++) {
+        event = events[i];
+        if (event->meta) {
+            if (Mf_TransformIsTempo(event)) {
+                unsigned char *data = Mf_MetaWritableCtx(ctx, event->meta);
+                uint32_t tempo = MIDI_M_TEMPO_N(data);
+                MIDI_M_TEMPO_N_SET(data, Mf_TransformTempo(transform, tempo));
+            }
+        } else if (!Mf_TransformMessage(transform, &event->e.message)) {
+            Mf_FreeEventCtx(ctx, event);
+            continue;
+        }
+
+        events[o] = event;
+        if (tracks) tracks[o] = tracks[i];
+        o++;
+    }
+
+    return o;
+}
+
+/* transform a whole track in place */
+void Mf_TransformTrack(MfTransform *transform, MfTrack *track)
+{
+    MfEvent *event, *prev = NULL, *next;
+    uint32_t deltaTm;
+
+    /* shared patterns can't be transformed in place */
+    Mf_ExpandTrack(track);
+
+    for (event = track->head; event; event = next) {
+        next = event->next;
+        deltaTm = event->deltaTm;
+        if (Mf_TransformEventsCtx(transform, track->ctx, &event, NULL, 1)) {
+            prev = event;
+            continue;
+        }
+
+        /* it was dropped (and freed), so unlink it, keeping the time */
+        if (next) next->deltaTm += deltaTm;
+        if (prev) prev->next = next;
+        else track->head = next;
+        if (!next) track->tail = prev;
+    }
+}
+
+void Mf_TransformFile(MfTransform *transform, MfFile *file)
+{
+    MfEvent *event;
+    int i, tempoAtZero = 0;
+
+    for (i = 0; i < file->trackCt; i++) {
+        Mf_TransformTrack(transform, file->tracks[i]);
+        for (event = file->tracks[i]->head; event && event->deltaTm == 0; event = event->next) {
+            if (Mf_TransformIsTempo(event)) tempoAtZero = 1;
+        }
+    }
+
+    /* the file plays at the default tempo until it sets one, so that needs
+     * scaling too */
+    if (!tempoAtZero && file->trackCt && transform->tempoScale != 1) {
+        event = Mf_NewEventCtx(file->tracks[0]->ctx);
+        event->e.message = Pm_Message(MIDI_STATUS_META, 0, 0);
+        event->meta = Mf_NewMetaCtx(file->tracks[0]->ctx, MIDI_M_TEMPO_LENGTH);
+        event->meta->type = MIDI_M_TEMPO;
+        MIDI_M_TEMPO_N_SET(event->meta->data, Mf_TransformTempo(transform, 500000));
+        Mf_PushEventHead(file->tracks[0], event);
+    }
+}
+
+static uint8_t Mf_ClampVelocity(double velocity)
+{
+    velocity += 0.5;
+    if (velocity < 1) return 1;
+    if (velocity > 127) return 127;
+    return velocity;
+}
+
+/* is this a tempo event? */
+static int Mf_TransformIsTempo(MfEvent *event)
+{
+    return event->meta && Pm_MessageStatus(event->e.message) == MIDI_STATUS_META &&
+        event->meta->type == MIDI_M_TEMPO && event->meta->length == MIDI_M_TEMPO_LENGTH;
+}
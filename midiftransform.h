@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2011  Gregor Richards
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MIDIFTRANSFORM_H
+#define MIDIFTRANSFORM_H
+
+#include "midifile.h"
+
+/* A pipeline of transformations of channel messages and tempo. Stages apply
+ * in the order they're added, but they're fused as they're added into a
+ * single set of lookup tables, so applying any number of stages is one pass
+ * with a handful of table lookups per message. */
+
+/* types */
+typedef struct __MfTransform MfTransform;
+
+/* all channels, for stages which take a channel mask */
+#define MF_ALL_CHANNELS 0xFFFF
+
+MfTransform *Mf_NewTransform(void);
+void Mf_FreeTransform(MfTransform *transform);
+
+/* transpose notes (and polyphonic aftertouch) on these channels, dropping
+ * anything transposed out of range */
+void Mf_TransformTranspose(MfTransform *transform, uint16_t channels, int semitones);
+
+/* scale note-on velocities on these channels to velocity * scale + offset,
+ * clamped to 1-127 */
+void Mf_TransformVelocityScale(MfTransform *transform, uint16_t channels, double scale, int offset);
+
+/* map note-on velocities on these channels through a curve (curve[0] is
+ * ignored, velocity 0 is always a note off) */
+void Mf_TransformVelocityCurve(MfTransform *transform, uint16_t channels, const uint8_t *curve);
+
+/* move everything on one channel to another */
+void Mf_TransformRemapChannel(MfTransform *transform, int from, int to);
+
+/* drop a controller on these channels */
+void Mf_TransformFilterController(MfTransform *transform, uint16_t channels, int controller);
+
+/* multiply tempos (microseconds per quarter note) by scale, so e.g. 2 plays
+ * at half speed */
+void Mf_TransformTempoScale(MfTransform *transform, double scale);
+
+/* transform packed messages in place, removing dropped ones. Returns the new
+ * count. */
+int Mf_TransformMessages(MfTransform *transform, PmMessage *msgs, int count);
+
+/* transform events in place, freeing and removing dropped ones (as read from
+ * a stream). Returns the new count. The Ctx version is for events made with
+ * another context. */
+int Mf_TransformEvents(MfTransform *transform, MfEvent **events, int *tracks, int count);
+int Mf_TransformEventsCtx(MfTransform *transform, MfContext *ctx, MfEvent **events, int *tracks, int count);
+
+/* transform a whole track or file in place (expanding any patterns). When
+ * scaling tempo, a file which doesn't set its tempo at the start gets a tempo
+ * event there (in its first track), so the default tempo is scaled too. */
+void Mf_TransformTrack(MfTransform *transform, MfTrack *track);
+void Mf_TransformFile(MfTransform *transform, MfFile *file);
+
+/* transform a single message, returning 0 if it should be dropped */
+int Mf_TransformMessage(MfTransform *transform, PmMessage *msg);
+
+/* get a tempo (in microseconds per quarter note) through the transform */
+uint32_t Mf_TransformTempo(MfTransform *transform, uint32_t tempo);
+
+#endif
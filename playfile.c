@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "midifsched.h"
 #include "midifstream.h"
 
 #define PCHECK(perr) do { \
@@ -52,7 +53,9 @@
 
 MfStream *stream = NULL;
 PortMidiStream *ostream = NULL;
-int ready = 0;
+MfScheduler *sched = NULL;
+MfOptimizer *opt = NULL;
+volatile int ready = 0, done = 0;
 
 void play(PtTimestamp timestamp, void *ignore);
 
@@ -66,7 +69,7 @@ int main(int argc, char **argv)
     char *arg, *nextarg, *file;
 
     PmDeviceID dev = -1;
-    int list = 0;
+    int list = 0, stats = 0, optimize = 0;
     file = NULL;
 
     for (argi = 1; argi < argc; argi++) {
@@ -75,6 +78,10 @@ int main(int argc, char **argv)
         if (arg[0] == '-') {
             if (!strcmp(arg, "-l")) {
                 list = 1;
+            } else if (!strcmp(arg, "-s")) {
+                stats = 1;
+            } else if (!strcmp(arg, "-O")) {
+                optimize = 1;
             } else if (!strcmp(arg, "-o") && nextarg) {
                 dev = atoi(nextarg);
                 argi++;
@@ -126,35 +133,68 @@ int main(int argc, char **argv)
     PSF(perr, Mf_ReadMidiFile, (&pf, f));
     fclose(f);
 
-    /* now start running */
+    /* now start running, with SysEx fitted in around the notes */
+    sched = Mf_OpenScheduler(ostream, MF_DIN_BYTES_PER_SECOND, 0, 250);
     stream = Mf_OpenStream(pf);
+    Mf_StreamSetSysEx(stream, Mf_SchedulerSysEx, sched);
+    if (optimize) {
+        /* thin controllers to 100 a second */
+        opt = Mf_NewOptimizer(MF_OPTIMIZE_ALL, 100, MF_DIN_BYTES_PER_SECOND);
+        Mf_StreamSetOptimizer(stream, opt);
+    }
     Mf_StartStream(stream, Pt_Time());
 
     /* FIXME: I sure hope this doesn't get reordered >_> */
     ready = 1;
 
-    while (1) Pt_Sleep(1<<30);
+    /* free what's been played until it's all done */
+    while (!done) {
+        Pt_Sleep(100);
+        Mf_StreamCollect(stream);
+    }
+
+    if (stats) {
+        MfSchedulerStats st;
+        Mf_SchedulerGetStats(sched, &st);
+        fprintf(stderr, "SysEx: %u messages (%u bytes) sent, %u dropped, most queued %u bytes, longest wait %dms\n",
+            st.sentMessages, st.sentBytes, st.dropped, st.maxQueuedBytes, (int) st.maxSysExDelay);
+        fprintf(stderr, "Channel messages late: %u, at worst by %uus\n",
+            st.lateMessages, st.maxLateness);
+        if (opt) {
+            MfOptimizerStats ost;
+            Mf_OptimizerGetStats(opt, &ost);
+            fprintf(stderr, "Optimizer: %llu bytes saved of %llu, %u redundant, %u thinned, %u note-offs dropped, %u converted, added latency at worst %dms\n",
+                (unsigned long long) (ost.inBytes - ost.outBytes), (unsigned long long) ost.inBytes,
+                ost.redundant, ost.thinned, ost.noteOffs, ost.converted, (int) ost.maxAddedLatency);
+        }
+    }
+
+    Mf_FreeFile(Mf_CloseStream(stream));
+    Mf_CloseScheduler(sched);
+    if (opt) Mf_FreeOptimizer(opt);
+    Pm_Terminate();
 
     return 0;
 }
 
 void play(PtTimestamp timestamp, void *ignore)
 {
-    MfEvent *event;
-    int track;
-    PmEvent ev;
+    PmEvent events[64];
+    MfSchedulerStats st;
+    int rd;
 
-    if (!ready) return;
+    if (!ready || done) return;
 
-    while (Mf_StreamReadNormal(stream, &event, &track, 1) == 1) {
-        ev = event->e;
-        Pm_WriteShort(ostream, 0, ev.message);
-        Mf_FreeEvent(event);
+    while ((rd = Mf_StreamReadPm(stream, events, NULL, 64)) > 0) {
+        Mf_SchedulerWrite(sched, timestamp, events, rd);
     }
 
     if (Mf_StreamEmpty(stream) == TRUE) {
-        Mf_FreeFile(Mf_CloseStream(stream));
-        Pm_Terminate();
-        exit(0);
+        Mf_SchedulerRun(sched, timestamp, -1);
+        Mf_SchedulerGetStats(sched, &st);
+        if (!st.queuedMessages) done = 1;
+    } else {
+        Mf_SchedulerRun(sched, timestamp,
+            Mf_StreamGetTimestamp(stream, NULL, Mf_StreamNext(stream)));
     }
 }